@@ -1,22 +1,102 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <jansson.h>
 
+/*
+ * nicm check: count the packets, the drops (continuity errors) and the scrambled packets of each PID
+ *
+ * A file is mapped and split into chunks checked on threads. Each chunk finds the sync by itself,
+ * and the continuity counters are compared across the chunks when their results are merged in order.
+ * A pipe is read in large blocks instead.
+ * When the sync is lost, the bytes up to the next CHECK_SYNC_CONFIRM sync bytes in a row are skipped.
+ */
+
 #define TS_PACKET_SIZE 188
 #define TS_SYNC_BYTE   0x47
 #define TS_PID_COUNT   0x2000
 
-static int perform_check(FILE *input, json_t *result);
+// Sync bytes in a row to find the sync again
+#define CHECK_SYNC_CONFIRM 3
+// Packets whose headers are extracted at once
+#define CHECK_BATCH_PACKETS 64
+// Block read from a pipe
+#define CHECK_READ_SIZE (4 << 20)
+// Files are split into chunks of at least this size
+#define CHECK_MIN_CHUNK_SIZE (64L << 20)
+
+struct pid_info {
+    long total;
+    long dropped;
+    long scrambled;
+
+    // Continuity counter of the first packet with payload (-1: none yet)
+    int first_counter;
+    int next_counter;
+};
+
+struct check_state {
+    struct pid_info *pid_info;
+    // Looking for the sync
+    int lost;
+    long sync_lost;
+    long skipped_bytes;
+};
+
+struct check_chunk {
+    pthread_t thread;
+    const uint8_t *data;
+    size_t size;
+    // Packets starting in [start, end) belong to the chunk
+    size_t start, end;
+    // The first packet found, and where the packet after the last one would start
+    size_t first, next;
+    struct check_state state;
+    int started;
+};
+
+static int perform_check(int fd, int jobs, json_t *result);
 
-int do_check(const char *ts_file, const char *output_file) {
-    FILE *input, *output;
+/**
+ * @brief Check the TS packets of the file
+ *
+ * @return json_t* The result, or NULL if the file cannot be opened
+ */
+json_t *check_file(const char *ts_file) {
+    int fd = open(ts_file, O_RDONLY | O_CLOEXEC);
+    json_t *result;
+
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s for input.\n", ts_file);
+        return NULL;
+    }
+    result = json_object();
+    // nicm ingest checks files in parallel
+    perform_check(fd, 1, result);
+    close(fd);
+
+    return result;
+}
+
+/**
+ * @param jobs Threads checking a file in chunks (0: the number of CPUs)
+ */
+int do_check(const char *ts_file, const char *output_file, int jobs) {
+    FILE *output;
+    int input;
 
     if (ts_file == NULL) {
-        input = stdin;
+        input = STDIN_FILENO;
     } else {
-        input = fopen(ts_file, "rb");
-        if (!input) {
+        input = open(ts_file, O_RDONLY | O_CLOEXEC);
+        if (input < 0) {
             fprintf(stderr, "Cannot open %s for input.", ts_file);
             return 1;
         }
@@ -28,7 +108,7 @@ int do_check(const char *ts_file, const char *output_file) {
         if (!output) {
             fprintf(stderr, "Cannot open %s for input.", ts_file);
 
-            fclose(input);
+            close(input);
 
             return 1;
         }
@@ -36,7 +116,7 @@ int do_check(const char *ts_file, const char *output_file) {
 
     json_t *result = json_object();
 
-    perform_check(input, result);
+    perform_check(input, jobs, result);
 
     char *string = json_dumps(result, 0);
     fprintf(output, "%s", string);
@@ -47,52 +127,311 @@ int do_check(const char *ts_file, const char *output_file) {
     return 0;
 }
 
-struct pid_info {
-    int total;
-    int dropped;
-    int scrambled;
+static void __init_state(struct check_state *state) {
+    int i;
 
-    int next_counter;
-};
+    memset(state, 0, sizeof(*state));
+    state->pid_info = calloc(TS_PID_COUNT, sizeof(struct pid_info));
+    for (i = 0; i < TS_PID_COUNT; i++) {
+        state->pid_info[i].first_counter = -1;
+    }
+}
 
-static int perform_check(FILE *input, json_t *result) {
-    uint8_t packet[TS_PACKET_SIZE];
-    struct pid_info pid_info[TS_PID_COUNT] = {};
+static inline void __count_packet(struct pid_info *pid_info, uint32_t header) {
+    struct pid_info *pinfo = pid_info + ((header >> 8) & 0x1fff);
 
-    int error_packet = 0;
+    pinfo->total++;
 
-    while (fread(packet, 1, TS_PACKET_SIZE, input) == TS_PACKET_SIZE) {
-        if (packet[0] != TS_SYNC_BYTE) {
-            error_packet++;
-            continue;
+    if (header & 0x10) { // has payload
+        int continuity_counter = (header & 0x0f);
+        if (pinfo->first_counter < 0) {
+            pinfo->first_counter = continuity_counter;
+        } else if ((pinfo->next_counter & 0x0f) != continuity_counter) {
+            pinfo->dropped++;
         }
-        int pid = (((int)packet[1] & 0x1f) << 8) | packet[2];
 
-        if (pid < 0 || pid > 0x1fff) {
-            fprintf(stderr, "Error: error in the logic.\n");
-            continue;
+        pinfo->next_counter = continuity_counter + 1;
+    }
+
+    if (header & 0xc0) {
+        pinfo->scrambled++;
+    }
+}
+
+/**
+ * @brief Find the next position before end with CHECK_SYNC_CONFIRM sync bytes in a row
+ *
+ * @param final No more data follows, so fewer sync bytes are enough at the end
+ * @param more Set if more data is needed to tell about the returned position
+ * @return size_t The position, or end if none
+ */
+static size_t __find_sync(const uint8_t *data, size_t pos, size_t end, size_t size, int final, int *more) {
+    const uint8_t *p;
+
+    *more = 0;
+    while (pos < end && (p = memchr(data + pos, TS_SYNC_BYTE, end - pos)) != NULL) {
+        size_t candidate = p - data;
+        int k;
+
+        for (k = 1; k < CHECK_SYNC_CONFIRM; k++) {
+            size_t next = candidate + (size_t)k * TS_PACKET_SIZE;
+
+            if (next >= size) {
+                *more = !final;
+                return candidate;
+            }
+            if (data[next] != TS_SYNC_BYTE) {
+                break;
+            }
+        }
+        if (k == CHECK_SYNC_CONFIRM) {
+            return candidate;
         }
+        pos = candidate + 1;
+    }
+
+    return end;
+}
 
-        pid_info[pid].total++;
+/**
+ * @brief Count the packets starting before the limit
+ *
+ * The headers of a batch of packets are extracted first in a tight loop, which the compiler unrolls,
+ * and then counted. A batch stops at a packet without the sync byte.
+ *
+ * @param final No more data follows the buffer
+ * @return size_t Bytes consumed. The rest is to be given again with the following data.
+ */
+static size_t __scan(const uint8_t *data, size_t size, size_t limit, int final, struct check_state *state) {
+    uint32_t headers[CHECK_BATCH_PACKETS];
+    size_t pos = 0;
 
-        if (packet[3] & 0x10) { // has payload
-            int continuity_counter = (packet[3] & 0x0f);
-            if (pid_info[pid].next_counter != 0 && 
-                (pid_info[pid].next_counter & 0x0f) != continuity_counter) {
-                pid_info[pid].dropped++;
+    while (pos < limit) {
+        if (state->lost) {
+            int more;
+            size_t found = __find_sync(data, pos, limit < size ? limit : size, size, final, &more);
+
+            state->skipped_bytes += found - pos;
+            pos = found;
+            if (more) {
+                return pos;
+            }
+            if (pos >= limit || pos >= size) {
+                break;
             }
+            state->lost = 0;
+        }
 
-            pid_info[pid].next_counter = continuity_counter + 1;
+        size_t n = (size - pos) / TS_PACKET_SIZE, i;
+        if (n > CHECK_BATCH_PACKETS) {
+            n = CHECK_BATCH_PACKETS;
         }
+        if (n > (limit - pos + TS_PACKET_SIZE - 1) / TS_PACKET_SIZE) {
+            n = (limit - pos + TS_PACKET_SIZE - 1) / TS_PACKET_SIZE;
+        }
+        if (n == 0) {
+            if (!final) {
+                return pos;
+            }
+            // A packet cut at the end of the file
+            state->skipped_bytes += size - pos;
+            return size;
+        }
+
+        for (i = 0; i < n; i++) {
+            const uint8_t *p = data + pos + i * TS_PACKET_SIZE;
 
-        if (packet[3] & 0xc0) {
-            pid_info[pid].scrambled++;
+            headers[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+        }
+        for (i = 0; i < n; i++) {
+            if ((headers[i] >> 24) != TS_SYNC_BYTE) {
+                break;
+            }
+            __count_packet(state->pid_info, headers[i]);
+        }
+        pos += i * TS_PACKET_SIZE;
+        if (i < n) {
+            state->lost = 1;
+            state->sync_lost++;
         }
     }
 
+    return pos;
+}
+
+/**
+ * @brief Check a pipe in blocks
+ */
+static int __check_stream(int fd, struct check_state *state) {
+    uint8_t *buf = malloc(CHECK_READ_SIZE);
+    size_t size = 0;
+    ssize_t ret;
+
+    for (;;) {
+        ret = read(fd, buf + size, CHECK_READ_SIZE - size);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: read failed: %s\n", strerror(errno));
+            break;
+        }
+        size += ret;
+
+        size_t consumed = __scan(buf, size, size, ret == 0, state);
+
+        if (ret == 0) {
+            break;
+        }
+        memmove(buf, buf + consumed, size - consumed);
+        size -= consumed;
+    }
+    free(buf);
+
+    return ret < 0 ? -1 : 0;
+}
+
+static void *__chunk_worker(void *arg) {
+    struct check_chunk *chunk = arg;
+    int more;
+
+    // The sync of a chunk is found without counting it as lost, and the seam is checked in the merge
+    chunk->first = chunk->start;
+    if (chunk->start > 0) {
+        chunk->first = __find_sync(chunk->data, chunk->start, chunk->end, chunk->size, 1, &more);
+        if (chunk->first >= chunk->end) {
+            chunk->next = chunk->end;
+            chunk->state.lost = 1;
+            return NULL;
+        }
+    }
+    chunk->next = chunk->first + __scan(chunk->data + chunk->first, chunk->size - chunk->first,
+        chunk->end - chunk->first, 1, &chunk->state);
+
+    return NULL;
+}
+
+/**
+ * @brief Add the counts of the following chunk, comparing the continuity counters at the seam
+ */
+static void __merge_state(struct check_state *state, const struct check_state *following) {
+    int i;
+
+    for (i = 0; i < TS_PID_COUNT; i++) {
+        struct pid_info *a = state->pid_info + i;
+        const struct pid_info *b = following->pid_info + i;
+
+        a->total += b->total;
+        a->dropped += b->dropped;
+        a->scrambled += b->scrambled;
+        if (b->first_counter >= 0) {
+            if (a->first_counter < 0) {
+                a->first_counter = b->first_counter;
+            } else if ((a->next_counter & 0x0f) != b->first_counter) {
+                a->dropped++;
+            }
+            a->next_counter = b->next_counter;
+        }
+    }
+    state->sync_lost += following->sync_lost;
+    state->skipped_bytes += following->skipped_bytes;
+}
+
+/**
+ * @brief Check a mapped file in chunks on threads
+ */
+static int __check_mapped(const uint8_t *data, size_t size, int jobs, struct check_state *state) {
+    struct check_chunk *chunks;
+    int i;
+
+    if (jobs <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        jobs = cpus > 0 ? cpus : 1;
+    }
+    if (size / jobs < CHECK_MIN_CHUNK_SIZE) {
+        jobs = size / CHECK_MIN_CHUNK_SIZE > 0 ? size / CHECK_MIN_CHUNK_SIZE : 1;
+    }
+
+    chunks = calloc(jobs, sizeof(*chunks));
+    for (i = 0; i < jobs; i++) {
+        chunks[i].data = data;
+        chunks[i].size = size;
+        chunks[i].start = size * i / jobs / TS_PACKET_SIZE * TS_PACKET_SIZE;
+        chunks[i].end = i + 1 < jobs ? size * (i + 1) / jobs / TS_PACKET_SIZE * TS_PACKET_SIZE : size;
+        __init_state(&chunks[i].state);
+    }
+
+    for (i = 1; i < jobs; i++) {
+        chunks[i].started = pthread_create(&chunks[i].thread, NULL, __chunk_worker, chunks + i) == 0;
+    }
+    __chunk_worker(chunks);
+    for (i = 1; i < jobs; i++) {
+        if (chunks[i].started) {
+            pthread_join(chunks[i].thread, NULL);
+        } else {
+            __chunk_worker(chunks + i);
+        }
+    }
+
+    *state = chunks[0].state;
+    for (i = 1; i < jobs; i++) {
+        const struct check_chunk *prev = chunks + i - 1, *chunk = chunks + i;
+
+        if (prev->state.lost) {
+            // Still looking for the sync at the end of the previous chunk
+            state->skipped_bytes += chunk->first - chunk->start;
+        } else if (prev->next < chunk->first) {
+            // The sync was lost at the seam. Scan the gap as a single scan would.
+            struct check_state seam;
+            size_t consumed;
+
+            __init_state(&seam);
+            consumed = __scan(data + prev->next, size - prev->next, chunk->first - prev->next, 1, &seam);
+            if (!seam.lost && prev->next + consumed != chunk->first) {
+                seam.sync_lost++;
+            }
+            __merge_state(state, &seam);
+            free(seam.pid_info);
+        } else if (prev->next > chunk->first) {
+            state->sync_lost++;
+        }
+        __merge_state(state, &chunk->state);
+        free(chunk->state.pid_info);
+    }
+    free(chunks);
+
+    return 0;
+}
+
+static int perform_check(int fd, int jobs, json_t *result) {
+    struct check_state state;
+    struct stat st;
+    int ret;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            ret = __check_mapped(map, st.st_size, jobs, &state);
+            munmap(map, st.st_size);
+        } else {
+            __init_state(&state);
+            ret = __check_stream(fd, &state);
+        }
+    } else {
+        __init_state(&state);
+        ret = __check_stream(fd, &state);
+    }
+
+    if (state.sync_lost > 0) {
+        fprintf(stderr, "Lost the sync %ld times (%ld bytes skipped).\n", state.sync_lost, state.skipped_bytes);
+    }
+
     int i;
     for (i = 0; i < TS_PID_COUNT; i++) {
-        const struct pid_info *pinfo = pid_info + i;
+        const struct pid_info *pinfo = state.pid_info + i;
         char num[16];
 
         if (pinfo->total > 0) {
@@ -105,6 +444,7 @@ static int perform_check(FILE *input, json_t *result) {
             json_object_set_new(result, num, info);
         }
     }
+    free(state.pid_info);
 
-    return 0;
-}
\ No newline at end of file
+    return ret;
+}
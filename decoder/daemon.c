@@ -0,0 +1,467 @@
+#define _GNU_SOURCE // accept4()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "lib/encoder_pool.h"
+#include "lib/pool.h"
+#include "lib/trace.h"
+#include "serve.h"
+
+/*
+ * nicm daemon: serve many inputs to many clients in one process
+ *
+ * A client connects to the Unix socket and sends NICM_SERVE_COMMAND_OPEN followed by the path.
+ * Then the connection speaks the protocol version 2 of nicm serve for the input.
+ * Connections to the same file and stream share the input, which is closed when the last one leaves.
+ * All the inputs share the encoder workers, and the memory budget is split evenly among them.
+ * On SIGINT or SIGTERM, the connections are shut down and the inputs are closed before exiting.
+ */
+
+#define DEFAULT_DAEMON_CACHE_SIZE (1UL << 30) // 1 GB
+// Wait before accepting again when out of file descriptors or memory
+#define ACCEPT_BACKOFF_MS 100
+
+struct daemon_input {
+    // Resolved by realpath()
+    char *path;
+    int stream;
+    // Connections using the input
+    int refs;
+    // NULL while opening
+    struct serve_context *ctx;
+    struct daemon_input *next;
+};
+
+struct daemon_connection;
+
+struct nicm_daemon {
+    struct file_open_options *opts;
+    struct encoder_pool encoder_pool;
+    size_t cache_size;
+
+    pthread_mutex_t mutex;
+    // Held while resizing the inputs, so that an older split is not applied after a newer one
+    pthread_mutex_t rebalance_mutex;
+    // Signaled when an input finished opening
+    pthread_cond_t cond;
+    struct daemon_input *inputs;
+    int num_inputs;
+    struct daemon_connection *connections;
+};
+
+struct daemon_connection {
+    struct nicm_daemon *daemon;
+    pthread_t thread;
+    // -1 once closed by the worker, since the number may be reused
+    int fd;
+    // The worker is exiting and can be joined
+    int finished;
+    struct daemon_connection *next;
+};
+
+static volatile sig_atomic_t daemon_quit = 0;
+
+static void __signal_handler(int sig) {
+    (void)sig;
+    daemon_quit = 1;
+}
+
+static void __release_input(struct nicm_daemon *daemon, struct daemon_input *input);
+
+/**
+ * @brief Split the memory budget among the inputs. The caller must not hold daemon->mutex.
+ *
+ * Resizing an input waits for its requests, so the inputs are resized without daemon->mutex.
+ * They are referenced meanwhile, so none is closed under us.
+ */
+static void __rebalance(struct nicm_daemon *daemon) {
+    struct daemon_input *input, **inputs;
+    size_t cache_size;
+    int i, num = 0;
+
+    pthread_mutex_lock(&daemon->rebalance_mutex);
+    pthread_mutex_lock(&daemon->mutex);
+    if (daemon->num_inputs == 0) {
+        pthread_mutex_unlock(&daemon->mutex);
+        pthread_mutex_unlock(&daemon->rebalance_mutex);
+        return;
+    }
+    cache_size = daemon->cache_size / daemon->num_inputs;
+    inputs = malloc(sizeof(struct daemon_input *) * daemon->num_inputs);
+    for (input = daemon->inputs; input && inputs; input = input->next) {
+        if (input->ctx) {
+            input->refs++;
+            inputs[num++] = input;
+        }
+    }
+    pthread_mutex_unlock(&daemon->mutex);
+
+    for (i = 0; i < num; i++) {
+        resize_serve_cache(inputs[i]->ctx, cache_size);
+    }
+    fprintf(stderr, "[daemon] %d inputs, %lu bytes of cache each\n", num, cache_size);
+    pthread_mutex_unlock(&daemon->rebalance_mutex);
+
+    // It may be the last reference, which rebalances again
+    for (i = 0; i < num; i++) {
+        __release_input(daemon, inputs[i]);
+    }
+    free(inputs);
+}
+
+static void __unlink_input(struct nicm_daemon *daemon, struct daemon_input *input) {
+    struct daemon_input **p;
+
+    for (p = &daemon->inputs; *p; p = &(*p)->next) {
+        if (*p == input) {
+            *p = input->next;
+            daemon->num_inputs--;
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Get the input of the file and the stream, opening it if nobody has
+ *
+ * The input is opened without the lock, so the other connections are not blocked by probing.
+ *
+ * @return struct daemon_input* NULL if the input cannot be opened
+ */
+static struct daemon_input *__acquire_input(struct nicm_daemon *daemon, const char *path, int stream) {
+    struct daemon_input *input;
+    struct serve_context *ctx;
+    size_t cache_size;
+    int ret;
+
+    pthread_mutex_lock(&daemon->mutex);
+    for (;;) {
+        for (input = daemon->inputs; input; input = input->next) {
+            if (input->stream == stream && !strcmp(input->path, path)) {
+                break;
+            }
+        }
+        if (!input || input->ctx) {
+            break;
+        }
+        // Being opened by another connection
+        pthread_cond_wait(&daemon->cond, &daemon->mutex);
+    }
+    if (input) {
+        input->refs++;
+        pthread_mutex_unlock(&daemon->mutex);
+        return input;
+    }
+
+    input = calloc(1, sizeof(struct daemon_input));
+    input->path = strdup(path);
+    input->stream = stream;
+    input->refs = 1;
+    input->next = daemon->inputs;
+    daemon->inputs = input;
+    daemon->num_inputs++;
+    cache_size = daemon->cache_size / daemon->num_inputs;
+    pthread_mutex_unlock(&daemon->mutex);
+
+    fprintf(stderr, "[daemon] Opening %s (stream %d)\n", path, stream);
+    ret = open_serve_context(&ctx, path, stream, daemon->opts, &daemon->encoder_pool, cache_size);
+
+    pthread_mutex_lock(&daemon->mutex);
+    if (ret != 0) {
+        fprintf(stderr, "[daemon] Failed to open %s (%d)\n", path, ret);
+        __unlink_input(daemon, input);
+        free(input->path);
+        free(input);
+        input = NULL;
+    } else {
+        input->ctx = ctx;
+    }
+    pthread_cond_broadcast(&daemon->cond);
+    pthread_mutex_unlock(&daemon->mutex);
+
+    __rebalance(daemon);
+
+    return input;
+}
+
+static void __release_input(struct nicm_daemon *daemon, struct daemon_input *input) {
+    int last;
+
+    pthread_mutex_lock(&daemon->mutex);
+    last = --input->refs == 0;
+    if (last) {
+        __unlink_input(daemon, input);
+    }
+    pthread_mutex_unlock(&daemon->mutex);
+
+    if (!last) {
+        return;
+    }
+
+    fprintf(stderr, "[daemon] Closing %s (stream %d)\n", input->path, input->stream);
+    close_serve_context(input->ctx);
+    free(input->path);
+    free(input);
+
+    // Give the memory to the others after it is freed
+    __rebalance(daemon);
+}
+
+/**
+ * @brief Tell the accept loop that the connection is over. Called before closing the socket.
+ */
+static void __finish_connection(struct daemon_connection *conn) {
+    pthread_mutex_lock(&conn->daemon->mutex);
+    conn->fd = -1;
+    conn->finished = 1;
+    pthread_mutex_unlock(&conn->daemon->mutex);
+}
+
+/**
+ * @brief Join the workers of the connections that are over
+ *
+ * @param all Shut down the connections still open and join them as well
+ */
+static void __reap_connections(struct nicm_daemon *daemon, int all) {
+    struct daemon_connection **p, *conn, *reaped = NULL;
+
+    pthread_mutex_lock(&daemon->mutex);
+    for (p = &daemon->connections; (conn = *p) != NULL; ) {
+        if (!conn->finished && !all) {
+            p = &conn->next;
+            continue;
+        }
+        if (conn->fd >= 0) {
+            // Ends serve_session() as if the client left
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+        *p = conn->next;
+        conn->next = reaped;
+        reaped = conn;
+    }
+    pthread_mutex_unlock(&daemon->mutex);
+
+    while ((conn = reaped) != NULL) {
+        reaped = conn->next;
+        pthread_join(conn->thread, NULL);
+        free(conn);
+    }
+}
+
+/**
+ * @brief Open the input requested by the client and serve it until the client quits
+ */
+static void *__connection_worker(void *arg) {
+    struct daemon_connection *conn = arg;
+    struct nicm_daemon *daemon = conn->daemon;
+    struct nicm_serve_command_v2 cmd;
+    struct serve_session session;
+    struct daemon_input *input = NULL;
+    char *path = NULL, *resolved = NULL;
+    FILE *in = NULL, *out = NULL;
+    long code = 0;
+    int in_fd = conn->fd, out_fd = dup(in_fd);
+
+    trace_thread_name("connection");
+    if (out_fd < 0 || (in = fdopen(in_fd, "r")) == NULL || (out = fdopen(out_fd, "w")) == NULL) {
+        fprintf(stderr, "[daemon] Failed to set up a connection\n");
+        __finish_connection(conn);
+        if (in) {
+            fclose(in);
+        } else {
+            close(in_fd);
+        }
+        if (out_fd >= 0) {
+            close(out_fd);
+        }
+        return NULL;
+    }
+    init_serve_session(&session, out, 2);
+
+    if (fread(&cmd, sizeof(cmd), 1, in) != 1) {
+        goto done;
+    }
+    if (cmd.command != NICM_SERVE_COMMAND_OPEN || cmd.args[1] <= 0 || cmd.args[1] >= PATH_MAX) {
+        code = 400;
+    } else {
+        path = malloc(cmd.args[1] + 1);
+        if (fread(path, 1, cmd.args[1], in) != (size_t)cmd.args[1]) {
+            goto done;
+        }
+        path[cmd.args[1]] = '\0';
+
+        // Connections to the same file share the input
+        if ((resolved = realpath(path, NULL)) == NULL) {
+            fprintf(stderr, "[daemon] Cannot resolve %s: %s\n", path, strerror(errno));
+            code = 404;
+        } else if ((input = __acquire_input(daemon, resolved, cmd.args[0] >= 0 ? (int)cmd.args[0] : -1)) == NULL) {
+            code = 404;
+        }
+    }
+
+    if (send_response(&session, cmd.id, code, 0, NULL) == 0 && input) {
+        serve_session(input->ctx, &session, in);
+    }
+    if (input) {
+        __release_input(daemon, input);
+    }
+
+done:
+    __finish_connection(conn);
+    destroy_serve_session(&session);
+    fclose(in);
+    fclose(out);
+    free(path);
+    free(resolved);
+
+    return NULL;
+}
+
+/**
+ * @brief Create the listening socket. A stale socket file is replaced, but a live daemon is not.
+ *
+ * @return int The socket, or negative on error
+ */
+static int __listen_socket(const char *socket_path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: The socket path is too long.\n");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        fprintf(stderr, "Error: socket() failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "Error: Another daemon is listening on %s.\n", socket_path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    unlink(socket_path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        fprintf(stderr, "Error: socket() failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Error: Cannot listen on %s: %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int do_daemon(const char *socket_path, struct file_open_options *opts) {
+    struct nicm_daemon daemon;
+    struct sigaction sa;
+    sigset_t signals;
+    int listen_fd;
+
+    memset(&daemon, 0, sizeof(daemon));
+    daemon.opts = opts;
+    daemon.cache_size = opts->cache_size > 0 ? (size_t)opts->cache_size : DEFAULT_DAEMON_CACHE_SIZE;
+    pthread_mutex_init(&daemon.mutex, NULL);
+    pthread_mutex_init(&daemon.rebalance_mutex, NULL);
+    pthread_cond_init(&daemon.cond, NULL);
+
+    // Clients may leave at any time
+    signal(SIGPIPE, SIG_IGN);
+
+    // Interrupt accept() to quit
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = __signal_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // Only this thread takes them, so that accept() is the one interrupted
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if ((listen_fd = __listen_socket(socket_path)) < 0) {
+        return 1;
+    }
+
+    // Encoders and scalers are created by each worker
+    if (init_encoder_pool(&daemon.encoder_pool, opts->encoder_threads) != 0) {
+        fprintf(stderr, "Failed to start the encoder workers.\n");
+        close(listen_fd);
+        unlink(socket_path);
+        return 1;
+    }
+
+    fprintf(stderr, "[daemon] Listening on %s (cache: %lu bytes)\n", socket_path, daemon.cache_size);
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+    while (!daemon_quit) {
+        struct daemon_connection *conn;
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC), error = errno;
+
+        __reap_connections(&daemon, 0);
+        if (fd < 0) {
+            if (error != EINTR && error != ECONNABORTED) {
+                fprintf(stderr, "[daemon] accept() failed: %s\n", strerror(error));
+            }
+            if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM) {
+                // Retrying at once fails the same until a connection leaves
+                poll(NULL, 0, ACCEPT_BACKOFF_MS);
+            }
+            continue;
+        }
+
+        if ((conn = calloc(1, sizeof(struct daemon_connection))) == NULL) {
+            fprintf(stderr, "[daemon] Failed to allocate a connection\n");
+            close(fd);
+            continue;
+        }
+        conn->daemon = &daemon;
+        conn->fd = fd;
+
+        // Listed before the worker starts, so it is found when it finishes. The worker inherits the blocked signals.
+        pthread_mutex_lock(&daemon.mutex);
+        conn->next = daemon.connections;
+        daemon.connections = conn;
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+        if (pthread_create(&conn->thread, NULL, __connection_worker, conn) != 0) {
+            fprintf(stderr, "[daemon] Failed to start a connection thread\n");
+            daemon.connections = conn->next;
+            close(fd);
+            free(conn);
+        }
+        pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+        pthread_mutex_unlock(&daemon.mutex);
+    }
+
+    fprintf(stderr, "[daemon] Quitting...\n");
+    close(listen_fd);
+    unlink(socket_path);
+
+    // The last connection of each input closes it, which saves its sidecars
+    __reap_connections(&daemon, 1);
+    destroy_encoder_pool(&daemon.encoder_pool);
+
+    print_pool_stats(stderr);
+    if (opts->trace_file) {
+        write_trace(opts->trace_file);
+    }
+    pthread_cond_destroy(&daemon.cond);
+    pthread_mutex_destroy(&daemon.rebalance_mutex);
+    pthread_mutex_destroy(&daemon.mutex);
+
+    return 0;
+}
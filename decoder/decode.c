@@ -1,10 +1,13 @@
 #include "nicm.h"
 #include "lib/helper.h"
+#include "lib/probecache.h"
+#include "lib/pool.h"
+#include "lib/frameindex.h"
 #include <libswresample/swresample.h>
 #include <jansson.h>
 
-int decode_stream_video(AVFormatContext *format, AVStream *stream, AVCodecContext *codec, FILE *output, const long *points, struct file_open_options *opts);
-int decode_stream_audio(AVFormatContext *format, AVStream *stream, AVCodecContext *codec, FILE *output, const long *points, json_t *data_info, struct file_open_options *opts);
+int decode_stream_video(AVFormatContext *format, AVStream *stream, AVCodecContext *codec, FILE *output, const long *points, const struct frame_index *frame_index);
+int decode_stream_audio(AVFormatContext *format, AVStream *stream, AVCodecContext *codec, FILE *output, const long *points, json_t *data_info, const struct frame_index *frame_index);
 
 int do_decode(const char *ts_file, const int stream, const enum NICM_STREAM_TYPE stream_type, const char *output_file, const long *points, const char *info_file, struct file_open_options *opts) {
     AVFormatContext *avf_context = NULL;
@@ -13,19 +16,11 @@ int do_decode(const char *ts_file, const int stream, const enum NICM_STREAM_TYPE
     AVStream *avs = NULL;
     enum AVMediaType type;
 
-    ret = open_file_with_opts(ts_file, &avf_context, opts);
+    ret = open_probed_file(ts_file, &avf_context, opts);
     if (ret < 0) {
-        fprintf(stderr, "Error: avformat_open_input returned %d\n", ret);
         return 10;
     }
 
-    ret = avformat_find_stream_info(avf_context, NULL);
-    if (ret < 0) {
-        fprintf(stderr, "Error: avformat_find_stream_info returned %d\n", ret);
-        avformat_close_input(&avf_context);
-        return 11;
-    }
-
     if (stream >= 0) {
         if ((unsigned int)stream < avf_context->nb_streams) {
             avs = avf_context->streams[stream];
@@ -94,19 +89,27 @@ int do_decode(const char *ts_file, const int stream, const enum NICM_STREAM_TYPE
 
     fprintf(stderr, "Decoding stream #%d (type = %d)\n", avs->index, type);
 
-    AVCodecContext *avcc = open_decoder_for_stream(avs);
+    AVCodecContext *avcc = open_decoder_for_stream(avs, opts, THREAD_TYPE_FRAME);
     if (!avcc) {
         fprintf(stderr, "Stream error: Failed to open the decoder for the stream");
         avformat_close_input(&avf_context);
         return 15;
     }
 
+    struct frame_index index = {};
+    if (opts->seek_by_byte && load_frame_index(&index, ts_file, avf_context, avs, avcc, opts) != 0) {
+        fprintf(stderr, "Failed to create indices.\n");
+        avcodec_free_context(&avcc);
+        avformat_close_input(&avf_context);
+        return 16;
+    }
+
     if (type == AVMEDIA_TYPE_VIDEO) {
-        ret = decode_stream_video(avf_context, avs, avcc, fp_output, points, opts);
+        ret = decode_stream_video(avf_context, avs, avcc, fp_output, points, opts->seek_by_byte ? &index : NULL);
     } else {
         json_t *data_info = json_array();
 
-        ret = decode_stream_audio(avf_context, avs, avcc, fp_output, points, data_info, opts);
+        ret = decode_stream_audio(avf_context, avs, avcc, fp_output, points, data_info, opts->seek_by_byte ? &index : NULL);
 
         char *str = json_dumps(data_info, 0);
         fprintf(fp_info, "%s", str);
@@ -116,6 +119,7 @@ int do_decode(const char *ts_file, const int stream, const enum NICM_STREAM_TYPE
     }
 
     fclose(fp_output);
+    release_frame_index(&index);
 
     avcodec_close(avcc);
     avcodec_free_context(&avcc);
@@ -124,37 +128,54 @@ int do_decode(const char *ts_file, const int stream, const enum NICM_STREAM_TYPE
     return ret;
 }
 
+/**
+ * @brief Get the next frame of the stream
+ *
+ * The frames already decoded are returned first, as a packet may give more than one frame.
+ * At the end of the file the decoder is drained, so the frames held for the threads and
+ * the reordering are returned before AVERROR_EOF.
+ */
 static int decode_common(AVFormatContext *format, AVStream *stream, AVCodecContext *codec, AVFrame *frame) {
-    AVPacket *packet = av_packet_alloc();
+    AVPacket *packet = pool_get_packet();
     int ret;
 
-    while ((ret = av_read_frame(format, packet)) == 0) {
+    for (;;) {
+        ret = avcodec_receive_frame(codec, frame);
+        if (ret != AVERROR(EAGAIN)) {
+            if (ret != 0 && ret != AVERROR_EOF) {
+                fprintf(stderr, "avcodec_receive_frame() = %d\n", ret);
+            }
+            break;
+        }
+
+        ret = av_read_frame(format, packet);
+        if (ret == AVERROR_EOF) {
+            // Drain once. Then avcodec_receive_frame() returns AVERROR_EOF after the last frame.
+            if ((ret = avcodec_send_packet(codec, NULL)) != 0 && ret != AVERROR_EOF) {
+                break;
+            }
+            continue;
+        } else if (ret != 0) {
+            break;
+        }
         if (packet->stream_index != stream->index || (packet->flags & AV_PKT_FLAG_CORRUPT)) {
             av_packet_unref(packet);
             continue;
         }
 
-        ret = avcodec_send_packet(codec, packet);
+        avcodec_send_packet(codec, packet);
         av_packet_unref(packet);
-
-        if (ret == 0) {
-            ret = avcodec_receive_frame(codec, frame);
-            if (ret == 0) {
-                break;
-            } else if (ret != AVERROR(EAGAIN)) {
-                fprintf(stderr, "avcodec_receive_frame() = %d\n", ret);
-                break;
-            }
-        }
     }
 
-    av_packet_free(&packet);
+    pool_put_packet(&packet);
 
     return ret;
 }
 
-
-int decode_stream_video(AVFormatContext *format, AVStream *stream, AVCodecContext *codec, FILE *output, const long *points, struct file_open_options *opts) {
+/**
+ * @param index Frame index to seek by byte (NULL: seek by PTS)
+ */
+int decode_stream_video(AVFormatContext *format, AVStream *stream, AVCodecContext *codec, FILE *output, const long *points, const struct frame_index *frame_index) {
     int ret;
     AVFrame *frame = av_frame_alloc();
     int frames = 0;
@@ -163,8 +184,8 @@ int decode_stream_video(AVFormatContext *format, AVStream *stream, AVCodecContex
     // CFR
     const AVRational frame_rate = stream->r_frame_rate;
     const int time_per_frame = frame_rate.den * stream->time_base.den / frame_rate.num / stream->time_base.num;
-    struct video_stream_frame_index *indices = NULL;
-    int frames_in_indices = 0;
+    struct video_stream_frame_index *indices = frame_index ? frame_index->entries : NULL;
+    int frames_in_indices = frame_index ? frame_index->num_entries : 0;
 
     if (stream->codecpar->format != AV_PIX_FMT_YUV420P) {
         fprintf(stderr, "Error: Pixel format unknown: %d\n", stream->codecpar->format);
@@ -173,10 +194,6 @@ int decode_stream_video(AVFormatContext *format, AVStream *stream, AVCodecContex
         goto fin;
     }
 
-    if (opts->seek_by_byte) {
-        indices = build_index_stream(format, stream, codec, &frames_in_indices);
-    }
-
     fprintf(output, "YUV4MPEG2 W%d H%d F%d:%d It A%d:%d C420\n",
         stream->codecpar->width, stream->codecpar->height, frame_rate.num, frame_rate.den,
         stream->codecpar->sample_aspect_ratio.num, stream->codecpar->sample_aspect_ratio.den);
@@ -235,9 +252,9 @@ int decode_stream_video(AVFormatContext *format, AVStream *stream, AVCodecContex
 
 fin:
     av_frame_free(&frame);
-    free(indices);
 
     fprintf(stderr, "Processed %d frames\n", frames);
+    print_pool_stats(stderr);
 
     return 0;
 }
@@ -266,7 +283,10 @@ static void append_segment_info(json_t *data_info, unsigned long start, unsigned
     json_array_append_new(data_info, segment);
 }
 
-int decode_stream_audio(AVFormatContext *format, AVStream *stream, AVCodecContext *codec, FILE *output, const long *points, json_t *data_info, struct file_open_options *opts) {
+/**
+ * @param index Frame index to seek by byte (NULL: seek by PTS)
+ */
+int decode_stream_audio(AVFormatContext *format, AVStream *stream, AVCodecContext *codec, FILE *output, const long *points, json_t *data_info, const struct frame_index *frame_index) {
     int ret;
     AVFrame *frame = av_frame_alloc();
     int frames = 0, last_frames = 0;
@@ -275,6 +295,7 @@ int decode_stream_audio(AVFormatContext *format, AVStream *stream, AVCodecContex
     const int DELTA = stream->time_base.den * 1 / stream->time_base.num;
 
     struct SwrContext *swr_context;
+    struct scratch_buffer output_buffer = {};
 
     AVChannelLayout output_channel_layout = {};
     int output_channels;
@@ -284,8 +305,8 @@ int decode_stream_audio(AVFormatContext *format, AVStream *stream, AVCodecContex
 
     unsigned long prev_samples_start = 0;
 
-    struct video_stream_frame_index *indices = NULL;
-    int frames_in_indices = 0;
+    struct video_stream_frame_index *indices = frame_index ? frame_index->entries : NULL;
+    int frames_in_indices = frame_index ? frame_index->num_entries : 0;
 
     output_channels = stream->codecpar->ch_layout.nb_channels;
 
@@ -304,10 +325,6 @@ int decode_stream_audio(AVFormatContext *format, AVStream *stream, AVCodecContex
         goto fin;
     }
 
-    if (opts->seek_by_byte) {
-        indices = build_index_stream(format, stream, codec, &frames_in_indices);
-    }
-
     unsigned long output_in_pts = 0;
 
     do {
@@ -431,6 +448,7 @@ int decode_stream_audio(AVFormatContext *format, AVStream *stream, AVCodecContex
             }
 
             int output_samples = av_rescale_rnd(sample_end - sample_start, frame->sample_rate, output_sample_rate, AV_ROUND_UP);
+            int output_size = av_samples_get_buffer_size(NULL, output_channels, output_samples, output_format, 1);
             uint8_t *output_data;
             const uint8_t *input[8] = {};
 
@@ -438,7 +456,8 @@ int decode_stream_audio(AVFormatContext *format, AVStream *stream, AVCodecContex
                 input[ch] = (uint8_t *)((float *)(frame->data[ch]) + sample_start);
             }
 
-            if ((ret = av_samples_alloc(&output_data, NULL, output_channels, output_samples, output_format, 1)) < 0) {
+            if (output_size < 0 || (output_data = reserve_scratch_buffer(&output_buffer, output_size)) == NULL) {
+                ret = output_size < 0 ? output_size : AVERROR(ENOMEM);
                 fprintf(stderr, "Original buffer: %d / PTS : %ld\n", frame->nb_samples, frame->pts);
                 fprintf(stderr, "Failed to allocate output sample (%d samples) (%d)\n", output_samples, ret);
 
@@ -478,7 +497,6 @@ int decode_stream_audio(AVFormatContext *format, AVStream *stream, AVCodecContex
 
             decoded_pts = frame->pts + duration;
 
-            av_freep(&output_data);
             av_frame_unref(frame);
             frames++;
 
@@ -512,14 +530,15 @@ int decode_stream_audio(AVFormatContext *format, AVStream *stream, AVCodecContex
 fin:
     swr_free(&swr_context);
     av_frame_free(&frame);
+    free_scratch_buffer(&output_buffer);
 
     fprintf(stderr, "Processed %d frames and wrote %ld samples\n", frames, samples);
+    print_pool_stats(stderr);
 
     append_segment_info(data_info, prev_samples_start, samples, output_channels, &output_channel_layout, output_sample_rate, "S16", frames - last_frames);
 
     av_channel_layout_uninit(&output_channel_layout);
 
-    free(indices);
 
     if (ret != 0) {
         if (ret == AVERROR_EOF) {
@@ -5,43 +5,56 @@
 #include <libavformat/avformat.h>
 #include <jansson.h>
 #include "lib/helper.h"
+#include "lib/probecache.h"
 
 static json_t *compose_result(AVFormatContext *avf_context);
 static const char *type_table[] = {"video", "audio", "data", "subtitle", "attachment", "none"};
 
-int do_detect(const char *ts_file, const char *output_file, struct file_open_options *opts) {
+/**
+ * @brief Detect the streams of the file
+ *
+ * @param error Exit code of nicm detect on error
+ * @return json_t* The result, or NULL on error
+ */
+json_t *detect_file(const char *ts_file, const struct file_open_options *opts, int *error) {
     AVFormatContext *avf_context = NULL;
-    int ret;
     json_t *result;
-    FILE *fp_output;
+    int ret;
 
-    ret = open_file_with_opts(ts_file, &avf_context, opts);
+    ret = open_probed_file(ts_file, &avf_context, opts);
     if (ret < 0) {
-        fprintf(stderr, "Error: avformat_open_input returned %d\n", ret);
-        return 10;
+        *error = 10;
+        return NULL;
     }
 
-    ret = avformat_find_stream_info(avf_context, NULL);
-    if (ret < 0) {
-        fprintf(stderr, "Error: avformat_find_stream_info returned %d\n", ret);
-        avformat_close_input(&avf_context);
-        return 11;
+    // OK, now analyze the stream and compose the result
+    result = compose_result(avf_context);
+    avformat_close_input(&avf_context);
+
+    return result;
+}
+
+int do_detect(const char *ts_file, const char *output_file, struct file_open_options *opts) {
+    int ret;
+    json_t *result;
+    FILE *fp_output;
+
+    result = detect_file(ts_file, opts, &ret);
+    if (!result) {
+        return ret;
     }
 
     if (output_file) {
         fp_output = fopen(output_file, "w");
         if (!fp_output) {
             fprintf(stderr, "Error: cannot open the output file \"%s\"\n", output_file);
-            avformat_close_input(&avf_context);
+            json_decref(result);
             return 11;
         }
     } else {
         fp_output = stdout;
     }
 
-    // OK, now analyze the stream and compose the result
-    result = compose_result(avf_context);
-
     char *output_string = json_dumps(result, 0);
     fprintf(fp_output, "%s", output_string);
     free(output_string);
@@ -51,7 +64,6 @@ int do_detect(const char *ts_file, const char *output_file, struct file_open_opt
     if (output_file) {
         fclose(fp_output);
     }
-    avformat_close_input(&avf_context);
     return 0;
 }
 
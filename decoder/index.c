@@ -5,26 +5,97 @@
 #include <libavformat/avformat.h>
 #include <jansson.h>
 #include "lib/helper.h"
-
-static json_t *process_stream(AVFormatContext *format, AVStream *stream);
-
-int do_index(const char *ts_file, const char *output_file, int stream, struct file_open_options *opts) {
+#include "lib/frameindex.h"
+#include "lib/indexer.h"
+#include "lib/indexwriter.h"
+#include "lib/probecache.h"
+
+static json_t *process_stream(const char *ts_file, AVFormatContext *format, AVStream *stream, const struct file_open_options *opts);
+static int update_sidecar(const char *ts_file, AVFormatContext *format, AVStream *stream, const struct file_open_options *opts, int *frames);
+static int write_binary_index(FILE *fp, const char *ts_file, AVFormatContext *format, AVStream *stream, const struct file_open_options *opts);
+static struct video_stream_frame_index *build_index(const char *ts_file, AVFormatContext *format, AVStream *stream, AVCodecContext *avcc, const struct file_open_options *opts, int *frames);
+static int open_index_stream(const char *ts_file, int stream, const struct file_open_options *opts, AVFormatContext **format, AVStream **found);
+
+/**
+ * @param sidecar Update the sidecar (MEDIA.STREAM.nidx) used by the other subcommands instead of writing JSON
+ * @param binary Write the binary index (lib/indexwriter.h) instead of JSON
+ */
+int do_index(const char *ts_file, const char *output_file, int stream, int sidecar, int binary, struct file_open_options *opts) {
     AVFormatContext *avf_context = NULL;
+    AVStream *avs = NULL;
     int ret;
     json_t *result;
     FILE *fp_output;
 
-    ret = open_file_with_opts(ts_file, &avf_context, opts);
-    if (ret < 0) {
-        fprintf(stderr, "Error: avformat_open_input returned %d\n", ret);
-        return 10;
+    ret = open_index_stream(ts_file, stream, opts, &avf_context, &avs);
+    if (ret != 0) {
+        return ret;
     }
 
-    ret = avformat_find_stream_info(avf_context, NULL);
-    if (ret < 0) {
-        fprintf(stderr, "Error: avformat_find_stream_info returned %d\n", ret);
+    if (sidecar) {
+        int frames;
+
+        ret = update_sidecar(ts_file, avf_context, avs, opts, &frames);
         avformat_close_input(&avf_context);
-        return 11;
+        return ret;
+    }
+
+    if (output_file) {
+        fp_output = fopen(output_file, "w");
+        if (!fp_output) {
+            fprintf(stderr, "Error: cannot open the output file \"%s\"\n", output_file);
+            avformat_close_input(&avf_context);
+            return 11;
+        }
+    } else {
+        fp_output = stdout;
+    }
+
+    ret = 0;
+    if (binary) {
+        if (write_binary_index(fp_output, ts_file, avf_context, avs, opts) != 0) {
+            fprintf(stderr, "Error: Processing the stream failed.\n");
+            ret = 15;
+        }
+        if (output_file) {
+            fclose(fp_output);
+        }
+        avformat_close_input(&avf_context);
+        return ret;
+    }
+
+    result = process_stream(ts_file, avf_context, avs, opts);
+
+    if (result) {
+        char *output_string = json_dumps(result, 0);
+        fprintf(fp_output, "%s", output_string);
+        free(output_string);
+
+        json_decref(result);
+    } else {
+        fprintf(stderr, "Error: Processing the stream failed.\n");
+        ret = 15;
+    }
+
+    if (output_file) {
+        fclose(fp_output);
+    }
+    avformat_close_input(&avf_context);
+    return ret;
+}
+
+/**
+ * @brief Open the file and find the video stream to index (the first one if stream < 0)
+ *
+ * @return int 0 on success, or the exit code of nicm index
+ */
+static int open_index_stream(const char *ts_file, int stream, const struct file_open_options *opts, AVFormatContext **format, AVStream **found) {
+    AVFormatContext *avf_context = NULL;
+    int ret;
+
+    ret = open_probed_file(ts_file, &avf_context, opts);
+    if (ret < 0) {
+        return 10;
     }
 
     AVStream *avs = NULL;
@@ -60,128 +131,207 @@ int do_index(const char *ts_file, const char *output_file, int stream, struct fi
         }
     }
 
-    if (output_file) {
-        fp_output = fopen(output_file, "w");
-        if (!fp_output) {
-            fprintf(stderr, "Error: cannot open the output file \"%s\"\n", output_file);
-            avformat_close_input(&avf_context);
-            return 11;
-        }
-    } else {
-        fp_output = stdout;
-    }
-
-    ret = 0;
-    result = process_stream(avf_context, avs);
+    *format = avf_context;
+    *found = avs;
 
-    if (result) {
-        char *output_string = json_dumps(result, 0);
-        fprintf(fp_output, "%s", output_string);
-        free(output_string);
+    return 0;
+}
 
-        json_decref(result);
-    } else {
-        fprintf(stderr, "Error: Processing the stream failed.\n");
-        ret = 15;
-    }
+/**
+ * @brief Update the sidecar of the file (nicm index -n) and report the number of frames
+ *
+ * @return int 0 on success, or the exit code of nicm index
+ */
+int update_index(const char *ts_file, int stream, const struct file_open_options *opts, int *frames) {
+    AVFormatContext *avf_context = NULL;
+    AVStream *avs = NULL;
+    int ret;
 
-    if (output_file) {
-        fclose(fp_output);
+    ret = open_index_stream(ts_file, stream, opts, &avf_context, &avs);
+    if (ret != 0) {
+        return ret;
     }
+    ret = update_sidecar(ts_file, avf_context, avs, opts, frames);
     avformat_close_input(&avf_context);
+
     return ret;
 }
 
-#define MAX_REF_FRAMES 60
+/**
+ * @brief Index a file being recorded as it grows, until it stops growing
+ */
+static struct video_stream_frame_index *follow_stream(const char *ts_file, AVStream *stream, const struct file_open_options *opts, int *frames) {
+    struct index_follower follower;
+    struct frame_index index = {};
+    const struct video_stream_frame_index *entries;
+    int num, ret;
+
+    if (open_index_follower(&follower, ts_file, stream->index, opts, NULL) != 0) {
+        return NULL;
+    }
+    do {
+        ret = follow_next_gop(&follower, &entries, &num);
+        append_frame_index(&index, entries, num);
+    } while (ret > 0);
+    close_index_follower(&follower);
 
-struct frame_info {
-    unsigned long pts;
-    unsigned long pos;
-};
+    if (ret < 0) {
+        release_frame_index(&index);
+        return NULL;
+    }
+    fprintf(stderr, "The file stopped growing.\n");
 
-static int compare_frame_info(const void *a, const void *b) {
-    const struct frame_info *fa = a, *fb = b;
+    *frames = index.num_entries;
+    return index.entries;
+}
 
-    return fa->pts - fb->pts;
+static struct video_stream_frame_index *build_index(const char *ts_file, AVFormatContext *format, AVStream *stream, AVCodecContext *avcc, const struct file_open_options *opts, int *frames) {
+    if (opts->follow_timeout > 0) {
+        return follow_stream(ts_file, stream, opts, frames);
+    }
+    return build_index_file(ts_file, format, stream, avcc, opts, frames);
 }
 
-static void flush_frames(struct frame_info *frames, int *num_frames, json_t *frames_array) {
-    // flush the frames buffer
-    qsort(frames, *num_frames, sizeof(*frames), compare_frame_info);
+/**
+ * @brief Write the binary index as the GOPs are indexed
+ *
+ * Only the last two GOPs are held. The frames of a GOP are final when the next GOP arrives,
+ * as the leading frames of an open GOP are presented before its keyframe.
+ * The parallel indexer (-j) holds the whole index before writing it.
+ */
+static int write_binary_index(FILE *fp, const char *ts_file, AVFormatContext *format, AVStream *stream, const struct file_open_options *opts) {
+    struct index_writer writer;
+    struct index_follower follower;
+    struct frame_index window = {};
+    const struct video_stream_frame_index *entries;
+    int num, ret;
+
+    if (init_index_writer(&writer, fp, stream->index, stream->time_base.num, stream->time_base.den) != 0) {
+        finish_index_writer(&writer);
+        return -1;
+    }
 
-    int i;
-    for (i = 0; i < *num_frames; i++) {
-        struct frame_info *f = frames + i;
+    if (opts->index_jobs > 1) {
+        struct video_stream_frame_index *all;
+        AVCodecContext *avcc = open_decoder_for_stream(stream, opts, THREAD_TYPE_FRAME);
 
-        json_t *o = json_object();
-        json_object_set_new(o, "pts", json_integer(f->pts));
-        json_object_set_new(o, "pos", json_integer(f->pos));
+        if (!avcc) {
+            fprintf(stderr, "Stream error: Failed to open the decoder for the stream");
+            finish_index_writer(&writer);
+            return -1;
+        }
+        all = build_index(ts_file, format, stream, avcc, opts, &num);
+        avcodec_free_context(&avcc);
+        if (!all) {
+            finish_index_writer(&writer);
+            return -1;
+        }
+        write_index_entries(&writer, all, num);
+        free(all);
+    } else {
+        if (open_index_follower(&follower, ts_file, stream->index, opts, NULL) != 0) {
+            finish_index_writer(&writer);
+            return -1;
+        }
+        do {
+            int final = 0;
+
+            ret = follow_next_gop(&follower, &entries, &num);
+            if (num > 0) {
+                append_frame_index(&window, entries, num);
+                while (ret > 0 && final < window.num_entries && window.entries[final].pts < entries[0].pts) {
+                    final++;
+                }
+            }
+            if (ret == 0) {
+                final = window.num_entries;
+            }
+            if (final > 0) {
+                write_index_entries(&writer, window.entries, final);
+                memmove(window.entries, window.entries + final, sizeof(*window.entries) * (window.num_entries - final));
+                window.num_entries -= final;
+            }
+        } while (ret > 0);
+        close_index_follower(&follower);
+        release_frame_index(&window);
 
-        json_array_append_new(frames_array, o);
+        if (ret < 0) {
+            finish_index_writer(&writer);
+            return -1;
+        }
     }
 
-    *num_frames = 0;
+    fprintf(stderr, "Wrote the index of %ld frames.\n", writer.frames + writer.num);
+
+    return finish_index_writer(&writer);
 }
 
-static json_t *process_stream(AVFormatContext *format, AVStream *stream) {
-    json_t *root = NULL;
+/**
+ * @brief Build the sidecar unless it is up to date
+ */
+static int update_sidecar(const char *ts_file, AVFormatContext *format, AVStream *stream, const struct file_open_options *opts, int *frames) {
+    struct frame_index index;
+    int ret = 0;
+
+    if (open_frame_index(&index, ts_file, stream->index) == 0) {
+        fprintf(stderr, "The index is up to date (%d frames).\n", index.num_entries);
+        *frames = index.num_entries;
+        release_frame_index(&index);
+        return 0;
+    }
 
-    AVCodecContext *avcc = open_decoder_for_stream(stream);
+    AVCodecContext *avcc = open_decoder_for_stream(stream, opts, THREAD_TYPE_FRAME);
     if (!avcc) {
         fprintf(stderr, "Stream error: Failed to open the decoder for the stream");
-        return root;
+        return 15;
     }
 
-    AVPacket *packet;
-    int ret;
-    long first_key_frame_pts = AV_NOPTS_VALUE;
+    index.entries = build_index(ts_file, format, stream, avcc, opts, &index.num_entries);
+    if (!index.entries || index.num_entries == 0) {
+        fprintf(stderr, "Error: Processing the stream failed.\n");
+        ret = 15;
+    } else if (save_frame_index(&index, ts_file, stream->index) != 0) {
+        ret = 16;
+    } else {
+        fprintf(stderr, "Wrote the index of %d frames.\n", index.num_entries);
+        *frames = index.num_entries;
+    }
+    release_frame_index(&index);
 
-    struct frame_info prev_frames[MAX_REF_FRAMES];
-    int num_prev_frames = 0;
+    avcodec_free_context(&avcc);
 
-    json_t *frames = json_array();
-    root = json_object();
+    return ret;
+}
 
-    packet = av_packet_alloc();
-    while ((ret = av_read_frame(format, packet)) == 0) {
-        if (packet->stream_index != stream->index) {
-            goto free_packet;
-        }
-        if (first_key_frame_pts == AV_NOPTS_VALUE) {
-            if (packet->flags & AV_PKT_FLAG_KEY) {
-                first_key_frame_pts = packet->pts;
-            } else {
-                goto free_packet;
-            }
-        }
-        // first_key_frame_pts must be valid at this point.
-        if (packet->pts < first_key_frame_pts) {
-            goto free_packet;
-        }
-        if (packet->flags & AV_PKT_FLAG_KEY) {
-            flush_frames(prev_frames, &num_prev_frames, frames);
-        }
-        if (num_prev_frames < MAX_REF_FRAMES) {
-            prev_frames[num_prev_frames].pts = packet->pts;
-            prev_frames[num_prev_frames].pos = packet->pos;
+static json_t *process_stream(const char *ts_file, AVFormatContext *format, AVStream *stream, const struct file_open_options *opts) {
+    struct video_stream_frame_index *entries;
+    int num_frames, i;
 
-            num_prev_frames++;
-        } else {
-            fprintf(stderr, "Warning: Frame buffer overflowed\n");
-        }
+    AVCodecContext *avcc = open_decoder_for_stream(stream, opts, THREAD_TYPE_FRAME);
+    if (!avcc) {
+        fprintf(stderr, "Stream error: Failed to open the decoder for the stream");
+        return NULL;
+    }
 
-free_packet:
-        av_packet_unref(packet);
+    entries = build_index(ts_file, format, stream, avcc, opts, &num_frames);
+    avcodec_free_context(&avcc);
+    if (!entries) {
+        return NULL;
     }
-    // Do not flush frames after the last key frame
-    av_packet_free(&packet);
 
-    int num_frames = json_array_size(frames);
-    long first_frame_pts = json_integer_value(json_array_get(frames, 0));
-    long last_frame_pts = json_integer_value(json_array_get(frames, num_frames - 1));
+    json_t *root = json_object();
+    json_t *frames = json_array();
 
-    avcodec_close(avcc);
-    avcodec_free_context(&avcc);
+    for (i = 0; i < num_frames; i++) {
+        json_t *o = json_object();
+        json_object_set_new(o, "pts", json_integer(entries[i].pts));
+        json_object_set_new(o, "pos", json_integer(entries[i].pos));
+        json_object_set_new(o, "key_pos", json_integer(entries[i].key_pos));
+        json_object_set_new(o, "gop", json_integer(entries[i].gop));
+        json_object_set_new(o, "key", json_boolean(entries[i].flags & FRAME_INDEX_FLAG_KEY));
+
+        json_array_append_new(frames, o);
+    }
 
     json_object_set_new(root, "frames", frames);
     json_object_set_new(root, "stream", json_integer(stream->index));
@@ -195,9 +345,15 @@ free_packet:
     char buf[64];
     json_t *info = json_object();
     json_object_set_new(info, "num_frames", json_integer(num_frames));
-    snprintf(buf, sizeof(buf), "%.3f", (double)(num_frames - 1) * (double)stream->time_base.den / (double)(last_frame_pts - first_frame_pts) / (double)stream->time_base.num);
+    if (num_frames > 1) {
+        snprintf(buf, sizeof(buf), "%.3f", (double)(num_frames - 1) * (double)stream->time_base.den / (double)(entries[num_frames - 1].pts - entries[0].pts) / (double)stream->time_base.num);
+    } else {
+        snprintf(buf, sizeof(buf), "0.000");
+    }
     json_object_set_new(info, "fps", json_string(buf));
     json_object_set_new(root, "info", info);
 
+    free(entries);
+
     return root;
 }
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <jansson.h>
+#include "nicm.h"
+#include "lib/frameindex.h"
+#include "lib/probecache.h"
+#include "lib/workpool.h"
+
+/*
+ * nicm ingest: detect, index and check many files at once
+ *
+ * The jobs of all the files run on a work-stealing pool (lib/workpool.h).
+ * Indexing and checking read whole files, so they are limited to a few at once,
+ * while detecting (a short probe) fills the other workers.
+ * A line of JSON is written for each file as soon as its last job finishes.
+ */
+
+#define DEFAULT_INGEST_IO_JOBS 2
+
+enum INGEST_JOB {
+    INGEST_JOB_DETECT = 1,
+    INGEST_JOB_INDEX = 2,
+    INGEST_JOB_CHECK = 4,
+};
+
+struct ingest_context {
+    const struct file_open_options *opts;
+    // INGEST_JOB_* for each file
+    int jobs;
+    FILE *output;
+    pthread_mutex_t output_mutex;
+    int failed;
+};
+
+struct ingest_file {
+    struct ingest_context *ctx;
+    const char *path;
+    // Jobs not finished. The last one writes the result.
+    atomic_int remaining;
+
+    json_t *detect;
+    json_t *check;
+    int frames;
+    // Exit code of each job (0: succeeded or not requested)
+    int detect_error, index_error, check_error;
+};
+
+struct ingest_job {
+    struct ingest_file *file;
+    enum INGEST_JOB type;
+};
+
+extern json_t *detect_file(const char *ts_file, const struct file_open_options *opts, int *error);
+extern int update_index(const char *ts_file, int stream, const struct file_open_options *opts, int *frames);
+extern json_t *check_file(const char *ts_file);
+
+static void __write_result(struct ingest_file *file) {
+    struct ingest_context *ctx = file->ctx;
+    int jobs = ctx->jobs, failed;
+    json_t *result = json_object();
+    json_t *errors = json_object();
+
+    json_object_set_new(result, "file", json_string(file->path));
+    if (file->detect) {
+        json_object_set_new(result, "detect", file->detect);
+    } else if (jobs & INGEST_JOB_DETECT) {
+        json_object_set_new(errors, "detect", json_integer(file->detect_error));
+    }
+    if ((jobs & INGEST_JOB_INDEX) && file->index_error == 0) {
+        json_t *index = json_object();
+
+        json_object_set_new(index, "frames", json_integer(file->frames));
+        json_object_set_new(result, "index", index);
+    } else if (jobs & INGEST_JOB_INDEX) {
+        json_object_set_new(errors, "index", json_integer(file->index_error));
+    }
+    if (file->check) {
+        json_object_set_new(result, "check", file->check);
+    } else if (jobs & INGEST_JOB_CHECK) {
+        json_object_set_new(errors, "check", json_integer(file->check_error));
+    }
+    file->detect = NULL;
+    file->check = NULL;
+
+    failed = json_object_size(errors) > 0;
+    if (failed) {
+        json_object_set_new(result, "errors", errors);
+    } else {
+        json_decref(errors);
+    }
+
+    char *output_string = json_dumps(result, 0);
+
+    pthread_mutex_lock(&ctx->output_mutex);
+    fprintf(ctx->output, "%s\n", output_string);
+    fflush(ctx->output);
+    if (failed) {
+        ctx->failed++;
+    }
+    pthread_mutex_unlock(&ctx->output_mutex);
+
+    free(output_string);
+    json_decref(result);
+}
+
+static void __run_job(void *arg) {
+    struct ingest_job *job = arg;
+    struct ingest_file *file = job->file;
+    const struct file_open_options *opts = file->ctx->opts;
+
+    switch (job->type) {
+        case INGEST_JOB_DETECT:
+            file->detect = detect_file(file->path, opts, &file->detect_error);
+            break;
+        case INGEST_JOB_INDEX:
+            file->index_error = update_index(file->path, -1, opts, &file->frames);
+            break;
+        case INGEST_JOB_CHECK:
+            file->check = check_file(file->path);
+            file->check_error = file->check ? 0 : 1;
+            break;
+    }
+
+    if (atomic_fetch_sub(&file->remaining, 1) == 1) {
+        __write_result(file);
+    }
+}
+
+static int __compare_path(const void *a, const void *b) {
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+static void __add_path(char ***paths, int *num, int *allocated, char *path) {
+    if (*num >= *allocated) {
+        *allocated = *allocated > 0 ? *allocated * 2 : 64;
+        *paths = realloc(*paths, sizeof(char *) * *allocated);
+    }
+    (*paths)[(*num)++] = path;
+}
+
+/**
+ * @brief Add the files in the directory (not recursive) in the order of their names
+ *
+ * Hidden files and the sidecars (.nidx, .nprobe) are skipped.
+ */
+static int __add_directory(char ***paths, int *num, int *allocated, const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *ent;
+    int first = *num;
+
+    if (!d) {
+        fprintf(stderr, "Error: cannot open the directory \"%s\"\n", dir);
+        return -1;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        struct stat st;
+        char *path;
+
+        if (ent->d_name[0] == '.' || (len > 5 && !strcmp(ent->d_name + len - 5, FRAME_INDEX_SUFFIX)) ||
+            (len > 7 && !strcmp(ent->d_name + len - 7, PROBE_CACHE_SUFFIX))) {
+            continue;
+        }
+        path = malloc(strlen(dir) + len + 2);
+        sprintf(path, "%s/%s", dir, ent->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            free(path);
+            continue;
+        }
+        __add_path(paths, num, allocated, path);
+    }
+    closedir(d);
+
+    qsort(*paths + first, *num - first, sizeof(char *), __compare_path);
+
+    return 0;
+}
+
+/**
+ * @brief Add the files listed in the file (a path per line, "-" for stdin)
+ */
+static int __add_list(char ***paths, int *num, int *allocated, const char *list_file) {
+    FILE *fp = strcmp(list_file, "-") ? fopen(list_file, "r") : stdin;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+
+    if (!fp) {
+        fprintf(stderr, "Error: cannot open the list \"%s\"\n", list_file);
+        return -1;
+    }
+    while ((len = getline(&line, &size, fp)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len > 0) {
+            __add_path(paths, num, allocated, strdup(line));
+        }
+    }
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Parse a comma separated list of jobs (detect, index, check)
+ *
+ * @return int The jobs (INGEST_JOB_*), or 0 on error
+ */
+int parse_ingest_jobs(const char *str) {
+    char *list = strdup(str), *saveptr = NULL, *name;
+    int jobs = 0;
+
+    for (name = strtok_r(list, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+        if (!strcmp(name, "detect")) {
+            jobs |= INGEST_JOB_DETECT;
+        } else if (!strcmp(name, "index")) {
+            jobs |= INGEST_JOB_INDEX;
+        } else if (!strcmp(name, "check")) {
+            jobs |= INGEST_JOB_CHECK;
+        } else {
+            jobs = 0;
+            break;
+        }
+    }
+    free(list);
+
+    return jobs;
+}
+
+/**
+ * @param inputs Files and directories
+ * @param list_file File listing the inputs (NULL: none)
+ * @param jobs Jobs for each file (INGEST_JOB_*, 0: all)
+ * @param workers Number of workers (0: the number of CPUs)
+ * @param io_jobs Jobs reading whole files at once (0: default)
+ */
+int do_ingest(char **inputs, int num_inputs, const char *list_file, const char *output_file, int jobs, int workers, int io_jobs, struct file_open_options *opts) {
+    struct ingest_context ctx = {};
+    struct work_pool pool;
+    struct ingest_file *files;
+    struct ingest_job *file_jobs;
+    char **paths = NULL;
+    int num = 0, allocated = 0;
+    int i, ret = 0;
+
+    for (i = 0; i < num_inputs; i++) {
+        struct stat st;
+
+        if (stat(inputs[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            ret = __add_directory(&paths, &num, &allocated, inputs[i]);
+        } else {
+            __add_path(&paths, &num, &allocated, strdup(inputs[i]));
+        }
+        if (ret != 0) {
+            goto end;
+        }
+    }
+    if (list_file && __add_list(&paths, &num, &allocated, list_file) != 0) {
+        ret = 1;
+        goto end;
+    }
+    if (num == 0) {
+        fprintf(stderr, "Error: No file to ingest.\n");
+        ret = 1;
+        goto end;
+    }
+
+    if (jobs == 0) {
+        jobs = INGEST_JOB_DETECT | INGEST_JOB_INDEX | INGEST_JOB_CHECK;
+    }
+    if (opts->threads == 0) {
+        // Files are processed in parallel instead of frames
+        opts->threads = 1;
+    }
+
+    if (output_file) {
+        ctx.output = fopen(output_file, "w");
+        if (!ctx.output) {
+            fprintf(stderr, "Error: cannot open the output file \"%s\"\n", output_file);
+            ret = 11;
+            goto end;
+        }
+    } else {
+        ctx.output = stdout;
+    }
+    ctx.opts = opts;
+    ctx.jobs = jobs;
+    pthread_mutex_init(&ctx.output_mutex, NULL);
+
+    init_work_pool(&pool, workers, io_jobs > 0 ? io_jobs : DEFAULT_INGEST_IO_JOBS);
+
+    // Up to 3 jobs per file
+    files = calloc(num, sizeof(struct ingest_file));
+    file_jobs = calloc(num * 3, sizeof(struct ingest_job));
+
+    for (i = 0; i < num; i++) {
+        struct ingest_file *file = files + i;
+        struct ingest_job *job = file_jobs + i * 3;
+        int n = 0;
+
+        file->ctx = &ctx;
+        file->path = paths[i];
+        atomic_init(&file->remaining, __builtin_popcount(jobs));
+
+        // The owner of the deque takes the newest job first, so detect is submitted last to run first
+        if (jobs & INGEST_JOB_CHECK) {
+            job[n].file = file;
+            job[n].type = INGEST_JOB_CHECK;
+            work_pool_submit(&pool, i, __run_job, job + n++, 1);
+        }
+        if (jobs & INGEST_JOB_INDEX) {
+            job[n].file = file;
+            job[n].type = INGEST_JOB_INDEX;
+            work_pool_submit(&pool, i, __run_job, job + n++, 1);
+        }
+        if (jobs & INGEST_JOB_DETECT) {
+            job[n].file = file;
+            job[n].type = INGEST_JOB_DETECT;
+            work_pool_submit(&pool, i, __run_job, job + n++, 0);
+        }
+    }
+
+    if (run_work_pool(&pool) != 0) {
+        ret = 1;
+    } else if (ctx.failed > 0) {
+        fprintf(stderr, "%d of %d files failed.\n", ctx.failed, num);
+        ret = 2;
+    }
+
+    destroy_work_pool(&pool);
+    pthread_mutex_destroy(&ctx.output_mutex);
+    free(file_jobs);
+    free(files);
+    if (output_file) {
+        fclose(ctx.output);
+    }
+
+end:
+    for (i = 0; i < num; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+
+    return ret;
+}
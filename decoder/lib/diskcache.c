@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdatomic.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "diskcache.h"
+
+#define DISKCACHE_MAGIC "NICMDC01"
+#define DISKCACHE_LOCK_FILE ".lock"
+// Sweep after writing 1/16 of the budget
+#define DISKCACHE_SWEEP_RATIO 16
+// Temporary files left by crashed processes
+#define DISKCACHE_STALE_TMP_SEC 3600
+
+// Distinguishes the temporary files of the same key written at once by the threads of a process (nicm daemon)
+static atomic_int tmp_serial;
+
+struct diskcache_header {
+    char magic[8];
+    struct diskcache_key key;
+    uint64_t size;
+};
+
+struct sweep_entry {
+    char *path;
+    time_t mtime;
+    off_t size;
+};
+
+static uint64_t __hash_key(const struct diskcache_key *key) {
+    // FNV-1a
+    const uint8_t *p = (const uint8_t *)key;
+    uint64_t hash = 0xcbf29ce484222325UL;
+    size_t i;
+
+    for (i = 0; i < sizeof(*key); i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3UL;
+    }
+
+    return hash;
+}
+
+static void __make_key(const struct diskcache *cache, struct diskcache_key *key, int stream, long pts, int image_opt) {
+    *key = cache->file_key;
+    key->pts = pts;
+    key->stream = stream;
+    key->image_opt = image_opt;
+}
+
+static void __entry_path(const struct diskcache *cache, const struct diskcache_key *key, char *path, size_t size) {
+    uint64_t hash = __hash_key(key);
+
+    snprintf(path, size, "%s/%02x/%016lx", cache->dir, (unsigned int)(hash >> 56), (unsigned long)hash);
+}
+
+static int compare_sweep_entry(const void *a, const void *b) {
+    const struct sweep_entry *ea = a, *eb = b;
+
+    return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+/**
+ * @brief Remove the least recently used images until the cache fits in the budget
+ *
+ * Only one process sweeps at a time. The others simply skip it.
+ */
+static void __sweep(struct diskcache *cache) {
+    struct sweep_entry *entries = NULL;
+    int num_entries = 0, num_allocated = 0, i;
+    size_t total = 0;
+    time_t now = time(NULL);
+    char path[4096];
+
+    if (flock(cache->lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        return;
+    }
+
+    for (i = 0; i < 256; i++) {
+        DIR *dir;
+        struct dirent *ent;
+
+        snprintf(path, sizeof(path), "%s/%02x", cache->dir, i);
+        if ((dir = opendir(path)) == NULL) {
+            continue;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+            struct stat st;
+
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s/%02x/%s", cache->dir, i, ent->d_name);
+            if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+            if (ent->d_name[0] == '.') {
+                if (now - st.st_mtime > DISKCACHE_STALE_TMP_SEC) {
+                    unlink(path);
+                }
+                continue;
+            }
+
+            if (num_entries == num_allocated) {
+                num_allocated = num_allocated ? num_allocated * 2 : 1024;
+                entries = realloc(entries, sizeof(*entries) * num_allocated);
+            }
+            entries[num_entries].path = strdup(path);
+            entries[num_entries].mtime = st.st_mtime;
+            entries[num_entries].size = st.st_size;
+            num_entries++;
+
+            total += st.st_size;
+        }
+        closedir(dir);
+    }
+
+    if (total > cache->max_bytes) {
+        // Leave some room so that the next sweep does not come too soon
+        size_t target = cache->max_bytes / 10 * 9;
+
+        qsort(entries, num_entries, sizeof(*entries), compare_sweep_entry);
+        for (i = 0; i < num_entries && total > target; i++) {
+            if (unlink(entries[i].path) == 0) {
+                total -= entries[i].size;
+            }
+        }
+        fprintf(stderr, "[diskcache] Swept %d images. %lu bytes in use.\n", i, total);
+    }
+
+    for (i = 0; i < num_entries; i++) {
+        free(entries[i].path);
+    }
+    free(entries);
+
+    flock(cache->lock_fd, LOCK_UN);
+}
+
+int init_diskcache(struct diskcache *cache, const char *dir, size_t max_bytes, const char *media_file) {
+    struct stat st;
+    char path[4096];
+
+    memset(cache, 0, sizeof(*cache));
+    cache->lock_fd = -1;
+
+    if (stat(media_file, &st) != 0) {
+        fprintf(stderr, "[diskcache] Cannot stat %s: %s\n", media_file, strerror(errno));
+        return -1;
+    }
+    cache->file_key.dev = st.st_dev;
+    cache->file_key.ino = st.st_ino;
+    cache->file_key.size = st.st_size;
+    cache->file_key.mtime_sec = st.st_mtim.tv_sec;
+    cache->file_key.mtime_nsec = st.st_mtim.tv_nsec;
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "[diskcache] Cannot create %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", dir, DISKCACHE_LOCK_FILE);
+    if ((cache->lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        fprintf(stderr, "[diskcache] Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    cache->dir = strdup(dir);
+    cache->max_bytes = max_bytes;
+
+    __sweep(cache);
+
+    return 0;
+}
+
+void destroy_diskcache(struct diskcache *cache) {
+    if (cache->lock_fd >= 0) {
+        close(cache->lock_fd);
+        cache->lock_fd = -1;
+    }
+    free(cache->dir);
+    cache->dir = NULL;
+}
+
+/**
+ * @brief Map the cached image
+ *
+ * @return int 0 if found (release the entry with release_diskcache_entry()), negative if not
+ */
+int find_in_diskcache(struct diskcache *cache, int stream, long pts, int image_opt, struct diskcache_entry *entry) {
+    struct diskcache_key key;
+    const struct diskcache_header *header;
+    struct stat st;
+    char path[4096];
+    void *map;
+    int fd;
+
+    __make_key(cache, &key, stream, pts, image_opt);
+    __entry_path(cache, &key, path, sizeof(path));
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header)) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    header = map;
+    if (memcmp(header->magic, DISKCACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        memcmp(&header->key, &key, sizeof(key)) != 0 ||
+        header->size != (uint64_t)st.st_size - sizeof(*header)) {
+        // Hash collision or a broken file
+        munmap(map, st.st_size);
+        close(fd);
+        return -1;
+    }
+
+    // Mark it recently used for the sweeper
+    futimens(fd, NULL);
+    close(fd);
+
+    entry->map = map;
+    entry->map_size = st.st_size;
+    entry->data = (const uint8_t *)map + sizeof(*header);
+    entry->size = header->size;
+
+    return 0;
+}
+
+void release_diskcache_entry(struct diskcache_entry *entry) {
+    if (entry->map) {
+        munmap(entry->map, entry->map_size);
+        entry->map = NULL;
+    }
+}
+
+static int __write_all(int fd, const void *data, size_t size) {
+    const uint8_t *p = data;
+
+    while (size > 0) {
+        ssize_t ret = write(fd, p, size);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+int add_diskcache(struct diskcache *cache, int stream, long pts, int image_opt, const uint8_t *data, size_t size) {
+    struct diskcache_header header;
+    char path[4096], tmp_path[4096];
+    uint64_t hash;
+    int fd;
+
+    if (size + sizeof(header) > cache->max_bytes) {
+        return -1;
+    }
+
+    memcpy(header.magic, DISKCACHE_MAGIC, sizeof(header.magic));
+    __make_key(cache, &header.key, stream, pts, image_opt);
+    header.size = size;
+
+    hash = __hash_key(&header.key);
+    snprintf(path, sizeof(path), "%s/%02x", cache->dir, (unsigned int)(hash >> 56));
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    __entry_path(cache, &header.key, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%02x/.tmp.%d.%d.%016lx", cache->dir, (unsigned int)(hash >> 56), (int)getpid(),
+             atomic_fetch_add(&tmp_serial, 1), (unsigned long)hash);
+
+    if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        return -1;
+    }
+    if (__write_all(fd, &header, sizeof(header)) != 0 || __write_all(fd, data, size) != 0) {
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    close(fd);
+
+    // Atomically replace. A concurrent writer of the same key writes the same image.
+    if (rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    cache->bytes_since_sweep += size + sizeof(header);
+    if (cache->bytes_since_sweep > cache->max_bytes / DISKCACHE_SWEEP_RATIO) {
+        cache->bytes_since_sweep = 0;
+        __sweep(cache);
+    }
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Persistent cache for encoded images, shared by nicm processes
+ *
+ * Each image is stored in its own file, named after the hash of its key
+ * (file identity, stream, PTS and image option), under DIR/xx/.
+ * A file consists of a fixed header followed by the image, so it can be
+ * served straight from a read-only mapping. Files are written to a temporary
+ * name and renamed, so readers never see a partial image.
+ */
+
+struct diskcache_key {
+    // Identity of the media file
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    // Image
+    int64_t pts;
+    int32_t stream;
+    int32_t image_opt;
+};
+
+struct diskcache {
+    char *dir;
+    size_t max_bytes;
+    struct diskcache_key file_key;
+    int lock_fd;
+    size_t bytes_since_sweep;
+};
+
+struct diskcache_entry {
+    void *map;
+    size_t map_size;
+    const uint8_t *data;
+    size_t size;
+};
+
+int init_diskcache(struct diskcache *cache, const char *dir, size_t max_bytes, const char *media_file);
+void destroy_diskcache(struct diskcache *cache);
+int find_in_diskcache(struct diskcache *cache, int stream, long pts, int image_opt, struct diskcache_entry *entry);
+void release_diskcache_entry(struct diskcache_entry *entry);
+int add_diskcache(struct diskcache *cache, int stream, long pts, int image_opt, const uint8_t *data, size_t size);
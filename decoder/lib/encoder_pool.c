@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
+#include "encoder_pool.h"
+#include "stats.h"
+#include "trace.h"
+
+// Contexts kept by a worker. Inputs of a shared pool come and go, so recycle the least recently used ones.
+#define WORKER_CONTEXTS 64
+
+// Contexts of a configuration owned by a worker
+struct worker_context {
+    unsigned long config_id;
+    unsigned long last_used;
+    AVCodecContext *encoder;
+    int quality;
+    struct SwsContext *sws;
+    // Source of the scaler, to recreate it when the input changes
+    int sws_src_width;
+    int sws_src_height;
+    int sws_src_format;
+};
+
+struct encoder_worker {
+    struct encoder_pool *pool;
+    struct worker_context contexts[WORKER_CONTEXTS];
+    unsigned long clock;
+};
+
+static _Atomic unsigned long next_config_id = 1;
+
+unsigned long new_encode_configs_id(void) {
+    return atomic_fetch_add(&next_config_id, 1);
+}
+
+static void __free_worker_context(struct worker_context *context) {
+    if (context->encoder) {
+        avcodec_free_context(&context->encoder);
+    }
+    sws_freeContext(context->sws);
+    memset(context, 0, sizeof(*context));
+}
+
+/**
+ * @brief Find the contexts of the configuration, or recycle the least recently used ones for it
+ */
+static struct worker_context *__get_worker_context(struct encoder_worker *worker, unsigned long config_id) {
+    struct worker_context *victim = worker->contexts;
+    int i;
+
+    for (i = 0; i < WORKER_CONTEXTS; i++) {
+        struct worker_context *context = worker->contexts + i;
+
+        if (context->config_id == config_id) {
+            victim = context;
+            break;
+        }
+        if (context->last_used < victim->last_used) {
+            victim = context;
+        }
+    }
+    if (victim->config_id != config_id) {
+        __free_worker_context(victim);
+        victim->config_id = config_id;
+    }
+    victim->last_used = ++worker->clock;
+
+    return victim;
+}
+
+static AVCodecContext *__open_encoder(const struct encode_configs *c, int quality) {
+    AVCodecContext *context = avcodec_alloc_context3(c->encoder);
+
+    if (!context) {
+        return NULL;
+    }
+    context->time_base = c->time_base;
+    context->pix_fmt = c->fmt;
+    context->width = c->width;
+    context->height = c->height;
+    if (c->set_quality) {
+        c->set_quality(context, quality);
+    }
+
+    if (avcodec_open2(context, c->encoder, NULL) != 0) {
+        fprintf(stderr, "[encoder_pool] Failed to open encoder.\n");
+        avcodec_free_context(&context);
+        return NULL;
+    }
+
+    return context;
+}
+
+/**
+ * @brief Create a scaler with slice threading
+ */
+static struct SwsContext *__open_scaler(const struct encoder_pool *pool, const struct encode_configs *c, const AVFrame *frame) {
+    struct SwsContext *sws = sws_alloc_context();
+
+    if (!sws) {
+        return NULL;
+    }
+    av_opt_set_int(sws, "srcw", frame->width, 0);
+    av_opt_set_int(sws, "srch", frame->height, 0);
+    av_opt_set_int(sws, "src_format", frame->format, 0);
+    av_opt_set_int(sws, "dstw", c->width, 0);
+    av_opt_set_int(sws, "dsth", c->height, 0);
+    av_opt_set_int(sws, "dst_format", c->fmt, 0);
+    av_opt_set_int(sws, "sws_flags", SWS_BILINEAR, 0);
+    av_opt_set_int(sws, "threads", pool->sws_threads, 0);
+
+    if (sws_init_context(sws, NULL, NULL) < 0) {
+        fprintf(stderr, "[encoder_pool] Failed to initialize the scaler.\n");
+        sws_freeContext(sws);
+        return NULL;
+    }
+
+    return sws;
+}
+
+static int __encode(struct encoder_worker *worker, struct encode_job *job) {
+    struct encoder_pool *pool = worker->pool;
+    struct encode_configs *c = job->config;
+    const AVFrame *frame = job->frame;
+    struct worker_context *context = __get_worker_context(worker, c->id);
+    long started;
+    int ret;
+
+    if (context->encoder && context->quality != job->quality) {
+        avcodec_free_context(&context->encoder);
+    }
+    if (!context->encoder) {
+        if (!c->encoder || !(context->encoder = __open_encoder(c, job->quality))) {
+            return -1;
+        }
+        context->quality = job->quality;
+    }
+    if (context->sws &&
+        (context->sws_src_width != frame->width || context->sws_src_height != frame->height || context->sws_src_format != frame->format)) {
+        sws_freeContext(context->sws);
+        context->sws = NULL;
+    }
+    if (!context->sws) {
+        if (!(context->sws = __open_scaler(pool, c, frame))) {
+            return -1;
+        }
+        context->sws_src_width = frame->width;
+        context->sws_src_height = frame->height;
+        context->sws_src_format = frame->format;
+    }
+
+    AVFrame *image = image_pool_get_frame(&c->image_pool);
+    if (!image) {
+        fprintf(stderr, "[encoder_pool] Failed to allocate the image buffer\n");
+        return -1;
+    }
+    started = now_us();
+    sws_scale(context->sws, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height, image->data, image->linesize);
+    job->scale_us = now_us() - started;
+    TRACE_COMPLETE(TRACE_LEVEL_DEBUG, "scale", "width,height", c->width, c->height, started, job->scale_us);
+
+    // With AV_CODEC_FLAG_QSCALE the encoder takes the quality of the frame, not global_quality.
+    // The frames of the pool are shared by the qualities, so it is set on every frame.
+    image->quality = context->encoder->global_quality;
+
+    started = now_us();
+    if ((ret = avcodec_send_frame(context->encoder, image)) != 0) {
+        fprintf(stderr, "[encoder_pool] avcodec_send_frame failed: %d\n", ret);
+        pool_put_frame(&image);
+        return -1;
+    }
+    pool_put_frame(&image);
+
+    job->packet = pool_get_packet();
+    if ((ret = avcodec_receive_packet(context->encoder, job->packet)) != 0) {
+        fprintf(stderr, "[encoder_pool] avcodec_receive_packet failed: %d\n", ret);
+        pool_put_packet(&job->packet);
+        return -1;
+    }
+    job->encode_us = now_us() - started;
+    TRACE_COMPLETE(TRACE_LEVEL_DEBUG, "encode", "bytes", job->packet->size, 0, started, job->encode_us);
+
+    return 0;
+}
+
+static void *__worker(void *arg) {
+    struct encoder_pool *pool = arg;
+    struct encoder_worker worker;
+    int i;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.pool = pool;
+    trace_thread_name("encoder");
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        struct encode_job *job;
+
+        while (!pool->head && !pool->quit) {
+            pthread_cond_wait(&pool->job_cond, &pool->mutex);
+        }
+        if (!pool->head) {
+            break;
+        }
+        job = pool->head;
+        pool->head = job->next;
+        if (!pool->head) {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        job->status = __encode(&worker, job);
+
+        pthread_mutex_lock(&pool->mutex);
+        job->done = 1;
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (i = 0; i < WORKER_CONTEXTS; i++) {
+        __free_worker_context(worker.contexts + i);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Start the workers
+ *
+ * @param threads Number of workers (0: the number of CPUs)
+ */
+int init_encoder_pool(struct encoder_pool *pool, int threads) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    if (threads <= 0) {
+        threads = cpus;
+    }
+
+    memset(pool, 0, sizeof(*pool));
+    // Share the cores with the other workers. A single request still scales on several cores.
+    pool->sws_threads = cpus / threads > 1 ? cpus / threads : 1;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->job_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    pool->threads = calloc(threads, sizeof(pthread_t));
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(pool->threads + i, NULL, __worker, pool) != 0) {
+            fprintf(stderr, "[encoder_pool] Failed to start a worker\n");
+            break;
+        }
+    }
+    pool->num_threads = i;
+
+    if (pool->num_threads == 0) {
+        destroy_encoder_pool(pool);
+        return -1;
+    }
+    fprintf(stderr, "[encoder_pool] %d workers, %d scaler threads each\n", pool->num_threads, pool->sws_threads);
+
+    return 0;
+}
+
+void destroy_encoder_pool(struct encoder_pool *pool) {
+    int i;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->job_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->num_threads = 0;
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->job_cond);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+void encoder_pool_submit(struct encoder_pool *pool, struct encode_job *job) {
+    job->packet = NULL;
+    job->status = 0;
+    job->done = 0;
+    job->scale_us = 0;
+    job->encode_us = 0;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->tail) {
+        pool->tail->next = job;
+    } else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pthread_cond_signal(&pool->job_cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void encoder_pool_wait(struct encoder_pool *pool, struct encode_job *job) {
+    pthread_mutex_lock(&pool->mutex);
+    while (!job->done) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+#include "pool.h"
+
+/*
+ * Worker threads converting and encoding frames into images
+ *
+ * Each worker has its own scaler and encoder context for every output configuration,
+ * so several images of the same option can be encoded at the same time.
+ * The contexts are created on the first use. A pool can be shared by several inputs:
+ * the workers keep the contexts of the recently used configurations.
+ */
+
+struct encode_configs {
+    // Unique in the process (new_encode_configs_id()). The workers find their contexts by it.
+    unsigned long id;
+    int width;
+    int height;
+    const AVCodec *encoder;
+    enum AVPixelFormat fmt;
+    AVRational time_base;
+    // Apply the quality of a request to the encoder before opening it (optional)
+    void (*set_quality)(AVCodecContext *context, int quality);
+    // Shared by the workers (AVBufferPool is thread-safe)
+    struct image_pool image_pool;
+};
+
+struct encode_job {
+    // Input. The caller keeps the frame until the job is done.
+    const AVFrame *frame;
+    struct encode_configs *config;
+    // 0: default of the encoder
+    int quality;
+    // Output. The caller owns the packet after the job is done.
+    AVPacket *packet;
+    int status;
+    // Time spent in the scaler and the encoder
+    long scale_us;
+    long encode_us;
+    int done;
+    struct encode_job *next;
+};
+
+struct encoder_pool {
+    int sws_threads;
+
+    pthread_t *threads;
+    int num_threads;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t job_cond;
+    pthread_cond_t done_cond;
+    struct encode_job *head;
+    struct encode_job *tail;
+    int quit;
+};
+
+unsigned long new_encode_configs_id(void);
+int init_encoder_pool(struct encoder_pool *pool, int threads);
+void destroy_encoder_pool(struct encoder_pool *pool);
+void encoder_pool_submit(struct encoder_pool *pool, struct encode_job *job);
+void encoder_pool_wait(struct encoder_pool *pool, struct encode_job *job);
@@ -1,17 +1,66 @@
+#include <string.h>
 #include <libavformat/avformat.h>
 #include "framecache.h"
+#include "pool.h"
 
-void init_framecache(struct framecache *cache, int first_array_size, long delta, int seek_threshold, int seek_amount) {
-    cache->frames = calloc(sizeof(struct frame), first_array_size);
-    cache->num_allocated_frames = first_array_size;
+#define PTS_INDEX_EMPTY -1
+#define NO_SLOT -1
+
+static inline unsigned int __hash_pts(const struct framecache *cache, long pts) {
+    // Fibonacci hashing: PTS values are usually multiples of delta, so spread them out
+    return (unsigned int)(((unsigned long)pts * 0x9E3779B97F4A7C15UL) >> (64 - cache->pts_index_bits));
+}
+
+static inline unsigned int __pts_index_mask(const struct framecache *cache) {
+    return (1U << cache->pts_index_bits) - 1;
+}
+
+void init_framecache(struct framecache *cache, int max_frames, size_t max_bytes, long delta) {
+    int i;
+
+    cache->frames = calloc(sizeof(struct frame), max_frames);
+    cache->num_allocated_frames = max_frames;
     cache->num_frames = 0;
-    cache->pts_range_end = AV_NOPTS_VALUE;
-    cache->pts_range_start = AV_NOPTS_VALUE;
     cache->pts_last = AV_NOPTS_VALUE;
 
+    cache->lru_head = NO_SLOT;
+    cache->lru_tail = NO_SLOT;
+    // Chain all the slots into the free list
+    for (i = 0; i < max_frames; i++) {
+        cache->frames[i].lru_next = (i + 1 < max_frames) ? i + 1 : NO_SLOT;
+    }
+    cache->free_slots = 0;
+
+    cache->bytes = 0;
+    cache->max_bytes = max_bytes;
+
+    // Keep the load factor of the index at most 50%
+    cache->pts_index_bits = 1;
+    while ((1 << cache->pts_index_bits) < max_frames * 2) {
+        cache->pts_index_bits++;
+    }
+    cache->pts_index = malloc(sizeof(int) << cache->pts_index_bits);
+    for (i = 0; i < (1 << cache->pts_index_bits); i++) {
+        cache->pts_index[i] = PTS_INDEX_EMPTY;
+    }
+    cache->pts_order = malloc(sizeof(int) * max_frames);
+
     cache->delta = delta;
-    cache->seek_threshold = seek_threshold;
-    cache->seek_amount = seek_amount;
+}
+
+static size_t __packet_bytes(const AVPacket *packet) {
+    return packet->buf ? packet->buf->size : (size_t)packet->size;
+}
+
+static size_t __frame_bytes(const AVFrame *avf) {
+    size_t bytes = 0;
+    int i;
+
+    for (i = 0; i < AV_NUM_DATA_POINTERS && avf->buf[i]; i++) {
+        bytes += avf->buf[i]->size;
+    }
+
+    return bytes;
 }
 
 static void __destroy_frame(struct frame *frame) {
@@ -19,121 +68,286 @@ static void __destroy_frame(struct frame *frame) {
 
     for (i = 0; i < sizeof(frame->encoded) / sizeof(frame->encoded[0]); i++) {
         if (frame->encoded[i]) {
-            av_packet_free(&frame->encoded[i]);
+            pool_put_packet(&frame->encoded[i]);
         }
     }
 
-    av_frame_free(&frame->avf);
+    pool_put_frame(&frame->avf);
+    frame->bytes = 0;
 }
 
 void destroy_framecache(struct framecache *cache) {
-    int i;
+    int slot;
 
     if (cache->frames) {
-        for (i = 0; i < cache->num_frames; i++) {
-            __destroy_frame(cache->frames + i);
+        for (slot = cache->lru_head; slot != NO_SLOT; slot = cache->frames[slot].lru_next) {
+            __destroy_frame(cache->frames + slot);
         }
         free(cache->frames);
         cache->frames = NULL;
     }
+    if (cache->pts_index) {
+        free(cache->pts_index);
+        cache->pts_index = NULL;
+    }
+    if (cache->pts_order) {
+        free(cache->pts_order);
+        cache->pts_order = NULL;
+    }
     cache->num_frames = 0;
-    cache->pts_range_end = AV_NOPTS_VALUE;
-    cache->pts_range_start = AV_NOPTS_VALUE;
+    cache->lru_head = NO_SLOT;
+    cache->lru_tail = NO_SLOT;
+    cache->free_slots = NO_SLOT;
+    cache->bytes = 0;
     cache->pts_last = AV_NOPTS_VALUE;
     cache->num_allocated_frames = 0;
 }
 
-static void __recalculate_pts_range(struct framecache *cache) {
-    int i;
+static void __lru_unlink(struct framecache *cache, int slot) {
+    struct frame *frame = cache->frames + slot;
 
-    cache->pts_range_start = AV_NOPTS_VALUE;
-    cache->pts_range_end = AV_NOPTS_VALUE;
+    if (frame->lru_prev != NO_SLOT) {
+        cache->frames[frame->lru_prev].lru_next = frame->lru_next;
+    } else {
+        cache->lru_head = frame->lru_next;
+    }
+    if (frame->lru_next != NO_SLOT) {
+        cache->frames[frame->lru_next].lru_prev = frame->lru_prev;
+    } else {
+        cache->lru_tail = frame->lru_prev;
+    }
+}
 
-    for (i = 0; i < cache->num_frames; i++) {
-        long pts = cache->frames[i].pts;
-        if (cache->pts_range_start == AV_NOPTS_VALUE || cache->pts_range_start > pts) {
-            cache->pts_range_start = pts;
+static void __lru_push_front(struct framecache *cache, int slot) {
+    struct frame *frame = cache->frames + slot;
+
+    frame->lru_prev = NO_SLOT;
+    frame->lru_next = cache->lru_head;
+    if (cache->lru_head != NO_SLOT) {
+        cache->frames[cache->lru_head].lru_prev = slot;
+    } else {
+        cache->lru_tail = slot;
+    }
+    cache->lru_head = slot;
+}
+
+static void __lru_touch(struct framecache *cache, int slot) {
+    if (cache->lru_head != slot) {
+        __lru_unlink(cache, slot);
+        __lru_push_front(cache, slot);
+    }
+}
+
+/**
+ * @brief Look up the position in the index for the PTS
+ *
+ * @return unsigned int The position in pts_index. It points to an empty entry if the PTS is not in the cache.
+ */
+static unsigned int __index_lookup(const struct framecache *cache, long pts) {
+    unsigned int mask = __pts_index_mask(cache);
+    unsigned int i = __hash_pts(cache, pts);
+
+    while (cache->pts_index[i] != PTS_INDEX_EMPTY && cache->frames[cache->pts_index[i]].pts != pts) {
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+static void __index_remove(struct framecache *cache, long pts) {
+    unsigned int mask = __pts_index_mask(cache);
+    unsigned int i = __index_lookup(cache, pts), j, k;
+
+    if (cache->pts_index[i] == PTS_INDEX_EMPTY) {
+        return;
+    }
+    cache->pts_index[i] = PTS_INDEX_EMPTY;
+
+    // Shift back the following entries in the same cluster so that lookups do not stop at the hole
+    for (j = (i + 1) & mask; cache->pts_index[j] != PTS_INDEX_EMPTY; j = (j + 1) & mask) {
+        k = __hash_pts(cache, cache->frames[cache->pts_index[j]].pts);
+
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            cache->pts_index[i] = cache->pts_index[j];
+            cache->pts_index[j] = PTS_INDEX_EMPTY;
+            i = j;
         }
-        if (cache->pts_range_end == AV_NOPTS_VALUE || cache->pts_range_end < pts) {
-            cache->pts_range_end = pts;
+    }
+}
+
+/**
+ * @brief Binary search in the PTS order
+ *
+ * @return int The number of the frames whose PTS is less than or equal to the PTS
+ */
+static int __order_upper_bound(const struct framecache *cache, long pts) {
+    int low = 0, high = cache->num_frames;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+
+        if (cache->frames[cache->pts_order[mid]].pts <= pts) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
     }
+
+    return low;
+}
+
+// Frames are decoded mostly in order, so the moves are usually short
+static void __order_insert(struct framecache *cache, int slot) {
+    int pos = __order_upper_bound(cache, cache->frames[slot].pts);
+
+    memmove(cache->pts_order + pos + 1, cache->pts_order + pos, sizeof(int) * (cache->num_frames - pos));
+    cache->pts_order[pos] = slot;
+}
+
+static void __order_remove(struct framecache *cache, int slot) {
+    int pos = __order_upper_bound(cache, cache->frames[slot].pts) - 1;
+
+    memmove(cache->pts_order + pos, cache->pts_order + pos + 1, sizeof(int) * (cache->num_frames - pos - 1));
+}
+
+static void __evict_lru(struct framecache *cache) {
+    int slot = cache->lru_tail;
+    struct frame *victim = cache->frames + slot;
+
+    __lru_unlink(cache, slot);
+    __index_remove(cache, victim->pts);
+    __order_remove(cache, slot);
+
+    cache->bytes -= victim->bytes;
+    __destroy_frame(victim);
+
+    victim->lru_next = cache->free_slots;
+    cache->free_slots = slot;
+    cache->num_frames--;
+}
+
+/**
+ * @brief Evict the least recently used frames until `incoming` more bytes fit in the budget.
+ *
+ * The most recently used frame is never evicted, so a frame larger than the budget still can be served.
+ */
+static void __make_room(struct framecache *cache, size_t incoming) {
+    while (cache->num_frames > 1 && cache->bytes + incoming > cache->max_bytes) {
+        __evict_lru(cache);
+    }
 }
 
 int add_framecache(struct framecache *cache, AVFrame *frame) {
-    if (cache->num_frames == cache->num_allocated_frames) {
-        //
-        int i, slide = cache->num_allocated_frames / 4;
-        for (i = 0; i < slide; i++) {
-            __destroy_frame(cache->frames + i);
-        }
-        memmove(cache->frames, cache->frames + slide, sizeof(cache->frames[0]) * (cache->num_frames - slide));
+    unsigned int i, pos = __index_lookup(cache, frame->pts);
+    size_t bytes = __frame_bytes(frame);
 
-        cache->num_frames -= slide;
+    cache->pts_last = frame->pts;
 
-        __recalculate_pts_range(cache);
+    if (cache->pts_index[pos] != PTS_INDEX_EMPTY) {
+        // Decoded again after a seek. Keep the cached one, which may have encoded images.
+        __lru_touch(cache, cache->pts_index[pos]);
+        pool_put_frame(&frame);
+        return 0;
     }
-    struct frame *fc_frame = cache->frames + cache->num_frames;
-    unsigned int i;
+
+    if (cache->num_frames == cache->num_allocated_frames) {
+        __evict_lru(cache);
+    }
+    while (cache->num_frames > 0 && cache->bytes + bytes > cache->max_bytes) {
+        __evict_lru(cache);
+    }
+    // The eviction may have shifted the entries
+    pos = __index_lookup(cache, frame->pts);
+
+    int slot = cache->free_slots;
+    struct frame *fc_frame = cache->frames + slot;
+
+    cache->free_slots = fc_frame->lru_next;
 
     fc_frame->avf = frame;
     fc_frame->pts = frame->pts;
+    fc_frame->bytes = bytes;
     for (i = 0; i < sizeof(fc_frame->encoded) / sizeof(fc_frame->encoded[0]); i++) {
         fc_frame->encoded[i] = NULL;
+        fc_frame->encoded_variant[i] = 0;
     }
 
+    cache->pts_index[pos] = slot;
+    __order_insert(cache, slot);
+    __lru_push_front(cache, slot);
+    cache->bytes += bytes;
     cache->num_frames++;
-    if (cache->pts_range_start == AV_NOPTS_VALUE || cache->pts_range_start > frame->pts) {
-        cache->pts_range_start = frame->pts;
-    }
-    if (cache->pts_range_end == AV_NOPTS_VALUE || cache->pts_range_end < frame->pts) {
-        cache->pts_range_end = frame->pts;
+
+    return 0;
+}
+
+/**
+ * @brief Attach an encoded image to a cached frame and charge it to the budget.
+ *
+ * The cache takes the ownership of the packet.
+ */
+int add_encoded_framecache(struct framecache *cache, struct frame *frame, int index, int variant, AVPacket *packet) {
+    int slot = frame - cache->frames;
+    size_t bytes = __packet_bytes(packet);
+
+    if (frame->encoded[index]) {
+        frame->bytes -= __packet_bytes(frame->encoded[index]);
+        cache->bytes -= __packet_bytes(frame->encoded[index]);
+        pool_put_packet(&frame->encoded[index]);
     }
-    cache->pts_last = frame->pts;
+
+    __lru_touch(cache, slot);
+    __make_room(cache, bytes);
+
+    frame->encoded[index] = packet;
+    frame->encoded_variant[index] = variant;
+    frame->bytes += bytes;
+    cache->bytes += bytes;
 
     return 0;
 }
 
+/**
+ * @brief Change the memory budget. Frames over the new budget are evicted at once.
+ */
+void resize_framecache(struct framecache *cache, size_t max_bytes) {
+    cache->max_bytes = max_bytes;
+    __make_room(cache, 0);
+}
+
 /**
  * >= 0 : Found in index
- * -1 : Not in cache. Seek it.
- * -2 : Not in cache. Continue to decode.
+ * -1 : Not in cache. Whether to seek or to continue to decode is up to the caller.
  */
 int find_in_framecache(struct framecache *cache, long pts) {
-    int i;
+    int slot = cache->pts_index[__index_lookup(cache, pts)];
 
-    if (pts >= cache->pts_range_start && pts <= cache->pts_range_end) {
-        for (i = 0; i < cache->num_frames; i++) {
-            if (cache->frames[i].pts == pts) {
-                return i;
-            }
-        }
-    }
-    if ((pts - cache->pts_last) > 0 && (pts - cache->pts_last) < cache->delta * cache->seek_threshold) {
-        return -2;
+    if (slot != PTS_INDEX_EMPTY) {
+        __lru_touch(cache, slot);
+        return slot;
     }
     return -1;
 }
 
 /**
  * @brief Find the nearest frame
- * 
- * @param cache 
- * @param pts 
+ *
+ * The frame covering the PTS is the last one starting at or before the PTS, found by a binary search in the PTS order.
+ *
+ * @param cache
+ * @param pts
  * @return int The index in the cache (>= 0), not in the range (negative)
  */
 int find_nearest_frame(struct framecache *cache, long pts) {
-    int i;
+    int pos = __order_upper_bound(cache, pts) - 1, slot;
 
-    if (pts >= cache->pts_range_start && pts <= cache->pts_range_end) {
-        for (i = 0; i < cache->num_frames; i++) {
-            long frame_pts = cache->frames[i].pts;
-            long frame_duration = cache->frames[i].avf->duration;
-
-            if (frame_pts <= pts && frame_pts + frame_duration > pts) {
-                return i;
-            }
-        }
+    if (pos < 0) {
+        return -1;
+    }
+    slot = cache->pts_order[pos];
+    if (cache->frames[slot].pts + cache->frames[slot].avf->duration > pts) {
+        __lru_touch(cache, slot);
+        return slot;
     }
 
     return -1;
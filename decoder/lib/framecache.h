@@ -1,27 +1,47 @@
 #pragma once
 #include <libavcodec/avcodec.h>
 
+// Encoded images kept per frame (one for each image option)
+#define FRAMECACHE_MAX_IMAGES 24
+
 struct frame {
     long pts;
     AVFrame *avf;
-    AVPacket *encoded[8];
+    AVPacket *encoded[FRAMECACHE_MAX_IMAGES];
+    // Encoder settings of each image (e.g. quality). Only the latest one is kept.
+    int encoded_variant[FRAMECACHE_MAX_IMAGES];
+    // Bytes held by the decoded planes and the encoded images
+    size_t bytes;
+    // LRU list (or the free list for unused slots)
+    int lru_prev;
+    int lru_next;
 };
 
 struct framecache {
-    long pts_range_start;
-    long pts_range_end;
     long pts_last;
     int num_frames;
     int num_allocated_frames;
     struct frame *frames;
+    // LRU list: lru_head is the most recently used frame, lru_tail is the next victim
+    int lru_head;
+    int lru_tail;
+    int free_slots;
+    // Memory budget
+    size_t bytes;
+    size_t max_bytes;
+    // Open addressing hash table (PTS -> slot in frames), -1 means empty
+    int *pts_index;
+    int pts_index_bits;
+    // Slots in the ascending order of PTS (num_frames entries), for find_nearest_frame()
+    int *pts_order;
     // configurations
     long delta;
-    int seek_threshold;
-    int seek_amount;
 };
 
-void init_framecache(struct framecache *cache, int first_array_size, long delta, int seek_threshold, int seek_amount);
+void init_framecache(struct framecache *cache, int max_frames, size_t max_bytes, long delta);
 void destroy_framecache(struct framecache *cache);
 int add_framecache(struct framecache *cache, AVFrame *frame);
+int add_encoded_framecache(struct framecache *cache, struct frame *frame, int index, int variant, AVPacket *packet);
+void resize_framecache(struct framecache *cache, size_t max_bytes);
 int find_in_framecache(struct framecache *cache, long pts);
 int find_nearest_frame(struct framecache *cache, long pts);
@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "frameindex.h"
+#include "indexer.h"
+
+#define FRAME_INDEX_MAGIC "NICMIX01"
+// Bump when the layout of the entries changes
+#define FRAME_INDEX_VERSION 2
+// The content hash covers these blocks spread evenly over the file, including the first and the last
+#define FRAME_INDEX_HASH_BLOCKS 16
+#define FRAME_INDEX_HASH_BLOCK_SIZE 4096
+
+// Distinguishes the temporary sidecars written at once by the threads of a process (nicm daemon, nicm ingest)
+static atomic_int tmp_serial;
+
+struct frame_index_header {
+    char magic[8];
+    uint32_t version;
+    int32_t stream;
+    // Identity of the media file
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash;
+    // Entries following the header
+    int64_t num_entries;
+    uint32_t entry_size;
+    uint32_t reserved;
+};
+
+static uint64_t __fnv1a(uint64_t hash, const uint8_t *p, size_t size) {
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3UL;
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Fill the identity of the media file in the header
+ *
+ * Reading the whole file would take as long as indexing it, so only sampled blocks are hashed.
+ * Together with the size and the mtime, it tells a replaced or rewritten file.
+ */
+static int __identify(const char *media_file, struct frame_index_header *header) {
+    uint8_t block[FRAME_INDEX_HASH_BLOCK_SIZE];
+    uint64_t hash = 0xcbf29ce484222325UL;
+    struct stat st;
+    int fd, i;
+
+    if ((fd = open(media_file, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "[frameindex] Cannot open %s: %s\n", media_file, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    for (i = 0; i < FRAME_INDEX_HASH_BLOCKS; i++) {
+        off_t last = st.st_size > FRAME_INDEX_HASH_BLOCK_SIZE ? st.st_size - FRAME_INDEX_HASH_BLOCK_SIZE : 0;
+        off_t offset = last * i / (FRAME_INDEX_HASH_BLOCKS - 1);
+        ssize_t ret = pread(fd, block, sizeof(block), offset);
+
+        if (ret < 0) {
+            fprintf(stderr, "[frameindex] Cannot read %s: %s\n", media_file, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        hash = __fnv1a(hash, block, ret);
+    }
+    close(fd);
+
+    header->size = st.st_size;
+    header->mtime_sec = st.st_mtim.tv_sec;
+    header->mtime_nsec = st.st_mtim.tv_nsec;
+    header->hash = hash;
+
+    return 0;
+}
+
+// Each stream has its own sidecar, so indexing another stream does not replace it
+static void __sidecar_path(const char *media_file, int stream, char *path, size_t size) {
+    snprintf(path, size, "%s.%d%s", media_file, stream, FRAME_INDEX_SUFFIX);
+}
+
+/**
+ * @brief Map the sidecar of the media file if it is up to date
+ *
+ * @return int 0 if mapped (release it with release_frame_index()), negative if missing or stale
+ */
+int open_frame_index(struct frame_index *index, const char *media_file, int stream) {
+    struct frame_index_header expected;
+    const struct frame_index_header *header;
+    struct stat st;
+    char path[4096];
+    void *map;
+    int fd;
+
+    memset(index, 0, sizeof(*index));
+
+    __sidecar_path(media_file, stream, path, sizeof(path));
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header)) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    header = map;
+    if (memcmp(header->magic, FRAME_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != FRAME_INDEX_VERSION ||
+        header->stream != stream ||
+        header->entry_size != sizeof(struct video_stream_frame_index) ||
+        header->num_entries <= 0 || header->num_entries > INT32_MAX ||
+        (uint64_t)st.st_size != sizeof(*header) + header->num_entries * header->entry_size) {
+        fprintf(stderr, "[frameindex] %s is broken or of another version\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    if (__identify(media_file, &expected) != 0 ||
+        header->size != expected.size || header->mtime_sec != expected.mtime_sec ||
+        header->mtime_nsec != expected.mtime_nsec || header->hash != expected.hash) {
+        fprintf(stderr, "[frameindex] %s is stale\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    index->map = map;
+    index->map_size = st.st_size;
+    index->entries = (struct video_stream_frame_index *)((uint8_t *)map + sizeof(*header));
+    index->num_entries = header->num_entries;
+
+    return 0;
+}
+
+static int __write_all(int fd, const void *data, size_t size) {
+    const uint8_t *p = data;
+
+    while (size > 0) {
+        ssize_t ret = write(fd, p, size);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write the index to the sidecar of the media file, replacing the old one
+ *
+ * @return int 0 on success
+ */
+int save_frame_index(const struct frame_index *index, const char *media_file, int stream) {
+    struct frame_index_header header;
+    char path[4096], tmp_path[4096 + 32];
+    int fd;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FRAME_INDEX_MAGIC, sizeof(header.magic));
+    header.version = FRAME_INDEX_VERSION;
+    header.stream = stream;
+    header.num_entries = index->num_entries;
+    header.entry_size = sizeof(struct video_stream_frame_index);
+    if (__identify(media_file, &header) != 0) {
+        return -1;
+    }
+
+    __sidecar_path(media_file, stream, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d.%d", path, (int)getpid(), atomic_fetch_add(&tmp_serial, 1));
+
+    if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        fprintf(stderr, "[frameindex] Cannot create %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+    if (__write_all(fd, &header, sizeof(header)) != 0 ||
+        __write_all(fd, index->entries, sizeof(struct video_stream_frame_index) * index->num_entries) != 0) {
+        fprintf(stderr, "[frameindex] Cannot write %s: %s\n", tmp_path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp_path, path) != 0) {
+        fprintf(stderr, "[frameindex] Cannot rename %s: %s\n", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Load the index of the stream from the sidecar, or build it and save the sidecar
+ *
+ * After building, the demuxer and the decoder are rewound to the beginning of the file.
+ * A sidecar which cannot be written (e.g. a read-only directory) is not an error.
+ *
+ * @return int 0 on success
+ */
+int load_frame_index(struct frame_index *index, const char *media_file, AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec, const struct file_open_options *opts) {
+    int ret;
+
+    if (open_frame_index(index, media_file, stream->index) == 0) {
+        fprintf(stderr, "[frameindex] Loaded the index of %s (%d frames)\n", media_file, index->num_entries);
+        return 0;
+    }
+
+    fprintf(stderr, "[frameindex] Building the index of %s...\n", media_file);
+    index->entries = build_index_file(media_file, avf_context, stream, codec, opts, &index->num_entries);
+    if (!index->entries || index->num_entries == 0) {
+        release_frame_index(index);
+        return -1;
+    }
+
+    if ((ret = av_seek_frame(avf_context, -1, 0, AVSEEK_FLAG_BYTE)) < 0) {
+        print_av_error(stderr, "[frameindex] Failed to rewind", ret);
+    }
+    avcodec_flush_buffers(codec);
+
+    if (save_frame_index(index, media_file, stream->index) != 0) {
+        fprintf(stderr, "[frameindex] Warning: Failed to save the index. It will be built again next time.\n");
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Add entries to the index on the heap, keeping it sorted by PTS
+ *
+ * The entries come a GOP at a time and go at or near the end, so they are insertion sorted.
+ *
+ * @return int 0 on success
+ */
+int append_frame_index(struct frame_index *index, const struct video_stream_frame_index *entries, int num) {
+    int i;
+
+    if (index->map) {
+        return -1;
+    }
+    if (index->num_entries + num > index->allocated) {
+        int allocated = index->allocated > 0 ? index->allocated * 2 : 4096;
+
+        while (allocated < index->num_entries + num) {
+            allocated *= 2;
+        }
+        index->entries = realloc(index->entries, sizeof(*index->entries) * allocated);
+        index->allocated = allocated;
+    }
+
+    for (i = 0; i < num; i++) {
+        int j = index->num_entries++;
+
+        while (j > 0 && index->entries[j - 1].pts > entries[i].pts) {
+            index->entries[j] = index->entries[j - 1];
+            j--;
+        }
+        index->entries[j] = entries[i];
+    }
+
+    return 0;
+}
+
+void release_frame_index(struct frame_index *index) {
+    if (index->map) {
+        munmap(index->map, index->map_size);
+    } else {
+        free(index->entries);
+    }
+    memset(index, 0, sizeof(*index));
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <stdint.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include "helper.h"
+
+/*
+ * Frame index kept in a sidecar file (MEDIA.STREAM.nidx) across runs
+ *
+ * Building an index reads the whole file, so it is done once and saved next to the media file.
+ * The sidecar is a fixed header followed by the entries as they are in memory, so it is used
+ * straight from a read-only mapping. It is valid only for the same stream of the same file:
+ * the size, the mtime and a hash of sampled blocks of the file must match. Otherwise it is
+ * rebuilt. The sidecar is written to a temporary name and renamed, so readers never see a partial one.
+ */
+
+#define FRAME_INDEX_SUFFIX ".nidx"
+
+struct frame_index {
+    struct video_stream_frame_index *entries;
+    int num_entries;
+    // Mapping of the sidecar, or NULL if the entries are on the heap
+    void *map;
+    size_t map_size;
+    // Entries allocated on the heap by append_frame_index()
+    int allocated;
+};
+
+int load_frame_index(struct frame_index *index, const char *media_file, AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec, const struct file_open_options *opts);
+int open_frame_index(struct frame_index *index, const char *media_file, int stream);
+int save_frame_index(const struct frame_index *index, const char *media_file, int stream);
+int append_frame_index(struct frame_index *index, const struct video_stream_frame_index *entries, int num);
+void release_frame_index(struct frame_index *index);
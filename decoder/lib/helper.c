@@ -1,4 +1,5 @@
 #include "helper.h"
+#include "trace.h"
 #include "../nicm.h"
 
 const struct file_open_options DEFAULT_OPTS = {
@@ -30,6 +31,11 @@ int open_file_with_opts(const char *ts_file, AVFormatContext **avf_context, cons
     av_dict_set_int(&opts, "probesize", (open_opts->probe_size == 0 ? DEFAULT_OPTS.probe_size : open_opts->probe_size), 0);
     av_dict_set_int(&opts, "analyzeduration", (open_opts->analyze_duration == 0 ? DEFAULT_OPTS.analyze_duration : open_opts->analyze_duration), 0);
     av_dict_set_int(&opts, "skip_initial_bytes", open_opts->skip_initial_bytes, 0);
+    if (open_opts->follow_timeout > 0) {
+        // The end of the file is not the end of the stream while it is recorded
+        av_dict_set_int(&opts, "follow", 1, 0);
+        av_dict_set_int(&opts, "rw_timeout", open_opts->follow_timeout, 0);
+    }
 
     fprintf(stderr, "open_file: probesize = %s, analyze_duration = %s, skip_initial_bytes = %s\n",
         safe_av_dict_get(opts, "probesize"), safe_av_dict_get(opts, "analyzeduration"), safe_av_dict_get(opts, "skip_initial_bytes")
@@ -47,83 +53,107 @@ int open_file(const char *ts_file, AVFormatContext **avf_context) {
     return open_file_with_opts(ts_file, avf_context, NULL);
 }
 
-AVCodecContext *open_decoder_for_stream(AVStream *stream) {
-    const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
-    AVCodecContext *context = avcodec_alloc_context3(codec);
-
-    avcodec_parameters_to_context(context, stream->codecpar);
-    avcodec_open2(context, codec, NULL);
-
-    return context;
+static int thread_type_flags(enum NICM_THREAD_TYPE type) {
+    switch (type) {
+        case THREAD_TYPE_FRAME:
+            return FF_THREAD_FRAME;
+        case THREAD_TYPE_SLICE:
+            return FF_THREAD_SLICE;
+        default:
+            return FF_THREAD_FRAME | FF_THREAD_SLICE;
+    }
 }
 
-void print_av_error(FILE *fp, const char *prefix, int ret) {
-    char err[1024];
-
-    av_strerror(ret, err, sizeof(err));
-
-    fprintf(fp, "%s: %s\n", prefix, err);
+static const char *thread_type_string(enum NICM_THREAD_TYPE type) {
+    switch (type) {
+        case THREAD_TYPE_FRAME:
+            return "frame";
+        case THREAD_TYPE_SLICE:
+            return "slice";
+        default:
+            return "frame+slice";
+    }
 }
 
-#define ALLOC_FRAMES 10240
-
-struct video_stream_frame_index *build_index_stream(AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec, int *frames) {
-    AVFrame *frame = av_frame_alloc();
-    AVPacket *packet = av_packet_alloc();
+/**
+ * @brief avformat_find_stream_info() with the decoder threading options applied to the probing decoders
+ *
+ * Only the options given explicitly are applied. Otherwise the probing decoders keep the default of libavformat (1 thread),
+ * since spawning the threads of every decoder costs more than the few frames decoded for probing.
+ */
+int find_stream_info_with_opts(AVFormatContext *avf_context, const struct file_open_options *open_opts) {
+    AVDictionary **opts;
+    unsigned int i;
     int ret;
 
-    struct video_stream_frame_index *indices = calloc(sizeof(*indices), ALLOC_FRAMES);
-    int num_indices = 0;
-    int num_buf = ALLOC_FRAMES;
+    if (open_opts == NULL) {
+        open_opts = &DEFAULT_OPTS;
+    }
 
-    while ((ret = av_read_frame(avf_context, packet)) == 0) {
-        if (packet->stream_index != stream->index) {
-            goto free_packet;
+    opts = calloc(avf_context->nb_streams, sizeof(*opts));
+    for (i = 0; i < avf_context->nb_streams; i++) {
+        if (open_opts->threads > 0) {
+            av_dict_set_int(&opts[i], "threads", open_opts->threads, 0);
         }
-        if (packet->flags & AV_PKT_FLAG_CORRUPT) {
-            goto free_packet;
+        if (open_opts->thread_type != THREAD_TYPE_DEFAULT) {
+            av_dict_set(&opts[i], "thread_type", thread_type_string(open_opts->thread_type), 0);
         }
+    }
 
-        ret = avcodec_send_packet(codec, packet);
-        if (ret == 0) {
-            ret = avcodec_receive_frame(codec, frame);
-            if (ret == 0) {
-                if (num_buf >= num_indices) {
-                    num_buf += ALLOC_FRAMES;
-                    indices = realloc(indices, sizeof(*indices) * num_buf);
-                }
+    ret = avformat_find_stream_info(avf_context, opts);
 
-                indices[num_indices].pts = frame->pts;
-                indices[num_indices].pos = packet->pos;
+    for (i = 0; i < avf_context->nb_streams; i++) {
+        av_dict_free(&opts[i]);
+    }
+    free(opts);
 
-                num_indices++;
+    return ret;
+}
 
-                av_frame_unref(frame);
-            } else if (ret != AVERROR(EAGAIN)) {
-                av_packet_free(&packet);
-                av_frame_free(&frame);
+/**
+ * @brief Open the decoder for the stream
+ *
+ * @param default_thread_type Threading used when not specified in the options.
+ *     Frame threading gives the best throughput but delays each frame by the number of threads,
+ *     so latency sensitive users should prefer slice threading.
+ */
+AVCodecContext *open_decoder_for_stream(AVStream *stream, const struct file_open_options *open_opts, enum NICM_THREAD_TYPE default_thread_type) {
+    const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    AVCodecContext *context = avcodec_alloc_context3(codec);
+    enum NICM_THREAD_TYPE thread_type;
 
-                free(indices);
+    if (open_opts == NULL) {
+        open_opts = &DEFAULT_OPTS;
+    }
+    thread_type = open_opts->thread_type != THREAD_TYPE_DEFAULT ? open_opts->thread_type : default_thread_type;
 
-                return NULL;
-            }
-        }
+    avcodec_parameters_to_context(context, stream->codecpar);
 
-free_packet:
-        av_packet_unref(packet);
+    context->thread_count = open_opts->threads;
+    context->thread_type = thread_type_flags(thread_type);
+
+    if (avcodec_open2(context, codec, NULL) != 0) {
+        avcodec_free_context(&context);
+        return NULL;
     }
+    fprintf(stderr, "open_decoder_for_stream: %s, threads = %d (%s)\n",
+        codec->name, context->thread_count, thread_type_string(thread_type));
+
+    return context;
+}
+
+void print_av_error(FILE *fp, const char *prefix, int ret) {
+    char err[1024];
 
-    av_packet_free(&packet);
-    av_frame_free(&frame);
+    av_strerror(ret, err, sizeof(err));
 
-    *frames = num_indices;
-    return indices;
+    fprintf(fp, "%s: %s\n", prefix, err);
 }
 
 static int compare_stream_frame_index(const void *a, const void *b) {
     const struct video_stream_frame_index *ia = a, *ib = b;
 
-    return ia->pts - ib->pts;
+    return (ia->pts > ib->pts) - (ia->pts < ib->pts);
 }
 
 struct video_stream_frame_index *find_index(struct video_stream_frame_index *indices, int num, unsigned long pts) {
@@ -132,21 +162,24 @@ struct video_stream_frame_index *find_index(struct video_stream_frame_index *ind
     return bsearch(&key, indices, num, sizeof(*indices), compare_stream_frame_index);
 }
 
+/**
+ * @brief Find the last frame presented at or before the PTS (the first frame if none)
+ */
 struct video_stream_frame_index *nearest_earlier_index(struct video_stream_frame_index *indices, int num, unsigned long pts) {
-    // should do binary search, but...
-    int i;
+    int low = 0, high = num;
 
-    if (indices[0].pts > pts) {
-        return indices;
-    }
+    // The first frame after the PTS is in [low, high]
+    while (low < high) {
+        int mid = low + (high - low) / 2;
 
-    for (i = 1; i < num; i++) {
-        if (indices[i].pts > pts) {
-            break;
+        if (indices[mid].pts > pts) {
+            high = mid;
+        } else {
+            low = mid + 1;
         }
     }
 
-    return indices + i - 1;
+    return indices + (low > 0 ? low - 1 : 0);
 }
 
 int seek_frame(AVFormatContext *avf_context, AVStream *stream, unsigned long pts, struct video_stream_frame_index *indices, int frames_in_indices) {
@@ -160,11 +193,12 @@ int seek_frame(AVFormatContext *avf_context, AVStream *stream, unsigned long pts
                 fprintf(stderr, "Failed to find the index for %ld\n", pts);
                 return -1;
             }
-            fprintf(stderr, "Use non-exact match for %ld\n", pts);
+            TRACE_INSTANT(TRACE_LEVEL_DEBUG, "index_inexact", "pts", pts, 0);
         }
 
-        fprintf(stderr, "Found the index: pts = %ld, pos = %ld\n", index->pts, index->pos);
-        if ((ret = av_seek_frame(avf_context, stream->index, index->pos, AVSEEK_FLAG_BYTE)) < 0) {
+        // Start from the keyframe the frame is decoded from, so that the decoder gets a whole GOP
+        TRACE_INSTANT(TRACE_LEVEL_DEBUG, "index_seek", "pts,pos", index->pts, index->key_pos);
+        if ((ret = av_seek_frame(avf_context, stream->index, index->key_pos, AVSEEK_FLAG_BYTE)) < 0) {
             fprintf(stderr, "av_seek_frame() = %d\n", ret);
             return ret;
         }
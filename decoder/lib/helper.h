@@ -7,14 +7,30 @@
 
 int open_file(const char *ts_file, AVFormatContext **avf_context);
 int open_file_with_opts(const char *ts_file, AVFormatContext **avf_context, const struct file_open_options *open_opts);
-AVCodecContext *open_decoder_for_stream(AVStream *stream);
+int find_stream_info_with_opts(AVFormatContext *avf_context, const struct file_open_options *open_opts);
+AVCodecContext *open_decoder_for_stream(AVStream *stream, const struct file_open_options *open_opts, enum NICM_THREAD_TYPE default_thread_type);
 void print_av_error(FILE *fp, const char *prefix, int ret);
 
+/*
+ * Entry of the frame index, in presentation order
+ *
+ * Decoding a frame starts from key_pos, the keyframe of its GOP (or of the previous GOP for
+ * a leading frame of an open GOP). The decode order and the GOP are counted from the first keyframe.
+ */
 struct video_stream_frame_index {
     unsigned long pts;
+    // Position of the packet of the frame
     unsigned long pos;
+    unsigned long key_pos;
+    unsigned int decode_order;
+    unsigned int gop;
+    unsigned int flags;
+    unsigned int reserved;
 };
-struct video_stream_frame_index *build_index_stream(AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec, int *frames);
+
+#define FRAME_INDEX_FLAG_KEY 1
+// Presented before the keyframe of its GOP
+#define FRAME_INDEX_FLAG_LEADING 2
 struct video_stream_frame_index *find_index(struct video_stream_frame_index *indices, int num, unsigned long pts);
 struct video_stream_frame_index *nearest_earlier_index(struct video_stream_frame_index *indices, int num, unsigned long pts);
 
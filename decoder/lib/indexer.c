@@ -0,0 +1,582 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "indexer.h"
+#include "pool.h"
+
+#define ALLOC_FRAMES 10240
+
+// A packet of the stream in decode order
+struct index_packet {
+    long pts;
+    long pos;
+    int key;
+};
+
+// A byte range of the file indexed by a thread
+struct index_range {
+    pthread_t thread;
+    const char *file;
+    const AVStream *stream;
+    const struct file_open_options *opts;
+    long start;
+    long end;
+    struct index_entries result;
+    int started;
+    int error;
+};
+
+/**
+ * @brief Append an entry. The keyframe of a leading frame is fixed by __finish_entries().
+ */
+static void __append_entry(struct index_entries *e, unsigned long pts, unsigned long pos, unsigned long key_pos, unsigned int decode_order, unsigned int flags) {
+    struct video_stream_frame_index *entry;
+
+    if (e->num >= e->allocated) {
+        e->allocated += ALLOC_FRAMES;
+        e->entries = realloc(e->entries, sizeof(*e->entries) * e->allocated);
+    }
+    entry = e->entries + e->num++;
+    entry->pts = pts;
+    entry->pos = pos;
+    entry->key_pos = key_pos;
+    entry->decode_order = decode_order;
+    entry->gop = e->keyframes - 1;
+    entry->flags = flags;
+    entry->reserved = 0;
+}
+
+/**
+ * @brief Read the packets of the stream until the first keyframe at or after end_pos
+ *
+ * @param end_pos Negative: the end of the file
+ * @param stop_pos Position of the keyframe the reading stopped at (negative: the end of the file)
+ * @return struct index_packet* The packets in decode order, or NULL if none
+ */
+static struct index_packet *__read_packets(AVFormatContext *avf_context, AVStream *stream, long end_pos, int *num_packets, long *stop_pos) {
+    AVPacket *packet = pool_get_packet();
+    struct index_packet *packets = NULL;
+    int num = 0, allocated = 0;
+
+    *stop_pos = -1;
+    while (av_read_frame(avf_context, packet) == 0) {
+        if (packet->stream_index == stream->index && !(packet->flags & AV_PKT_FLAG_CORRUPT) && packet->pos >= 0) {
+            if (end_pos >= 0 && packet->pos >= end_pos && (packet->flags & AV_PKT_FLAG_KEY)) {
+                *stop_pos = packet->pos;
+                av_packet_unref(packet);
+                break;
+            }
+            if (num >= allocated) {
+                allocated += ALLOC_FRAMES;
+                packets = realloc(packets, sizeof(*packets) * allocated);
+            }
+            packets[num].pts = packet->pts;
+            packets[num].pos = packet->pos;
+            packets[num].key = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+            num++;
+        }
+        av_packet_unref(packet);
+    }
+    pool_put_packet(&packet);
+
+    *num_packets = num;
+    return packets;
+}
+
+/**
+ * @brief Index the frames from the decoder. The frames of a decoded GOP all have the order of the keyframe.
+ *
+ * @param first Set while no frame of the GOP is indexed yet. The first one is the keyframe.
+ */
+static void __receive_frames(AVCodecContext *codec, AVFrame *frame, long key_pos, unsigned int decode_order, int *first, struct index_entries *e) {
+    while (avcodec_receive_frame(codec, frame) == 0) {
+        if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+            __append_entry(e, frame->best_effort_timestamp, key_pos, key_pos, decode_order, *first ? FRAME_INDEX_FLAG_KEY : 0);
+            *first = 0;
+        }
+        av_frame_unref(frame);
+    }
+}
+
+/**
+ * @brief Decode a GOP to learn the PTS of its frames, for a container without them
+ *
+ * The frames get the position of the keyframe, where decoding them has to start anyway.
+ *
+ * @param end_pos Position of the next keyframe (negative: the end of the file)
+ */
+static int __decode_gop(AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec, long key_pos, long end_pos, unsigned int decode_order, struct index_entries *e) {
+    AVPacket *packet = pool_get_packet();
+    AVFrame *frame = pool_get_frame();
+    int ret, first = 1;
+
+    if ((ret = av_seek_frame(avf_context, stream->index, key_pos, AVSEEK_FLAG_BYTE)) < 0) {
+        print_av_error(stderr, "[indexer] Failed to seek to the GOP", ret);
+        pool_put_packet(&packet);
+        pool_put_frame(&frame);
+        return ret;
+    }
+    avcodec_flush_buffers(codec);
+
+    while (av_read_frame(avf_context, packet) == 0) {
+        if (packet->stream_index == stream->index) {
+            if (end_pos >= 0 && packet->pos >= end_pos) {
+                av_packet_unref(packet);
+                break;
+            }
+            if (packet->pos >= key_pos && avcodec_send_packet(codec, packet) == 0) {
+                __receive_frames(codec, frame, key_pos, decode_order, &first, e);
+            }
+        }
+        av_packet_unref(packet);
+    }
+
+    // Drain the frames held for reordering
+    avcodec_send_packet(codec, NULL);
+    __receive_frames(codec, frame, key_pos, decode_order, &first, e);
+    avcodec_flush_buffers(codec);
+
+    pool_put_packet(&packet);
+    pool_put_frame(&frame);
+
+    return 0;
+}
+
+/**
+ * @brief Index a GOP, from its keyframe to the packet before the next keyframe
+ *
+ * @param decode_order Decode order of the keyframe
+ * @param first_pts Frames presented before it are left out (AV_NOPTS_VALUE: none)
+ * @param end_pos Position of the next keyframe (negative: the end of the file)
+ * @return int 0 on success
+ */
+static int __index_gop(AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec, const struct index_packet *gop, int num, unsigned int decode_order, long first_pts, long end_pos, struct index_entries *e) {
+    long key_pts = gop[0].pts, key_pos = gop[0].pos;
+    int i, missing = 0;
+
+    e->keyframes++;
+    for (i = 0; i < num; i++) {
+        if (gop[i].pts == AV_NOPTS_VALUE) {
+            missing = 1;
+        }
+    }
+
+    if (missing) {
+        if (__decode_gop(avf_context, stream, codec, key_pos, end_pos, decode_order, e) != 0) {
+            return -1;
+        }
+        e->decoded_gops++;
+        return 0;
+    }
+    for (i = 0; i < num; i++) {
+        if (first_pts == AV_NOPTS_VALUE || gop[i].pts >= first_pts) {
+            __append_entry(e, gop[i].pts, gop[i].pos, key_pos, decode_order + i,
+                (gop[i].key ? FRAME_INDEX_FLAG_KEY : 0) | (gop[i].pts < key_pts ? FRAME_INDEX_FLAG_LEADING : 0));
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Index the GOPs starting from the current position up to the first keyframe at or after end_pos
+ *
+ * Packets before the first keyframe cannot be decoded. At the beginning of the file, neither can
+ * the frames presented before it (the leading frames of an open GOP), so they are left out.
+ * In the middle of the file, the leading frames belong to the range and are kept.
+ *
+ * @param first_range The range starts at the beginning of the file
+ * @return int 0 on success
+ */
+static int __index_range(AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec, long end_pos, int first_range, struct index_entries *e) {
+    struct index_packet *packets;
+    int num_packets, first, i, j;
+    long first_pts, stop_pos;
+
+    packets = __read_packets(avf_context, stream, end_pos, &num_packets, &stop_pos);
+    if (!packets) {
+        return 0;
+    }
+
+    for (first = 0; first < num_packets && !packets[first].key; first++) {
+    }
+    if (first == num_packets) {
+        if (!first_range) {
+            // The GOP spans the whole range. The previous range has read it.
+            free(packets);
+            return 0;
+        }
+        // No keyframe flags from the container. Trust the first packet.
+        first = 0;
+    }
+    first_pts = first_range ? packets[first].pts : AV_NOPTS_VALUE;
+
+    e->packets += num_packets - first;
+
+    // A GOP is from a keyframe to the next one
+    for (i = first; i < num_packets; i = j) {
+        for (j = i + 1; j < num_packets && !packets[j].key; j++) {
+        }
+        if (__index_gop(avf_context, stream, codec, packets + i, j - i, i - first, first_pts, j < num_packets ? packets[j].pos : stop_pos, e) != 0) {
+            free(packets);
+            return -1;
+        }
+    }
+    free(packets);
+
+    return 0;
+}
+
+static int __compare_entry(const void *a, const void *b) {
+    const struct video_stream_frame_index *ia = a, *ib = b;
+
+    return (ia->pts > ib->pts) - (ia->pts < ib->pts);
+}
+
+/**
+ * @brief Sort the entries in presentation order and hand them over
+ *
+ * A frame indexed twice (duplicated across GOPs, or at the seam of two ranges) is indexed once.
+ * A leading frame of an open GOP refers to the previous GOP, so decoding it starts from the
+ * keyframe of the previous GOP.
+ */
+static struct video_stream_frame_index *__finish_entries(struct index_entries *e, int ranges, int *frames) {
+    long *key_pos;
+    int i, j;
+
+    if (e->num == 0) {
+        free(e->entries);
+        return NULL;
+    }
+
+    key_pos = malloc(sizeof(*key_pos) * e->keyframes);
+    for (i = 0; i < e->keyframes; i++) {
+        key_pos[i] = -1;
+    }
+    for (i = 0; i < e->num; i++) {
+        key_pos[e->entries[i].gop] = e->entries[i].key_pos;
+    }
+    for (i = 0; i < e->num; i++) {
+        struct video_stream_frame_index *entry = e->entries + i;
+
+        if ((entry->flags & FRAME_INDEX_FLAG_LEADING) && entry->gop > 0 && key_pos[entry->gop - 1] >= 0) {
+            entry->key_pos = key_pos[entry->gop - 1];
+        }
+    }
+    free(key_pos);
+
+    qsort(e->entries, e->num, sizeof(*e->entries), __compare_entry);
+    for (i = 1, j = 1; i < e->num; i++) {
+        if (e->entries[i].pts != e->entries[j - 1].pts) {
+            e->entries[j++] = e->entries[i];
+        }
+    }
+    e->num = j;
+
+    fprintf(stderr, "[indexer] %d frames, %d GOPs (%d decoded for the missing PTS) in %d range(s)\n",
+        e->num, e->keyframes, e->decoded_gops, ranges);
+
+    *frames = e->num;
+    return e->entries;
+}
+
+/**
+ * @brief Build the index of the stream, reading the file from the current position to the end
+ *
+ * A frame is indexed at the position of its own packet.
+ *
+ * @param codec Decoder of the stream, used only for the GOPs without PTS
+ * @return struct video_stream_frame_index* Entries sorted by PTS (free()), or NULL on error
+ */
+struct video_stream_frame_index *build_index_stream(AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec, int *frames) {
+    struct index_entries e = {};
+
+    if (__index_range(avf_context, stream, codec, -1, 1, &e) != 0) {
+        free(e.entries);
+        return NULL;
+    }
+
+    return __finish_entries(&e, 1, frames);
+}
+
+/**
+ * @brief Index a byte range of the file with its own demuxer and decoder
+ *
+ * The demuxer resynchronizes at the first TS packet of the range, and indexing starts from
+ * the first keyframe after it. The last GOP is read past the end of the range up to the next
+ * keyframe, which is where the next range starts.
+ */
+static void *__range_worker(void *arg) {
+    struct index_range *range = arg;
+    struct file_open_options opts = *range->opts;
+    AVFormatContext *avf_context = NULL;
+    AVCodecContext *codec = NULL;
+    AVStream *stream;
+    int ret;
+
+    // The streams are known from the main demuxer. Only the PMT is needed to map the packets.
+    opts.analyze_duration = INDEX_RANGE_ANALYZE_DURATION;
+    // The ranges are the parallelism. A decoder is needed only for the GOPs without PTS.
+    opts.threads = 1;
+
+    if ((ret = open_file_with_opts(range->file, &avf_context, &opts)) < 0) {
+        print_av_error(stderr, "[indexer] Failed to open the file", ret);
+        range->error = 1;
+        return NULL;
+    }
+    if ((ret = find_stream_info_with_opts(avf_context, &opts)) < 0 ||
+        (unsigned int)range->stream->index >= avf_context->nb_streams ||
+        avf_context->streams[range->stream->index]->codecpar->codec_id != range->stream->codecpar->codec_id) {
+        fprintf(stderr, "[indexer] Stream #%d is not found in the range from %ld\n", range->stream->index, range->start);
+        range->error = 1;
+        goto end;
+    }
+    stream = avf_context->streams[range->stream->index];
+
+    if ((ret = av_seek_frame(avf_context, -1, range->start, AVSEEK_FLAG_BYTE)) < 0) {
+        print_av_error(stderr, "[indexer] Failed to seek to the range", ret);
+        range->error = 1;
+        goto end;
+    }
+    if (!(codec = open_decoder_for_stream(stream, &opts, THREAD_TYPE_SLICE))) {
+        fprintf(stderr, "[indexer] Failed to open the decoder\n");
+        range->error = 1;
+        goto end;
+    }
+
+    if (__index_range(avf_context, stream, codec, range->end, range->start == 0, &range->result) != 0) {
+        range->error = 1;
+    }
+
+end:
+    avcodec_free_context(&codec);
+    avformat_close_input(&avf_context);
+
+    return NULL;
+}
+
+/**
+ * @brief Build the index of a TS file in byte ranges indexed in parallel
+ *
+ * Other containers do not resynchronize at an arbitrary byte, and small files are not worth
+ * the threads, so they are indexed by build_index_stream(). So is a file whose ranges fail.
+ *
+ * @param file Path of the file opened by avf_context
+ * @param avf_context Demuxer at the beginning of the file, used when not split
+ * @return struct video_stream_frame_index* Entries sorted by PTS (free()), or NULL on error
+ */
+struct video_stream_frame_index *build_index_file(const char *file, AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec, const struct file_open_options *opts, int *frames) {
+    struct index_range *ranges;
+    struct index_entries e = {};
+    int64_t size = avf_context->pb ? avio_size(avf_context->pb) : -1;
+    int jobs = opts ? opts->index_jobs : 0, i, error = 0;
+
+    if (jobs > 1 && size > 0 && size / jobs < INDEX_MIN_RANGE_SIZE) {
+        jobs = size / INDEX_MIN_RANGE_SIZE;
+    }
+    if (jobs <= 1 || strcmp(avf_context->iformat->name, "mpegts") != 0) {
+        return build_index_stream(avf_context, stream, codec, frames);
+    }
+
+    ranges = calloc(jobs, sizeof(*ranges));
+    for (i = 0; i < jobs; i++) {
+        ranges[i].file = file;
+        ranges[i].stream = stream;
+        ranges[i].opts = opts;
+        ranges[i].start = size * i / jobs / TS_PACKET_SIZE * TS_PACKET_SIZE;
+        ranges[i].end = i + 1 < jobs ? size * (i + 1) / jobs / TS_PACKET_SIZE * TS_PACKET_SIZE : -1;
+    }
+    fprintf(stderr, "[indexer] Indexing %s in %d ranges\n", file, jobs);
+
+    for (i = 0; i < jobs; i++) {
+        if (pthread_create(&ranges[i].thread, NULL, __range_worker, ranges + i) == 0) {
+            ranges[i].started = 1;
+        } else {
+            ranges[i].error = 1;
+        }
+    }
+    for (i = 0; i < jobs; i++) {
+        if (ranges[i].started) {
+            pthread_join(ranges[i].thread, NULL);
+        }
+        error |= ranges[i].error;
+    }
+
+    // Merge the partial indexes, continuing the decode order and the GOPs of the previous range.
+    // The seams are sorted out with the duplicates.
+    for (i = 0; i < jobs; i++) {
+        struct index_entries *r = &ranges[i].result;
+        int k;
+
+        if (!error && r->num > 0) {
+            if (e.num + r->num > e.allocated) {
+                e.allocated = e.num + r->num;
+                e.entries = realloc(e.entries, sizeof(*e.entries) * e.allocated);
+            }
+            for (k = 0; k < r->num; k++) {
+                e.entries[e.num + k] = r->entries[k];
+                e.entries[e.num + k].decode_order += e.packets;
+                e.entries[e.num + k].gop += e.keyframes;
+            }
+            e.num += r->num;
+        }
+        e.packets += r->packets;
+        e.keyframes += r->keyframes;
+        e.decoded_gops += r->decoded_gops;
+        free(r->entries);
+    }
+    free(ranges);
+
+    if (error) {
+        fprintf(stderr, "[indexer] Warning: Failed to index the ranges. Indexing the whole file instead.\n");
+        free(e.entries);
+        return build_index_stream(avf_context, stream, codec, frames);
+    }
+
+    return __finish_entries(&e, jobs, frames);
+}
+
+/**
+ * @brief Open the file being recorded to index the stream as it grows
+ *
+ * The options must have follow_timeout. When the file does not grow for it, the recording is over.
+ *
+ * @param interrupt Checked while waiting for the file to grow (optional)
+ * @return int 0 on success
+ */
+int open_index_follower(struct index_follower *f, const char *file, int stream, const struct file_open_options *opts, const AVIOInterruptCB *interrupt) {
+    struct file_open_options follow_opts = *opts;
+    int ret;
+
+    memset(f, 0, sizeof(*f));
+    f->last_key_pos = -1;
+    // A decoder is needed only for the GOPs without PTS
+    follow_opts.threads = 1;
+
+    f->avf_context = avformat_alloc_context();
+    if (interrupt) {
+        f->avf_context->interrupt_callback = *interrupt;
+    }
+    if ((ret = open_file_with_opts(file, &f->avf_context, &follow_opts)) < 0) {
+        print_av_error(stderr, "[indexer] Failed to open the file to follow", ret);
+        // Freed by avformat_open_input()
+        f->avf_context = NULL;
+        return -1;
+    }
+    if (find_stream_info_with_opts(f->avf_context, &follow_opts) < 0 ||
+        stream < 0 || (unsigned int)stream >= f->avf_context->nb_streams ||
+        f->avf_context->streams[stream]->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
+        fprintf(stderr, "[indexer] Stream #%d is not found in the file to follow\n", stream);
+        close_index_follower(f);
+        return -1;
+    }
+    f->stream = f->avf_context->streams[stream];
+    if (!(f->codec = open_decoder_for_stream(f->stream, &follow_opts, THREAD_TYPE_SLICE))) {
+        fprintf(stderr, "[indexer] Failed to open the decoder\n");
+        close_index_follower(f);
+        return -1;
+    }
+    f->file = strdup(file);
+
+    return 0;
+}
+
+static void __push_gop_packet(struct index_follower *f, const AVPacket *packet) {
+    if (f->gop_packets >= f->gop_allocated) {
+        f->gop_allocated += 256;
+        f->gop = realloc(f->gop, sizeof(*f->gop) * f->gop_allocated);
+    }
+    f->gop[f->gop_packets].pts = packet->pts;
+    f->gop[f->gop_packets].pos = packet->pos;
+    f->gop[f->gop_packets].key = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+    f->gop_packets++;
+}
+
+/**
+ * @brief Wait for the next GOP of the file and index it
+ *
+ * The index is a GOP behind the recording, as a GOP is complete only when the next keyframe
+ * arrives. When the file stops growing, the last GOP is indexed as it is.
+ *
+ * @param entries Entries of the GOP sorted by PTS, valid until the next call
+ * @return int 1 if a GOP is indexed, 0 if the file has stopped growing, negative on error or interrupt
+ */
+int follow_next_gop(struct index_follower *f, const struct video_stream_frame_index **entries, int *num) {
+    AVPacket *packet;
+    int ret = 0, i;
+
+    f->e.num = 0;
+    *entries = NULL;
+    *num = 0;
+    if (f->ended) {
+        return 0;
+    }
+
+    packet = pool_get_packet();
+    for (;;) {
+        if ((ret = av_read_frame(f->avf_context, packet)) < 0) {
+            // A timeout of the follow option is AVERROR(EIO)
+            if (ret == AVERROR_EXIT) {
+                pool_put_packet(&packet);
+                return ret;
+            }
+            f->ended = 1;
+            break;
+        }
+        if (packet->stream_index != f->stream->index || (packet->flags & AV_PKT_FLAG_CORRUPT) || packet->pos < 0 ||
+            (f->gop_packets == 0 && !(packet->flags & AV_PKT_FLAG_KEY))) {
+            av_packet_unref(packet);
+            continue;
+        }
+        if ((packet->flags & AV_PKT_FLAG_KEY) && f->gop_packets > 0) {
+            break;
+        }
+        __push_gop_packet(f, packet);
+        av_packet_unref(packet);
+    }
+
+    ret = 0;
+    if (f->gop_packets > 0) {
+        // The first GOP drops the frames presented before its keyframe, as build_index_stream() does
+        ret = __index_gop(f->avf_context, f->stream, f->codec, f->gop, f->gop_packets, f->e.packets,
+            f->e.packets == 0 ? f->gop[0].pts : AV_NOPTS_VALUE, f->ended ? -1 : packet->pos, &f->e);
+        f->e.packets += f->gop_packets;
+
+        for (i = 0; i < f->e.num; i++) {
+            if ((f->e.entries[i].flags & FRAME_INDEX_FLAG_LEADING) && f->last_key_pos >= 0) {
+                f->e.entries[i].key_pos = f->last_key_pos;
+            }
+        }
+        f->last_key_pos = f->gop[0].pos;
+        f->gop_packets = 0;
+        qsort(f->e.entries, f->e.num, sizeof(*f->e.entries), __compare_entry);
+    }
+    if (!f->ended) {
+        // The keyframe of the next GOP
+        __push_gop_packet(f, packet);
+        av_packet_unref(packet);
+    }
+    pool_put_packet(&packet);
+
+    if (ret != 0) {
+        return -1;
+    }
+    *entries = f->e.entries;
+    *num = f->e.num;
+
+    return f->ended ? 0 : 1;
+}
+
+void close_index_follower(struct index_follower *f) {
+    if (f->codec) {
+        avcodec_free_context(&f->codec);
+    }
+    if (f->avf_context) {
+        avformat_close_input(&f->avf_context);
+    }
+    free(f->gop);
+    free(f->e.entries);
+    free(f->file);
+    memset(f, 0, sizeof(*f));
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include "helper.h"
+
+/*
+ * Building the frame index of a video stream
+ *
+ * The index is built from the packets alone: the demuxer tells the PTS, the byte position
+ * and the keyframe flag of each packet, and sorting them by PTS gives the presentation order.
+ * It runs at the speed of reading the file. Only the GOPs whose packets lack a PTS are decoded
+ * to learn the PTS of their frames.
+ *
+ * A large TS file is split into byte ranges on TS packet boundaries, each indexed by a thread
+ * with its own demuxer from the first keyframe in the range to the first one in the next range.
+ * The partial indexes are merged in PTS order, dropping the frames indexed on both sides of a seam.
+ *
+ * A file being recorded is followed by its own demuxer which waits at the end of the file for it
+ * to grow (the follow option of the file protocol). A GOP is indexed once the next keyframe arrives.
+ */
+
+#define TS_PACKET_SIZE 188
+// A range smaller than this is not worth a thread
+#define INDEX_MIN_RANGE_SIZE (64L << 20)
+// Analysis by the demuxer of each range (usec)
+#define INDEX_RANGE_ANALYZE_DURATION (1000L * 1000)
+
+struct video_stream_frame_index *build_index_stream(AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec, int *frames);
+struct video_stream_frame_index *build_index_file(const char *file, AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec, const struct file_open_options *opts, int *frames);
+
+struct index_packet;
+struct index_entries {
+    struct video_stream_frame_index *entries;
+    int num;
+    int allocated;
+    // Packets from the first keyframe, and GOPs, for the decode order and the GOPs of the next range
+    int packets;
+    int keyframes;
+    int decoded_gops;
+};
+
+struct index_follower {
+    char *file;
+    AVFormatContext *avf_context;
+    AVStream *stream;
+    AVCodecContext *codec;
+    // Packets of the GOP being received
+    struct index_packet *gop;
+    int gop_packets;
+    int gop_allocated;
+    long last_key_pos;
+    // Entries of the last GOP indexed
+    struct index_entries e;
+    int ended;
+};
+
+int open_index_follower(struct index_follower *f, const char *file, int stream, const struct file_open_options *opts, const AVIOInterruptCB *interrupt);
+int follow_next_gop(struct index_follower *f, const struct video_stream_frame_index **entries, int *num);
+void close_index_follower(struct index_follower *f);
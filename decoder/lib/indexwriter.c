@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <string.h>
+#include "indexwriter.h"
+
+// Longest varint of 64 bits
+#define VARINT_MAX_BYTES 10
+
+static uint8_t *__put_u32(uint8_t *p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+
+    return p + 4;
+}
+
+static uint8_t *__put_varint(uint8_t *p, uint64_t value) {
+    while (value >= 0x80) {
+        *p++ = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+
+    return p;
+}
+
+static uint64_t __zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+/**
+ * @brief Write the header
+ *
+ * @return int 0 on success
+ */
+int init_index_writer(struct index_writer *writer, FILE *fp, int stream, int timebase_num, int timebase_den) {
+    uint8_t header[32], *p = header;
+
+    memset(header, 0, sizeof(header));
+    memcpy(p, INDEX_BINARY_MAGIC, 8);
+    p = __put_u32(p + 8, INDEX_BINARY_VERSION);
+    p = __put_u32(p, stream);
+    p = __put_u32(p, timebase_num);
+    __put_u32(p, timebase_den);
+
+    writer->fp = fp;
+    writer->num = 0;
+    writer->frames = 0;
+    writer->block = malloc(sizeof(*writer->block) * INDEX_BLOCK_FRAMES);
+    writer->buf = malloc(INDEX_BLOCK_FRAMES * (VARINT_MAX_BYTES * 2 + 1));
+    writer->error = fwrite(header, sizeof(header), 1, fp) != 1;
+
+    return writer->error ? -1 : 0;
+}
+
+static void __flush_block(struct index_writer *writer) {
+    uint8_t head[8], *p = writer->buf;
+    int64_t prev_pts = 0, prev_pos = 0;
+    int i;
+
+    if (writer->num == 0) {
+        return;
+    }
+
+    for (i = 0; i < writer->num; i++) {
+        p = __put_varint(p, __zigzag((int64_t)writer->block[i].pts - prev_pts));
+        prev_pts = writer->block[i].pts;
+    }
+    for (i = 0; i < writer->num; i++) {
+        p = __put_varint(p, __zigzag((int64_t)writer->block[i].pos - prev_pos));
+        prev_pos = writer->block[i].pos;
+    }
+    for (i = 0; i < writer->num; i++) {
+        *p++ = writer->block[i].flags;
+    }
+
+    __put_u32(__put_u32(head, writer->num), p - writer->buf);
+    if (fwrite(head, sizeof(head), 1, writer->fp) != 1 ||
+        fwrite(writer->buf, p - writer->buf, 1, writer->fp) != 1) {
+        writer->error = 1;
+    }
+    writer->frames += writer->num;
+    writer->num = 0;
+}
+
+/**
+ * @brief Add the entries following the ones written so far
+ *
+ * @return int 0 on success
+ */
+int write_index_entries(struct index_writer *writer, const struct video_stream_frame_index *entries, int num) {
+    int i;
+
+    for (i = 0; i < num; i++) {
+        writer->block[writer->num++] = entries[i];
+        if (writer->num == INDEX_BLOCK_FRAMES) {
+            __flush_block(writer);
+        }
+    }
+
+    return writer->error ? -1 : 0;
+}
+
+/**
+ * @brief Write the rest of the entries and the end of the index
+ *
+ * @return int 0 on success
+ */
+int finish_index_writer(struct index_writer *writer) {
+    uint8_t end[8];
+
+    __flush_block(writer);
+    __put_u32(__put_u32(end, 0), 0);
+    if (fwrite(end, sizeof(end), 1, writer->fp) != 1 || fflush(writer->fp) != 0) {
+        writer->error = 1;
+    }
+    free(writer->block);
+    free(writer->buf);
+    writer->block = NULL;
+    writer->buf = NULL;
+
+    return writer->error ? -1 : 0;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include "helper.h"
+
+/*
+ * Binary frame index (nicm index -f bin)
+ *
+ * Written as the frames are indexed, so that the memory does not grow with the file.
+ * All the integers are little endian.
+ *
+ *   Header (32 bytes): magic "NICMIB01", uint32 version, int32 stream,
+ *                      int32 timebase num, int32 timebase den, 8 bytes reserved
+ *   Blocks: uint32 frames (0: the end of the index), uint32 bytes of the columns, and the columns
+ *     - PTS: zigzag varint of the difference from the previous frame
+ *     - pos: zigzag varint of the difference from the previous frame
+ *     - flags: a byte per frame (FRAME_INDEX_FLAG_*)
+ *
+ * The differences start from 0 in each block, so a reader can skip blocks by their size.
+ * The frames are in presentation order.
+ */
+
+#define INDEX_BINARY_MAGIC "NICMIB01"
+#define INDEX_BINARY_VERSION 1
+#define INDEX_BLOCK_FRAMES 4096
+
+struct index_writer {
+    FILE *fp;
+    struct video_stream_frame_index *block;
+    int num;
+    // The encoded columns of a block
+    uint8_t *buf;
+    long frames;
+    int error;
+};
+
+int init_index_writer(struct index_writer *writer, FILE *fp, int stream, int timebase_num, int timebase_den);
+int write_index_entries(struct index_writer *writer, const struct video_stream_frame_index *entries, int num);
+int finish_index_writer(struct index_writer *writer);
@@ -0,0 +1,191 @@
+#include <pthread.h>
+#include <libavutil/imgutils.h>
+#include "pool.h"
+
+#define MAX_FREE_FRAMES 64
+#define MAX_FREE_PACKETS 64
+#define IMAGE_ALIGN 32
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static AVFrame *free_frames[MAX_FREE_FRAMES];
+static int num_free_frames = 0;
+static AVPacket *free_packets[MAX_FREE_PACKETS];
+static int num_free_packets = 0;
+
+static struct pool_stats stats;
+
+AVFrame *pool_get_frame(void) {
+    AVFrame *frame = NULL;
+
+    pthread_mutex_lock(&pool_mutex);
+    stats.frame_gets++;
+    if (num_free_frames > 0) {
+        frame = free_frames[--num_free_frames];
+    } else {
+        stats.frame_allocs++;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (!frame) {
+        frame = av_frame_alloc();
+    }
+
+    return frame;
+}
+
+void pool_put_frame(AVFrame **frame) {
+    if (*frame == NULL) {
+        return;
+    }
+    // Release the data outside the lock. Pooled buffers go back to their pools here.
+    av_frame_unref(*frame);
+
+    pthread_mutex_lock(&pool_mutex);
+    if (num_free_frames < MAX_FREE_FRAMES) {
+        free_frames[num_free_frames++] = *frame;
+        *frame = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (*frame) {
+        av_frame_free(frame);
+    }
+}
+
+AVPacket *pool_get_packet(void) {
+    AVPacket *packet = NULL;
+
+    pthread_mutex_lock(&pool_mutex);
+    stats.packet_gets++;
+    if (num_free_packets > 0) {
+        packet = free_packets[--num_free_packets];
+    } else {
+        stats.packet_allocs++;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (!packet) {
+        packet = av_packet_alloc();
+    }
+
+    return packet;
+}
+
+void pool_put_packet(AVPacket **packet) {
+    if (*packet == NULL) {
+        return;
+    }
+    av_packet_unref(*packet);
+
+    pthread_mutex_lock(&pool_mutex);
+    if (num_free_packets < MAX_FREE_PACKETS) {
+        free_packets[num_free_packets++] = *packet;
+        *packet = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (*packet) {
+        av_packet_free(packet);
+    }
+}
+
+static AVBufferRef *__image_buffer_alloc(void *opaque, size_t size) {
+    (void)opaque;
+
+    pthread_mutex_lock(&pool_mutex);
+    stats.buffer_allocs++;
+    pthread_mutex_unlock(&pool_mutex);
+
+    return av_buffer_alloc(size);
+}
+
+int init_image_pool(struct image_pool *pool, int width, int height, enum AVPixelFormat fmt) {
+    pool->width = width;
+    pool->height = height;
+    pool->fmt = fmt;
+    pool->size = av_image_get_buffer_size(fmt, width, height, IMAGE_ALIGN);
+    if (pool->size < 0) {
+        pool->pool = NULL;
+        return pool->size;
+    }
+    pool->pool = av_buffer_pool_init2(pool->size, NULL, __image_buffer_alloc, NULL);
+
+    return pool->pool ? 0 : AVERROR(ENOMEM);
+}
+
+void destroy_image_pool(struct image_pool *pool) {
+    // Buffers still referenced are freed when they are returned
+    av_buffer_pool_uninit(&pool->pool);
+}
+
+/**
+ * @brief Get a frame backed by a pooled image buffer
+ *
+ * Release it with pool_put_frame(), which returns the buffer to the pool.
+ */
+AVFrame *image_pool_get_frame(struct image_pool *pool) {
+    AVFrame *frame;
+    AVBufferRef *buf = av_buffer_pool_get(pool->pool);
+
+    if (!buf) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    stats.buffer_gets++;
+    pthread_mutex_unlock(&pool_mutex);
+
+    frame = pool_get_frame();
+    frame->buf[0] = buf;
+    av_image_fill_arrays(frame->data, frame->linesize, buf->data, pool->fmt, pool->width, pool->height, IMAGE_ALIGN);
+    frame->width = pool->width;
+    frame->height = pool->height;
+    frame->format = pool->fmt;
+
+    return frame;
+}
+
+/**
+ * @brief Make sure the buffer has at least `size` bytes. The contents are not preserved.
+ */
+uint8_t *reserve_scratch_buffer(struct scratch_buffer *buffer, size_t size) {
+    if (buffer->size < size) {
+        av_freep(&buffer->data);
+        // Grow geometrically so that slightly larger requests do not reallocate every time
+        if (size < buffer->size * 2) {
+            size = buffer->size * 2;
+        }
+        buffer->data = av_malloc(size);
+        buffer->size = buffer->data ? size : 0;
+
+        pthread_mutex_lock(&pool_mutex);
+        stats.buffer_allocs++;
+        pthread_mutex_unlock(&pool_mutex);
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    stats.buffer_gets++;
+    pthread_mutex_unlock(&pool_mutex);
+
+    return buffer->data;
+}
+
+void free_scratch_buffer(struct scratch_buffer *buffer) {
+    av_freep(&buffer->data);
+    buffer->size = 0;
+}
+
+void get_pool_stats(struct pool_stats *result) {
+    pthread_mutex_lock(&pool_mutex);
+    *result = stats;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void print_pool_stats(FILE *fp) {
+    struct pool_stats s;
+
+    get_pool_stats(&s);
+    fprintf(fp, "Pool: frames %lu/%lu, packets %lu/%lu, buffers %lu/%lu (allocated/requested)\n",
+        s.frame_allocs, s.frame_gets, s.packet_allocs, s.packet_gets, s.buffer_allocs, s.buffer_gets);
+}
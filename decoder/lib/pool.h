@@ -0,0 +1,49 @@
+#pragma once
+#include <stdio.h>
+#include <libavcodec/avcodec.h>
+
+/*
+ * Recycled allocations for the per-frame hot paths
+ *
+ * AVFrame and AVPacket shells are kept on free lists shared by all threads.
+ * Scaled images come from an AVBufferPool per output size and format.
+ * The counters tell how many times the pools had to hit the heap, which
+ * should stop growing once playback reaches a steady state.
+ */
+
+struct pool_stats {
+    unsigned long frame_gets;
+    unsigned long frame_allocs;
+    unsigned long packet_gets;
+    unsigned long packet_allocs;
+    unsigned long buffer_gets;
+    unsigned long buffer_allocs;
+};
+
+AVFrame *pool_get_frame(void);
+void pool_put_frame(AVFrame **frame);
+AVPacket *pool_get_packet(void);
+void pool_put_packet(AVPacket **packet);
+
+struct image_pool {
+    AVBufferPool *pool;
+    int width;
+    int height;
+    enum AVPixelFormat fmt;
+    int size;
+};
+
+int init_image_pool(struct image_pool *pool, int width, int height, enum AVPixelFormat fmt);
+void destroy_image_pool(struct image_pool *pool);
+AVFrame *image_pool_get_frame(struct image_pool *pool);
+
+struct scratch_buffer {
+    uint8_t *data;
+    size_t size;
+};
+
+uint8_t *reserve_scratch_buffer(struct scratch_buffer *buffer, size_t size);
+void free_scratch_buffer(struct scratch_buffer *buffer);
+
+void get_pool_stats(struct pool_stats *stats);
+void print_pool_stats(FILE *fp);
@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <jansson.h>
+#include "probecache.h"
+#include "helper.h"
+
+// Bump when the fields of the sidecar change
+#define PROBE_CACHE_VERSION 1
+// The sidecar is valid while this much of the beginning of the file is the same
+#define PROBE_CACHE_HASH_SIZE (64 << 10)
+
+// Distinguishes the temporary sidecars written at once by the threads of a process (nicm ingest)
+static atomic_int tmp_serial;
+
+struct probe_step {
+    long probe_size;
+    long analyze_duration;
+};
+
+// The last step (0: the default options) is the probing done before the escalation
+static const struct probe_step probe_steps[] = {
+    { .probe_size = (2L << 20), .analyze_duration = (1L * 1000 * 1000) },
+    { .probe_size = (16L << 20), .analyze_duration = (5L * 1000 * 1000) },
+    { .probe_size = 0, .analyze_duration = 0 },
+};
+
+static uint64_t __fnv1a(uint64_t hash, const uint8_t *p, size_t size) {
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3UL;
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Hash the beginning of the file (after the skipped bytes), where the stream info comes from
+ *
+ * @param size The size of the file
+ * @return int 0 on success
+ */
+static int __identify(const char *file, long skip, char *hash_str, size_t hash_size, long *size) {
+    uint8_t *block = malloc(PROBE_CACHE_HASH_SIZE);
+    uint64_t hash = 0xcbf29ce484222325UL;
+    struct stat st;
+    ssize_t ret;
+    int fd;
+
+    if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(block);
+        return -1;
+    }
+    ret = pread(fd, block, PROBE_CACHE_HASH_SIZE, skip);
+    close(fd);
+    if (ret < 0) {
+        free(block);
+        return -1;
+    }
+    hash = __fnv1a(hash, block, ret);
+    free(block);
+
+    snprintf(hash_str, hash_size, "%016lx", (unsigned long)hash);
+    *size = st.st_size;
+
+    return 0;
+}
+
+static void __sidecar_path(const char *file, char *path, size_t size) {
+    snprintf(path, size, "%s%s", file, PROBE_CACHE_SUFFIX);
+}
+
+static json_t *__rational(AVRational r) {
+    json_t *a = json_array();
+
+    json_array_append_new(a, json_integer(r.num));
+    json_array_append_new(a, json_integer(r.den));
+
+    return a;
+}
+
+static AVRational __get_rational(const json_t *o, const char *key) {
+    const json_t *a = json_object_get(o, key);
+    AVRational r = { 0, 1 };
+
+    if (json_is_array(a) && json_array_size(a) == 2) {
+        r.num = json_integer_value(json_array_get(a, 0));
+        r.den = json_integer_value(json_array_get(a, 1));
+    }
+
+    return r;
+}
+
+static json_int_t __get_int(const json_t *o, const char *key) {
+    return json_integer_value(json_object_get(o, key));
+}
+
+static json_t *__compose_stream(const AVStream *st) {
+    const AVCodecParameters *par = st->codecpar;
+    json_t *s = json_object();
+
+    json_object_set_new(s, "id", json_integer(st->id));
+    json_object_set_new(s, "type", json_integer(par->codec_type));
+    json_object_set_new(s, "codec", json_integer(par->codec_id));
+    json_object_set_new(s, "tag", json_integer(par->codec_tag));
+    json_object_set_new(s, "format", json_integer(par->format));
+    json_object_set_new(s, "bit_rate", json_integer(par->bit_rate));
+    json_object_set_new(s, "bits_per_coded_sample", json_integer(par->bits_per_coded_sample));
+    json_object_set_new(s, "bits_per_raw_sample", json_integer(par->bits_per_raw_sample));
+    json_object_set_new(s, "profile", json_integer(par->profile));
+    json_object_set_new(s, "level", json_integer(par->level));
+    json_object_set_new(s, "width", json_integer(par->width));
+    json_object_set_new(s, "height", json_integer(par->height));
+    json_object_set_new(s, "sar", __rational(par->sample_aspect_ratio));
+    json_object_set_new(s, "field_order", json_integer(par->field_order));
+    json_object_set_new(s, "color_range", json_integer(par->color_range));
+    json_object_set_new(s, "color_primaries", json_integer(par->color_primaries));
+    json_object_set_new(s, "color_trc", json_integer(par->color_trc));
+    json_object_set_new(s, "color_space", json_integer(par->color_space));
+    json_object_set_new(s, "chroma_location", json_integer(par->chroma_location));
+    json_object_set_new(s, "video_delay", json_integer(par->video_delay));
+    json_object_set_new(s, "channel_order", json_integer(par->ch_layout.order));
+    json_object_set_new(s, "channels", json_integer(par->ch_layout.nb_channels));
+    json_object_set_new(s, "channel_mask", json_integer(par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ? (json_int_t)par->ch_layout.u.mask : 0));
+    json_object_set_new(s, "sample_rate", json_integer(par->sample_rate));
+    json_object_set_new(s, "block_align", json_integer(par->block_align));
+    json_object_set_new(s, "frame_size", json_integer(par->frame_size));
+    json_object_set_new(s, "initial_padding", json_integer(par->initial_padding));
+    json_object_set_new(s, "time_base", __rational(st->time_base));
+    json_object_set_new(s, "start_time", json_integer(st->start_time));
+    json_object_set_new(s, "duration", json_integer(st->duration));
+    json_object_set_new(s, "r_frame_rate", __rational(st->r_frame_rate));
+    json_object_set_new(s, "avg_frame_rate", __rational(st->avg_frame_rate));
+    json_object_set_new(s, "disposition", json_integer(st->disposition));
+
+    if (par->extradata_size > 0) {
+        char *hex = malloc(par->extradata_size * 2 + 1);
+        int i;
+
+        for (i = 0; i < par->extradata_size; i++) {
+            sprintf(hex + i * 2, "%02x", par->extradata[i]);
+        }
+        json_object_set_new(s, "extradata", json_string(hex));
+        free(hex);
+    }
+
+    return s;
+}
+
+/**
+ * @brief Save the stream info of the probed file. A sidecar which cannot be written is not an error.
+ */
+static void __save_probe_cache(const char *file, const AVFormatContext *avf_context, const struct file_open_options *opts) {
+    char path[4096], tmp_path[4096 + 32], hash[32];
+    json_t *root, *streams;
+    unsigned int i;
+    long size;
+
+    if (__identify(file, opts->skip_initial_bytes, hash, sizeof(hash), &size) != 0) {
+        return;
+    }
+
+    root = json_object();
+    json_object_set_new(root, "version", json_integer(PROBE_CACHE_VERSION));
+    json_object_set_new(root, "hash", json_string(hash));
+    json_object_set_new(root, "skip", json_integer(opts->skip_initial_bytes));
+    json_object_set_new(root, "size", json_integer(size));
+    json_object_set_new(root, "format", json_string(avf_context->iformat->name));
+    json_object_set_new(root, "start_time", json_integer(avf_context->start_time));
+    json_object_set_new(root, "duration", json_integer(avf_context->duration));
+    json_object_set_new(root, "bit_rate", json_integer(avf_context->bit_rate));
+
+    streams = json_array();
+    for (i = 0; i < avf_context->nb_streams; i++) {
+        json_array_append_new(streams, __compose_stream(avf_context->streams[i]));
+    }
+    json_object_set_new(root, "streams", streams);
+
+    __sidecar_path(file, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d.%d", path, (int)getpid(), atomic_fetch_add(&tmp_serial, 1));
+    if (json_dump_file(root, tmp_path, JSON_COMPACT) != 0 || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "[probecache] Cannot write %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+    }
+    json_decref(root);
+}
+
+/**
+ * @brief Load the sidecar if it is of the same beginning of the file
+ *
+ * @param same_size The file has not grown (or been cut) since
+ * @return json_t* The sidecar, or NULL if missing or stale
+ */
+static json_t *__load_probe_cache(const char *file, const struct file_open_options *opts, int *same_size) {
+    char path[4096], hash[32];
+    json_error_t error;
+    json_t *root;
+    long size;
+
+    __sidecar_path(file, path, sizeof(path));
+    if (access(path, R_OK) != 0) {
+        return NULL;
+    }
+    if ((root = json_load_file(path, 0, &error)) == NULL) {
+        fprintf(stderr, "[probecache] %s is broken: %s\n", path, error.text);
+        return NULL;
+    }
+    if (!json_is_object(root) || __get_int(root, "version") != PROBE_CACHE_VERSION ||
+        !json_is_array(json_object_get(root, "streams")) ||
+        __get_int(root, "skip") != opts->skip_initial_bytes ||
+        __identify(file, opts->skip_initial_bytes, hash, sizeof(hash), &size) != 0 ||
+        !json_is_string(json_object_get(root, "hash")) ||
+        strcmp(json_string_value(json_object_get(root, "hash")), hash) != 0) {
+        fprintf(stderr, "[probecache] %s is stale\n", path);
+        json_decref(root);
+        return NULL;
+    }
+    *same_size = __get_int(root, "size") == size;
+
+    return root;
+}
+
+static int __restore_stream(AVStream *st, const json_t *s, int same_size) {
+    AVCodecParameters *par = st->codecpar;
+    const char *hex = json_string_value(json_object_get(s, "extradata"));
+    int channels = __get_int(s, "channels");
+
+    par->codec_type = __get_int(s, "type");
+    par->codec_id = __get_int(s, "codec");
+    par->codec_tag = __get_int(s, "tag");
+    par->format = __get_int(s, "format");
+    par->bit_rate = __get_int(s, "bit_rate");
+    par->bits_per_coded_sample = __get_int(s, "bits_per_coded_sample");
+    par->bits_per_raw_sample = __get_int(s, "bits_per_raw_sample");
+    par->profile = __get_int(s, "profile");
+    par->level = __get_int(s, "level");
+    par->width = __get_int(s, "width");
+    par->height = __get_int(s, "height");
+    par->sample_aspect_ratio = __get_rational(s, "sar");
+    par->field_order = __get_int(s, "field_order");
+    par->color_range = __get_int(s, "color_range");
+    par->color_primaries = __get_int(s, "color_primaries");
+    par->color_trc = __get_int(s, "color_trc");
+    par->color_space = __get_int(s, "color_space");
+    par->chroma_location = __get_int(s, "chroma_location");
+    par->video_delay = __get_int(s, "video_delay");
+    par->sample_rate = __get_int(s, "sample_rate");
+    par->block_align = __get_int(s, "block_align");
+    par->frame_size = __get_int(s, "frame_size");
+    par->initial_padding = __get_int(s, "initial_padding");
+
+    av_channel_layout_uninit(&par->ch_layout);
+    if (__get_int(s, "channel_order") == AV_CHANNEL_ORDER_NATIVE) {
+        av_channel_layout_from_mask(&par->ch_layout, __get_int(s, "channel_mask"));
+    } else if (channels > 0) {
+        av_channel_layout_default(&par->ch_layout, channels);
+    }
+
+    av_freep(&par->extradata);
+    par->extradata_size = 0;
+    if (hex) {
+        int i, size = strlen(hex) / 2;
+
+        par->extradata = av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!par->extradata) {
+            return -1;
+        }
+        for (i = 0; i < size; i++) {
+            unsigned int byte;
+
+            sscanf(hex + i * 2, "%2x", &byte);
+            par->extradata[i] = byte;
+        }
+        par->extradata_size = size;
+    }
+
+    st->time_base = __get_rational(s, "time_base");
+    st->start_time = __get_int(s, "start_time");
+    st->duration = same_size ? __get_int(s, "duration") : AV_NOPTS_VALUE;
+    st->r_frame_rate = __get_rational(s, "r_frame_rate");
+    st->avg_frame_rate = __get_rational(s, "avg_frame_rate");
+    st->disposition = __get_int(s, "disposition");
+
+    return 0;
+}
+
+/**
+ * @brief Fill the streams found in the header from the sidecar
+ *
+ * @return int 0 on success, negative if the demuxer found other streams
+ */
+static int __restore_probe_cache(AVFormatContext *avf_context, const json_t *root, int same_size) {
+    const json_t *streams = json_object_get(root, "streams");
+    const char *format = json_string_value(json_object_get(root, "format"));
+    unsigned int i;
+
+    if (!format || strcmp(format, avf_context->iformat->name) != 0 ||
+        json_array_size(streams) != avf_context->nb_streams || avf_context->nb_streams == 0) {
+        return -1;
+    }
+    for (i = 0; i < avf_context->nb_streams; i++) {
+        // The type may be found by probing the packets, so only the IDs (PIDs) are compared
+        if (__get_int(json_array_get(streams, i), "id") != avf_context->streams[i]->id) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < avf_context->nb_streams; i++) {
+        if (__restore_stream(avf_context->streams[i], json_array_get(streams, i), same_size) != 0) {
+            return -1;
+        }
+    }
+    avf_context->start_time = __get_int(root, "start_time");
+    avf_context->duration = same_size ? __get_int(root, "duration") : AV_NOPTS_VALUE;
+    avf_context->bit_rate = __get_int(root, "bit_rate");
+
+    return 0;
+}
+
+/**
+ * @brief Whether the parameters needed by the subcommands are found for all the streams
+ */
+static int __resolved(const AVFormatContext *avf_context) {
+    unsigned int i;
+
+    for (i = 0; i < avf_context->nb_streams; i++) {
+        const AVCodecParameters *par = avf_context->streams[i]->codecpar;
+
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+            if (par->codec_id == AV_CODEC_ID_NONE || par->width == 0 || par->height == 0 ||
+                par->format < 0 || avf_context->streams[i]->start_time == AV_NOPTS_VALUE) {
+                return 0;
+            }
+        } else if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
+            if (par->codec_id == AV_CODEC_ID_NONE || par->sample_rate == 0 ||
+                par->ch_layout.nb_channels == 0 || par->format < 0) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Open the file and find its stream info, from the sidecar if possible
+ *
+ * The probesize and the analyzeduration given in the options are used as they are.
+ * Otherwise they are raised step by step up to the defaults until all the streams are resolved.
+ *
+ * @return int 0 on success, or a negative AVERROR (*avf_context is NULL)
+ */
+int open_probed_file(const char *file, AVFormatContext **avf_context, const struct file_open_options *opts) {
+    struct file_open_options step_opts = *opts;
+    int fixed = opts->probe_size != 0 || opts->analyze_duration != 0;
+    int num_steps = sizeof(probe_steps) / sizeof(probe_steps[0]);
+    int same_size = 0, ret, i;
+    json_t *cache;
+
+    if ((cache = __load_probe_cache(file, opts, &same_size)) != NULL) {
+        // Only the header is parsed
+        if (!fixed) {
+            step_opts.probe_size = probe_steps[0].probe_size;
+            step_opts.analyze_duration = probe_steps[0].analyze_duration;
+        }
+        ret = open_file_with_opts(file, avf_context, &step_opts);
+        if (ret < 0) {
+            fprintf(stderr, "Error: avformat_open_input returned %d\n", ret);
+            json_decref(cache);
+            *avf_context = NULL;
+            return ret;
+        }
+        ret = __restore_probe_cache(*avf_context, cache, same_size);
+        json_decref(cache);
+        if (ret == 0) {
+            fprintf(stderr, "[probecache] Restored the stream info of %s\n", file);
+            return 0;
+        }
+        fprintf(stderr, "[probecache] The streams of %s have changed\n", file);
+        avformat_close_input(avf_context);
+    }
+
+    for (i = fixed ? num_steps - 1 : 0; i < num_steps; i++) {
+        if (!fixed) {
+            step_opts.probe_size = probe_steps[i].probe_size;
+            step_opts.analyze_duration = probe_steps[i].analyze_duration;
+        }
+
+        ret = open_file_with_opts(file, avf_context, &step_opts);
+        if (ret < 0) {
+            fprintf(stderr, "Error: avformat_open_input returned %d\n", ret);
+            *avf_context = NULL;
+            return ret;
+        }
+        ret = find_stream_info_with_opts(*avf_context, &step_opts);
+        if (ret < 0) {
+            fprintf(stderr, "Error: avformat_find_stream_info returned %d\n", ret);
+            avformat_close_input(avf_context);
+            return ret;
+        }
+
+        // A stream without packets is never resolved, so the result of the last step is kept as it is,
+        // unless the file being recorded may have them later
+        if (__resolved(*avf_context) || i == num_steps - 1) {
+            if (__resolved(*avf_context) || opts->follow_timeout == 0) {
+                __save_probe_cache(file, *avf_context, opts);
+            }
+            break;
+        }
+        fprintf(stderr, "[probecache] Some streams are not resolved. Probing %s again with larger sizes.\n", file);
+        avformat_close_input(avf_context);
+    }
+
+    return 0;
+}
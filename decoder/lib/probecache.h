@@ -0,0 +1,19 @@
+#pragma once
+#include <libavformat/avformat.h>
+#include "../nicm.h"
+
+/*
+ * Opening a file with its stream info (avformat_find_stream_info) made fast
+ *
+ * The stream info of a file is kept in a sidecar (MEDIA.nprobe) after it is probed once.
+ * Next time only the header is parsed and the streams are filled from the sidecar, when the
+ * demuxer finds the same streams. The sidecar is valid while the beginning of the file is the same,
+ * so a file still being recorded keeps it; the durations are taken only while the size is the same.
+ *
+ * Otherwise the file is probed with a small probesize and analyzeduration first, which resolves
+ * most of the files. They are raised only when a stream is left without its parameters.
+ */
+
+#define PROBE_CACHE_SUFFIX ".nprobe"
+
+int open_probed_file(const char *file, AVFormatContext **avf_context, const struct file_open_options *opts);
@@ -0,0 +1,124 @@
+#include <libavutil/avutil.h>
+#include "seek_policy.h"
+#include "trace.h"
+
+// Weight of a new sample in the averages
+#define SEEK_POLICY_ALPHA 0.2
+// The longest interval is forgotten slowly, so a short GOP after a scene change does not shrink the preroll
+#define SEEK_POLICY_MAX_GOP_DECAY 0.98
+// Keyframe intervals longer than this are not GOPs (e.g. a gap in the stream)
+#define SEEK_POLICY_MAX_GOP 2000
+#define SEEK_POLICY_PREROLL_MARGIN 2
+#define SEEK_POLICY_MAX_PREROLL 1000
+// A stall measured as a seek must not make the forward limit overflow
+#define SEEK_POLICY_MAX_FORWARD 10000
+
+void init_seek_policy(struct seek_policy *policy, long delta, int initial_threshold, int initial_preroll) {
+    policy->delta = delta;
+    policy->gop_frames = 0;
+    policy->max_gop_frames = 0;
+    policy->last_keyframe_pts = AV_NOPTS_VALUE;
+    policy->decode_cost = 0;
+    policy->decode_samples = 0;
+    policy->seek_cost = 0;
+    policy->seek_samples = 0;
+    policy->preroll_frames = initial_preroll;
+    policy->initial_threshold = initial_threshold;
+}
+
+static double __average(double average, int samples, double value) {
+    return samples == 0 ? value : average + SEEK_POLICY_ALPHA * (value - average);
+}
+
+/**
+ * @brief Tell that a keyframe at the PTS was read. Call it for every keyframe in the order of reading.
+ *
+ * Pass AV_NOPTS_VALUE after a seek so that the interval across the seek is not taken.
+ */
+void seek_policy_keyframe(struct seek_policy *policy, long pts) {
+    long last = policy->last_keyframe_pts;
+    double interval;
+
+    policy->last_keyframe_pts = pts;
+    if (pts == AV_NOPTS_VALUE || last == AV_NOPTS_VALUE || pts <= last) {
+        return;
+    }
+
+    interval = (double)(pts - last) / policy->delta;
+    if (interval > SEEK_POLICY_MAX_GOP) {
+        return;
+    }
+
+    policy->gop_frames = policy->gop_frames == 0 ? interval : policy->gop_frames + SEEK_POLICY_ALPHA * (interval - policy->gop_frames);
+    policy->max_gop_frames *= SEEK_POLICY_MAX_GOP_DECAY;
+    if (interval > policy->max_gop_frames) {
+        policy->max_gop_frames = interval;
+    }
+
+    int preroll = (int)(policy->max_gop_frames + 0.5) + SEEK_POLICY_PREROLL_MARGIN;
+    if (preroll > SEEK_POLICY_MAX_PREROLL) {
+        preroll = SEEK_POLICY_MAX_PREROLL;
+    }
+    if (preroll != policy->preroll_frames) {
+        TRACE_INSTANT(TRACE_LEVEL_INFO, "seek_policy_preroll", "max_gop,preroll", (long)(policy->max_gop_frames + 0.5), preroll);
+        policy->preroll_frames = preroll;
+    }
+}
+
+/**
+ * @brief Tell the time to read and decode a frame
+ */
+void seek_policy_decoded(struct seek_policy *policy, long elapsed_us) {
+    policy->decode_cost = __average(policy->decode_cost, policy->decode_samples, elapsed_us);
+    policy->decode_samples++;
+}
+
+/**
+ * @brief Tell the time from starting a seek to decoding the requested frame
+ */
+void seek_policy_seeked(struct seek_policy *policy, long elapsed_us) {
+    policy->seek_cost = __average(policy->seek_cost, policy->seek_samples, elapsed_us);
+    policy->seek_samples++;
+
+    TRACE_INSTANT(TRACE_LEVEL_INFO, "seek_policy_seeked", "seek_us,forward_limit", (long)policy->seek_cost, seek_policy_forward_limit(policy));
+}
+
+/**
+ * @brief Tell that a seek landed after the requested frame. The preroll is doubled.
+ */
+void seek_policy_overshot(struct seek_policy *policy) {
+    int preroll = policy->preroll_frames * 2;
+
+    policy->preroll_frames = preroll > SEEK_POLICY_MAX_PREROLL ? SEEK_POLICY_MAX_PREROLL : preroll;
+    if (policy->max_gop_frames < policy->preroll_frames) {
+        policy->max_gop_frames = policy->preroll_frames;
+    }
+    TRACE_INSTANT(TRACE_LEVEL_INFO, "seek_policy_overshot", "preroll", policy->preroll_frames, 0);
+}
+
+/**
+ * @brief Longest distance to decode forward instead of seeking
+ */
+int seek_policy_forward_limit(const struct seek_policy *policy) {
+    double limit;
+
+    if (policy->decode_samples == 0 || policy->seek_samples == 0 || policy->decode_cost <= 0) {
+        return policy->initial_threshold;
+    }
+    limit = policy->seek_cost / policy->decode_cost;
+    return limit < SEEK_POLICY_MAX_FORWARD ? (int)limit : SEEK_POLICY_MAX_FORWARD;
+}
+
+/**
+ * @brief Whether seeking is cheaper than decoding `distance` frames forward
+ */
+int seek_policy_should_seek(const struct seek_policy *policy, long distance) {
+    return distance <= 0 || distance >= seek_policy_forward_limit(policy);
+}
+
+/**
+ * @brief PTS to seek to for the frame at the PTS, far enough to have a keyframe before the frame
+ */
+long seek_policy_seek_target(const struct seek_policy *policy, long pts) {
+    return pts - policy->delta * policy->preroll_frames;
+}
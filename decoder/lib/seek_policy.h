@@ -0,0 +1,43 @@
+#pragma once
+
+/*
+ * Choice between decoding forward and seeking, learned from the stream
+ *
+ * Reaching a frame d frames ahead of the decoder costs d decodes. A seek costs the seek itself
+ * and the decodes from the keyframe before the frame, which depends on the GOP structure.
+ * Both are measured while serving (exponentially weighted moving averages), so the policy fits
+ * short and long GOPs and cheap and expensive codecs alike.
+ *
+ * Distances are in frames. Costs are in microseconds.
+ */
+
+struct seek_policy {
+    long delta;
+
+    // Keyframe interval
+    double gop_frames;
+    // Longest recent keyframe interval. A seek has to go back this far to find a keyframe.
+    double max_gop_frames;
+    long last_keyframe_pts;
+
+    // Cost of decoding a frame
+    double decode_cost;
+    int decode_samples;
+    // Cost of a seek until the requested frame is decoded
+    double seek_cost;
+    int seek_samples;
+
+    // Frames to go back before the requested frame when seeking
+    int preroll_frames;
+    // Used until both costs are measured
+    int initial_threshold;
+};
+
+void init_seek_policy(struct seek_policy *policy, long delta, int initial_threshold, int initial_preroll);
+void seek_policy_keyframe(struct seek_policy *policy, long pts);
+void seek_policy_decoded(struct seek_policy *policy, long elapsed_us);
+void seek_policy_seeked(struct seek_policy *policy, long elapsed_us);
+void seek_policy_overshot(struct seek_policy *policy);
+int seek_policy_should_seek(const struct seek_policy *policy, long distance);
+int seek_policy_forward_limit(const struct seek_policy *policy);
+long seek_policy_seek_target(const struct seek_policy *policy, long pts);
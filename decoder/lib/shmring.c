@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "shmring.h"
+
+int init_shm_ring(struct shm_ring *ring, int slots, size_t slot_size) {
+    struct shm_ring_header *header;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    if (slots <= 0 || slots > SHM_RING_MAX_SLOTS) {
+        fprintf(stderr, "[shmring] Invalid number of slots: %d\n", slots);
+        return -1;
+    }
+    // Keep each slot page aligned
+    slot_size = (slot_size + 4095) & ~(size_t)4095;
+
+    if ((ring->fd = memfd_create("nicm-frames", MFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "[shmring] memfd_create failed: %s\n", strerror(errno));
+        return -1;
+    }
+    ring->map_size = SHM_RING_HEADER_SIZE + slot_size * slots;
+    if (ftruncate(ring->fd, ring->map_size) != 0) {
+        fprintf(stderr, "[shmring] Cannot allocate %lu bytes: %s\n", ring->map_size, strerror(errno));
+        close(ring->fd);
+        ring->fd = -1;
+        return -1;
+    }
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if (ring->map == MAP_FAILED) {
+        fprintf(stderr, "[shmring] mmap failed: %s\n", strerror(errno));
+        ring->map = NULL;
+        close(ring->fd);
+        ring->fd = -1;
+        return -1;
+    }
+
+    ring->slots = slots;
+    ring->slot_size = slot_size;
+    ring->next_slot = 0;
+    snprintf(ring->path, sizeof(ring->path), "/proc/%d/fd/%d", (int)getpid(), ring->fd);
+
+    header = (struct shm_ring_header *)ring->map;
+    memcpy(header->magic, SHM_RING_MAGIC, sizeof(header->magic));
+    header->version = SHM_RING_VERSION;
+    header->slots = slots;
+    header->slot_size = slot_size;
+    header->header_size = SHM_RING_HEADER_SIZE;
+
+    return 0;
+}
+
+void destroy_shm_ring(struct shm_ring *ring) {
+    if (ring->map) {
+        munmap(ring->map, ring->map_size);
+        ring->map = NULL;
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+}
+
+size_t shm_ring_slot_offset(const struct shm_ring *ring, int slot) {
+    return SHM_RING_HEADER_SIZE + ring->slot_size * slot;
+}
+
+/**
+ * @brief Take the oldest slot and mark it being written
+ *
+ * @return uint8_t* The beginning of the slot
+ */
+uint8_t *shm_ring_begin_write(struct shm_ring *ring, int *slot) {
+    struct shm_ring_header *header = (struct shm_ring_header *)ring->map;
+
+    *slot = ring->next_slot;
+    ring->next_slot = (ring->next_slot + 1) % ring->slots;
+
+    __atomic_add_fetch(&header->sequence[*slot], 1, __ATOMIC_ACQ_REL);
+
+    return ring->map + shm_ring_slot_offset(ring, *slot);
+}
+
+/**
+ * @brief Publish the slot
+ *
+ * @return uint64_t The sequence number the readers should see while the slot is valid
+ */
+uint64_t shm_ring_end_write(struct shm_ring *ring, int slot) {
+    struct shm_ring_header *header = (struct shm_ring_header *)ring->map;
+
+    return __atomic_add_fetch(&header->sequence[slot], 1, __ATOMIC_RELEASE);
+}
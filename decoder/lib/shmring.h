@@ -0,0 +1,47 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Ring of raw frames in shared memory
+ *
+ * The memory is an anonymous memfd, so it disappears with the process.
+ * Other processes open it through /proc/PID/fd/FD.
+ *
+ * Layout: A header page (struct shm_ring_header) followed by `slots` slots of `slot_size` bytes.
+ * Each slot has a sequence number in the header, which is odd while the slot is being written.
+ * A reader compares the sequence number before and after reading a slot to tell that
+ * the slot was not reused meanwhile.
+ */
+
+#define SHM_RING_MAGIC "NICMSHM1"
+#define SHM_RING_VERSION 1
+#define SHM_RING_HEADER_SIZE 4096
+#define SHM_RING_MAX_SLOTS 256
+
+struct shm_ring_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t slots;
+    uint64_t slot_size;
+    uint64_t header_size;
+    uint8_t reserved[32];
+    // Offset 64
+    uint64_t sequence[SHM_RING_MAX_SLOTS];
+};
+
+struct shm_ring {
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    size_t slot_size;
+    int slots;
+    int next_slot;
+    char path[64];
+};
+
+int init_shm_ring(struct shm_ring *ring, int slots, size_t slot_size);
+void destroy_shm_ring(struct shm_ring *ring);
+uint8_t *shm_ring_begin_write(struct shm_ring *ring, int *slot);
+uint64_t shm_ring_end_write(struct shm_ring *ring, int slot);
+size_t shm_ring_slot_offset(const struct shm_ring *ring, int slot);
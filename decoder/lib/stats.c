@@ -0,0 +1,87 @@
+#include <time.h>
+#include "stats.h"
+
+long now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static int __bucket_of(long us) {
+    int bucket = 0;
+
+    while (us > 0 && bucket < LATENCY_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+void latency_record(struct latency_histogram *histogram, long us) {
+    unsigned long max;
+
+    if (us < 0) {
+        us = 0;
+    }
+    counter_add(&histogram->count, 1);
+    counter_add(&histogram->total_us, us);
+    counter_add(histogram->buckets + __bucket_of(us), 1);
+
+    max = counter_get(&histogram->max_us);
+    while ((unsigned long)us > max &&
+        !atomic_compare_exchange_weak_explicit(&histogram->max_us, &max, us, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/**
+ * @brief Estimate a percentile by the upper bound of the bucket it falls in
+ */
+static unsigned long __percentile(const unsigned long *buckets, unsigned long count, unsigned long max, int percent) {
+    unsigned long rank = (count * percent + 99) / 100, seen = 0;
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            unsigned long bound = (1UL << i) - 1;
+
+            return bound < max ? bound : max;
+        }
+    }
+
+    return max;
+}
+
+/**
+ * @brief Make a JSON object of the histogram
+ *
+ * {"count", "total_us", "max_us", "p50_us", "p90_us", "p99_us", "buckets": [count of bucket 0, ...]}
+ */
+json_t *latency_to_json(struct latency_histogram *histogram) {
+    unsigned long buckets[LATENCY_BUCKETS], count = 0, max = counter_get(&histogram->max_us);
+    json_t *object = json_object();
+    json_t *array = json_array();
+    int i;
+
+    // Count the buckets rather than reading `count`, so that the percentiles agree with the buckets
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        buckets[i] = counter_get(histogram->buckets + i);
+        count += buckets[i];
+        json_array_append_new(array, json_integer(buckets[i]));
+    }
+
+    json_object_set_new(object, "count", json_integer(count));
+    json_object_set_new(object, "total_us", json_integer(counter_get(&histogram->total_us)));
+    json_object_set_new(object, "max_us", json_integer(max));
+    if (count > 0) {
+        json_object_set_new(object, "p50_us", json_integer(__percentile(buckets, count, max, 50)));
+        json_object_set_new(object, "p90_us", json_integer(__percentile(buckets, count, max, 90)));
+        json_object_set_new(object, "p99_us", json_integer(__percentile(buckets, count, max, 99)));
+    }
+    json_object_set_new(object, "buckets", array);
+
+    return object;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <stdatomic.h>
+#include <jansson.h>
+
+/*
+ * Counters and latency histograms of the hot paths
+ *
+ * They are updated by any thread without a lock, and read while being updated,
+ * so a snapshot is not exactly consistent across the counters.
+ * Latencies are in microseconds. The bucket i counts the latencies below 2^i us
+ * and at least 2^(i-1) us, and the last bucket counts all the longer ones.
+ */
+
+#define LATENCY_BUCKETS 24 // Up to 4 seconds
+
+struct latency_histogram {
+    atomic_ulong count;
+    atomic_ulong total_us;
+    atomic_ulong max_us;
+    atomic_ulong buckets[LATENCY_BUCKETS];
+};
+
+long now_us(void);
+void latency_record(struct latency_histogram *histogram, long us);
+json_t *latency_to_json(struct latency_histogram *histogram);
+
+static inline void counter_add(atomic_ulong *counter, unsigned long n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static inline unsigned long counter_get(atomic_ulong *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
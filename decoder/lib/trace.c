@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+struct trace_event {
+    long ts;
+    long duration;
+    const char *name;
+    const char *args;
+    long values[2];
+    int tid;
+    char phase;
+};
+
+struct trace_ring {
+    struct trace_event *events;
+    unsigned long mask;
+    // Events ever recorded. The event n is in the slot (n & mask).
+    atomic_ulong head;
+    int tid;
+    const char *thread_name;
+    // The thread has exited. The ring and its events are taken over by the next new thread.
+    int released;
+    struct trace_ring *next;
+};
+
+int trace_level = TRACE_LEVEL_INFO;
+
+static unsigned long trace_events = TRACE_DEFAULT_EVENTS;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *rings = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct trace_ring *thread_ring = NULL;
+
+/**
+ * @brief Set the level and the number of events kept per thread. Call it before the threads start.
+ *
+ * @param events Rounded up to a power of two (0: default)
+ */
+void init_trace(int level, int events) {
+    trace_level = level;
+    if (events > 0) {
+        trace_events = 1;
+        while (trace_events < (unsigned long)events) {
+            trace_events <<= 1;
+        }
+    }
+}
+
+static void __release_ring(void *arg) {
+    struct trace_ring *ring = arg;
+
+    pthread_mutex_lock(&rings_mutex);
+    ring->released = 1;
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+static void __create_ring_key(void) {
+    pthread_key_create(&ring_key, __release_ring);
+}
+
+/**
+ * @brief Get the ring of the calling thread, reusing one of an exited thread if any
+ *
+ * Connection threads of the daemon come and go, so the rings are recycled instead of freed.
+ */
+static struct trace_ring *__get_ring(void) {
+    struct trace_ring *ring;
+
+    if (thread_ring) {
+        return thread_ring;
+    }
+    pthread_once(&ring_key_once, __create_ring_key);
+
+    pthread_mutex_lock(&rings_mutex);
+    for (ring = rings; ring; ring = ring->next) {
+        if (ring->released) {
+            break;
+        }
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(struct trace_ring));
+        ring->events = calloc(trace_events, sizeof(struct trace_event));
+        ring->mask = trace_events - 1;
+        ring->next = rings;
+        rings = ring;
+    }
+    ring->tid = syscall(SYS_gettid);
+    ring->thread_name = NULL;
+    ring->released = 0;
+    pthread_mutex_unlock(&rings_mutex);
+
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+
+    return ring;
+}
+
+/**
+ * @brief Name the calling thread in the trace. The name must be a string literal.
+ */
+void trace_thread_name(const char *name) {
+    struct trace_ring *ring = __get_ring();
+
+    pthread_mutex_lock(&rings_mutex);
+    ring->thread_name = name;
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+/**
+ * @brief Record an event in the ring of the calling thread. Use the TRACE_* macros instead.
+ */
+void trace_record(char phase, const char *name, const char *args, long a, long b, long ts, long duration) {
+    struct trace_ring *ring = __get_ring();
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct trace_event *event = ring->events + (head & ring->mask);
+
+    event->ts = ts;
+    event->duration = duration;
+    event->name = name;
+    event->args = args;
+    event->values[0] = a;
+    event->values[1] = b;
+    event->tid = ring->tid;
+    event->phase = phase;
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void __export_event(FILE *fp, const struct trace_event *event, int pid, int first) {
+    const char *args = event->args;
+    int i;
+
+    fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%ld,\"pid\":%d,\"tid\":%d",
+        first ? "" : ",\n", event->name, event->phase, event->ts, pid, event->tid);
+    if (event->phase == 'X') {
+        fprintf(fp, ",\"dur\":%ld", event->duration);
+    } else if (event->phase == 'i') {
+        fprintf(fp, ",\"s\":\"t\"");
+    }
+    if (args) {
+        fprintf(fp, ",\"args\":{");
+        for (i = 0; i < 2 && *args; i++) {
+            size_t len = strcspn(args, ",");
+
+            fprintf(fp, "%s\"%.*s\":%ld", i > 0 ? "," : "", (int)len, args, event->values[i]);
+            args += len;
+            if (*args == ',') {
+                args++;
+            }
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "}");
+}
+
+/**
+ * @brief Write the events of all the threads in Chrome trace JSON
+ *
+ * The threads keep recording meanwhile. The events which may have been overwritten while
+ * copying the ring are dropped.
+ *
+ * @return int 0 on success
+ */
+int export_trace(FILE *fp) {
+    struct trace_ring *ring;
+    struct trace_event *copy = NULL;
+    unsigned long copy_size = 0;
+    int pid = getpid(), first = 1;
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+
+    pthread_mutex_lock(&rings_mutex);
+    for (ring = rings; ring; ring = ring->next) {
+        unsigned long size = ring->mask + 1;
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned long start = head > size ? head - size : 0, n;
+
+        if (copy_size < size) {
+            free(copy);
+            copy = malloc(size * sizeof(struct trace_event));
+            copy_size = size;
+        }
+        for (n = start; n < head; n++) {
+            copy[n - start] = ring->events[n & ring->mask];
+        }
+
+        // The slot being written now held the event (head_now - size)
+        unsigned long head_now = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned long valid = head_now + 1 > size ? head_now + 1 - size : 0;
+
+        for (n = start > valid ? start : valid; n < head; n++) {
+            __export_event(fp, copy + (n - start), pid, first);
+            first = 0;
+        }
+
+        if (ring->thread_name && !ring->released) {
+            fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", pid, ring->tid, ring->thread_name);
+            first = 0;
+        }
+    }
+    pthread_mutex_unlock(&rings_mutex);
+    free(copy);
+
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    return ferror(fp) ? -1 : 0;
+}
+
+/**
+ * @brief Write the trace to the file
+ *
+ * @return int 0 on success
+ */
+int write_trace(const char *path) {
+    FILE *fp = fopen(path, "w");
+    int ret;
+
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot write the trace to %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    ret = export_trace(fp);
+    if (fclose(fp) != 0) {
+        ret = -1;
+    }
+    if (ret == 0) {
+        fprintf(stderr, "Trace written to %s\n", path);
+    }
+
+    return ret;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <stdio.h>
+#include "stats.h"
+
+/*
+ * Binary event tracing for the hot paths
+ *
+ * Each thread records fixed-size events into its own ring buffer without any lock or formatting.
+ * The rings keep the latest events and are exported as Chrome trace JSON (chrome://tracing, Perfetto)
+ * at exit or on demand. Event names and argument names must be string literals: only the pointers are kept.
+ *
+ * Events above TRACE_MAX_LEVEL are compiled out (make TRACE_MAX_LEVEL=1), and the events above
+ * trace_level are skipped at the cost of a comparison.
+ */
+
+#define TRACE_LEVEL_OFF 0
+// Commands, seeks and the decisions of the seek policy
+#define TRACE_LEVEL_INFO 1
+// Every frame, packet and image
+#define TRACE_LEVEL_DEBUG 2
+
+#ifndef TRACE_MAX_LEVEL
+#define TRACE_MAX_LEVEL TRACE_LEVEL_DEBUG
+#endif
+
+#define TRACE_DEFAULT_EVENTS 8192
+
+extern int trace_level;
+
+#define TRACE_ENABLED(level) ((level) <= TRACE_MAX_LEVEL && (level) <= trace_level)
+
+/* Instant event. `args` names the values separated by a comma (e.g. "pts,pos"), or NULL. */
+#define TRACE_INSTANT(level, name, args, a, b) do { \
+        if (TRACE_ENABLED(level)) { \
+            trace_record('i', (name), (args), (a), (b), now_us(), 0); \
+        } \
+    } while (0)
+
+/* Timestamp to start a span, or 0 if the level is disabled */
+#define TRACE_START(level) (TRACE_ENABLED(level) ? now_us() : 0)
+
+/* Span from TRACE_START() until now */
+#define TRACE_SPAN(level, started, name, args, a, b) do { \
+        if (TRACE_ENABLED(level) && (started) > 0) { \
+            trace_record('X', (name), (args), (a), (b), (started), now_us() - (started)); \
+        } \
+    } while (0)
+
+/* Span already measured by the caller */
+#define TRACE_COMPLETE(level, name, args, a, b, started, duration) do { \
+        if (TRACE_ENABLED(level)) { \
+            trace_record('X', (name), (args), (a), (b), (started), (duration)); \
+        } \
+    } while (0)
+
+/* Counter track (the value is `a`) */
+#define TRACE_COUNTER(level, name, a) do { \
+        if (TRACE_ENABLED(level)) { \
+            trace_record('C', (name), "value", (a), 0, now_us(), 0); \
+        } \
+    } while (0)
+
+void init_trace(int level, int events);
+void trace_thread_name(const char *name);
+void trace_record(char phase, const char *name, const char *args, long a, long b, long ts, long duration);
+int export_trace(FILE *fp);
+int write_trace(const char *path);
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "workpool.h"
+#include "trace.h"
+
+struct work_worker {
+    struct work_pool *pool;
+    int index;
+};
+
+/**
+ * @brief Create the deques
+ *
+ * @param workers Number of workers (0: the number of CPUs)
+ * @param io_limit I/O bound jobs running at once (0: no limit)
+ */
+int init_work_pool(struct work_pool *pool, int workers, int io_limit) {
+    int i;
+
+    if (workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        workers = cpus > 0 ? cpus : 1;
+    }
+
+    memset(pool, 0, sizeof(*pool));
+    pool->num_workers = workers;
+    pool->deques = calloc(workers, sizeof(struct work_deque));
+    for (i = 0; i < workers; i++) {
+        pthread_mutex_init(&pool->deques[i].mutex, NULL);
+    }
+    atomic_init(&pool->io_free, io_limit > 0 ? io_limit : workers);
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    return 0;
+}
+
+static void __notify(struct work_pool *pool, int remaining) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->remaining += remaining;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * @brief Add a job to the deque of the worker (modulo the number of workers)
+ *
+ * @param io The job is I/O bound
+ */
+void work_pool_submit(struct work_pool *pool, int worker, void (*run)(void *arg), void *arg, int io) {
+    struct work_deque *deque = pool->deques + (worker % pool->num_workers);
+
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->num >= deque->allocated) {
+        deque->allocated = deque->allocated > 0 ? deque->allocated * 2 : 16;
+        deque->items = realloc(deque->items, sizeof(struct work_item) * deque->allocated);
+    }
+    deque->items[deque->num].run = run;
+    deque->items[deque->num].arg = arg;
+    deque->items[deque->num].io = io;
+    deque->num++;
+    pthread_mutex_unlock(&deque->mutex);
+
+    __notify(pool, 1);
+}
+
+static int __acquire_io(struct work_pool *pool) {
+    int free_slots = atomic_load(&pool->io_free);
+
+    while (free_slots > 0) {
+        if (atomic_compare_exchange_weak(&pool->io_free, &free_slots, free_slots - 1)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Take a job which can run now from the deque
+ *
+ * @param newest Take from the newest end (the owner) or the oldest end (a thief)
+ */
+static int __take_from(struct work_pool *pool, struct work_deque *deque, int newest, struct work_item *item) {
+    int i, found = 0;
+
+    pthread_mutex_lock(&deque->mutex);
+    for (i = 0; i < deque->num; i++) {
+        int k = newest ? deque->num - 1 - i : i;
+
+        if (!deque->items[k].io || __acquire_io(pool)) {
+            *item = deque->items[k];
+            memmove(deque->items + k, deque->items + k + 1, sizeof(struct work_item) * (deque->num - k - 1));
+            deque->num--;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&deque->mutex);
+
+    return found;
+}
+
+static void *__worker(void *arg) {
+    struct work_worker *worker = arg;
+    struct work_pool *pool = worker->pool;
+    struct work_item item;
+
+    trace_thread_name("work");
+    for (;;) {
+        unsigned long generation;
+        int i, found = 0;
+
+        pthread_mutex_lock(&pool->mutex);
+        generation = pool->generation;
+        if (pool->remaining == 0) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        for (i = 0; i < pool->num_workers && !found; i++) {
+            found = __take_from(pool, pool->deques + (worker->index + i) % pool->num_workers, i == 0, &item);
+        }
+
+        if (found) {
+            if (i > 1) {
+                TRACE_INSTANT(TRACE_LEVEL_DEBUG, "steal", "from", (worker->index + i - 1) % pool->num_workers, 0);
+            }
+            item.run(item.arg);
+            if (item.io) {
+                atomic_fetch_add(&pool->io_free, 1);
+            }
+            __notify(pool, -1);
+            continue;
+        }
+
+        // Nothing can run now. Wait for a job to be submitted or an I/O slot to be freed.
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->remaining > 0 && pool->generation == generation) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Run the workers until all the jobs are done. Jobs may submit more jobs.
+ *
+ * @return int 0 on success
+ */
+int run_work_pool(struct work_pool *pool) {
+    pthread_t *threads = calloc(pool->num_workers, sizeof(pthread_t));
+    struct work_worker *workers = calloc(pool->num_workers, sizeof(struct work_worker));
+    int i, started;
+
+    for (started = 0; started < pool->num_workers; started++) {
+        workers[started].pool = pool;
+        workers[started].index = started;
+        if (pthread_create(threads + started, NULL, __worker, workers + started) != 0) {
+            fprintf(stderr, "[workpool] Failed to start a worker\n");
+            break;
+        }
+    }
+    // The jobs of a missing worker are stolen by the others
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(workers);
+
+    return started > 0 ? 0 : -1;
+}
+
+void destroy_work_pool(struct work_pool *pool) {
+    int i;
+
+    for (i = 0; i < pool->num_workers; i++) {
+        pthread_mutex_destroy(&pool->deques[i].mutex);
+        free(pool->deques[i].items);
+    }
+    free(pool->deques);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Work-stealing pool for batches of jobs (nicm ingest)
+ *
+ * Each worker has its own deque. A worker takes its newest job, so the jobs submitted
+ * together to a worker (e.g. those of a file) run back to back while the file is in the
+ * page cache. An idle worker steals the oldest job of another worker.
+ * Jobs reading whole files are marked as I/O bound. At most io_limit of them run at once,
+ * so that a disk is not thrashed by many sequential readers; the other workers take
+ * CPU bound jobs meanwhile.
+ */
+
+struct work_item {
+    void (*run)(void *arg);
+    void *arg;
+    int io;
+};
+
+struct work_deque {
+    pthread_mutex_t mutex;
+    struct work_item *items;
+    int num;
+    int allocated;
+};
+
+struct work_pool {
+    struct work_deque *deques;
+    int num_workers;
+    atomic_int io_free;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // Jobs submitted and not finished
+    int remaining;
+    // Changes when a job is submitted or finished, so that a waiting worker looks again
+    unsigned long generation;
+};
+
+int init_work_pool(struct work_pool *pool, int workers, int io_limit);
+void work_pool_submit(struct work_pool *pool, int worker, void (*run)(void *arg), void *arg, int io);
+int run_work_pool(struct work_pool *pool);
+void destroy_work_pool(struct work_pool *pool);
@@ -1,10 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <getopt.h>
 #include <libavutil/avutil.h>
 
 #include "nicm.h"
+#include "lib/trace.h"
 
 enum NICM_SUBCOMMAND {
     CMD_NONE = 0,
@@ -12,14 +15,19 @@ enum NICM_SUBCOMMAND {
     CMD_INDEX,
     CMD_SERVE,
     CMD_DECODE,
-    CMD_CHECK
+    CMD_CHECK,
+    CMD_DAEMON,
+    CMD_INGEST
 };
 
 extern int do_detect(const char *ts_file, const char *output_file, struct file_open_options *opts);
-extern int do_index(const char *ts_file, const char *output_file, int stream, struct file_open_options *opts);
+extern int do_index(const char *ts_file, const char *output_file, int stream, int sidecar, int binary, struct file_open_options *opts);
 extern int do_serve(const char *ts_file, int stream, struct file_open_options *opts);
+extern int do_daemon(const char *socket_path, struct file_open_options *opts);
 extern int do_decode(const char *ts_file, const int stream, const enum NICM_STREAM_TYPE stream_type, const char *output_file, unsigned long *points, const char *info_file, struct file_open_options *opts);
-extern int do_check(const char *ts_file, const char *output_file);
+extern int do_check(const char *ts_file, const char *output_file, int jobs);
+extern int do_ingest(char **inputs, int num_inputs, const char *list_file, const char *output_file, int jobs, int workers, int io_jobs, struct file_open_options *opts);
+extern int parse_ingest_jobs(const char *str);
 
 static void usage(const char *argv0, enum NICM_SUBCOMMAND cmd) {
     fprintf(stderr, "nicm: nicd media tool (aka ntt4)\n\n");
@@ -30,6 +38,8 @@ static void usage(const char *argv0, enum NICM_SUBCOMMAND cmd) {
             fprintf(stderr, "Options:\n");
             fprintf(stderr, "    -o JSON: Specify output file\n");
             fprintf(stderr, "    -a DURATION: Set the duration (sec) for the first analysis\n");
+            fprintf(stderr, "    -t THREADS: Number of decoder threads (default: 0 = auto)\n");
+            fprintf(stderr, "    -T TYPE: Decoder threading (frame, slice or auto) (default: auto)\n");
 
             break;
 
@@ -39,7 +49,13 @@ static void usage(const char *argv0, enum NICM_SUBCOMMAND cmd) {
             fprintf(stderr, "Options:\n");
             fprintf(stderr, "    -o JSON: Specify output file\n");
             fprintf(stderr, "    -s STREAM: Video stream\n");
+            fprintf(stderr, "    -n: Update the index file (Movie file.STREAM.nidx) used by -b instead of writing JSON\n");
+            fprintf(stderr, "    -f FORMAT: Output format (json or bin) (default: json)\n");
+            fprintf(stderr, "    -j JOBS: Index a TS file in byte ranges on JOBS threads (default: 1)\n");
+            fprintf(stderr, "    -F IDLE: Follow the file being recorded until it does not grow for IDLE seconds\n");
             fprintf(stderr, "    -l DURATION: Set the duration (sec) for the first analysis\n");
+            fprintf(stderr, "    -t THREADS: Number of decoder threads (default: 0 = auto)\n");
+            fprintf(stderr, "    -T TYPE: Decoder threading (frame, slice or auto) (default: frame)\n");
 
             break;
 
@@ -49,7 +65,40 @@ static void usage(const char *argv0, enum NICM_SUBCOMMAND cmd) {
             fprintf(stderr, "Options:\n");
             fprintf(stderr, "    -s STREAM: Video stream\n");
             fprintf(stderr, "    -l DURATION: Set the duration (sec) for the first analysis\n");
-            fprintf(stderr, "    -b: Seek a frame by byte\n");
+            fprintf(stderr, "    -b: Seek a frame by byte (the index is kept in Movie file.STREAM.nidx)\n");
+            fprintf(stderr, "    -F IDLE: Follow the file being recorded until it does not grow for IDLE seconds\n");
+            fprintf(stderr, "    -m SIZE: Memory budget for the frame cache (e.g. 512M, 2G)\n");
+            fprintf(stderr, "    -d DIR: Directory for the persistent image cache\n");
+            fprintf(stderr, "    -D SIZE: Size limit of the persistent image cache (default: 1G)\n");
+            fprintf(stderr, "    -t THREADS: Number of decoder threads (default: 0 = auto)\n");
+            fprintf(stderr, "    -T TYPE: Decoder threading (frame, slice or auto) (default: slice)\n");
+            fprintf(stderr, "    -r FRAMES: Frames to decode ahead of the last request (default: 30, 0 = disabled)\n");
+            fprintf(stderr, "    -P VERSION: Protocol version (1: in-order, 2: tagged requests) (default: 1)\n");
+            fprintf(stderr, "    -S SLOTS: Serve raw frames through a shared memory ring of SLOTS frames\n");
+            fprintf(stderr, "    -E THREADS: Number of image encoder workers (default: 0 = number of CPUs)\n");
+            fprintf(stderr, "    -V LEVEL: Trace level (0: off, 1: commands and seeks, 2: every frame) (default: 1)\n");
+            fprintf(stderr, "    -x FILE: Write the trace in Chrome trace JSON at exit\n");
+
+            break;
+
+        case CMD_DAEMON:
+            fprintf(stderr, "Usage: %s daemon -u SOCKET [options...]\n\n", argv0);
+
+            fprintf(stderr, "Options:\n");
+            fprintf(stderr, "    -u SOCKET: Path of the Unix socket to listen on\n");
+            fprintf(stderr, "    -l DURATION: Set the duration (sec) for the first analysis\n");
+            fprintf(stderr, "    -b: Seek a frame by byte (the index is kept in Movie file.STREAM.nidx)\n");
+            fprintf(stderr, "    -F IDLE: Follow the file being recorded until it does not grow for IDLE seconds\n");
+            fprintf(stderr, "    -m SIZE: Memory budget for the frame caches of all the inputs (default: 1G)\n");
+            fprintf(stderr, "    -d DIR: Directory for the persistent image cache\n");
+            fprintf(stderr, "    -D SIZE: Size limit of the persistent image cache (default: 1G)\n");
+            fprintf(stderr, "    -t THREADS: Number of decoder threads (default: 0 = auto)\n");
+            fprintf(stderr, "    -T TYPE: Decoder threading (frame, slice or auto) (default: slice)\n");
+            fprintf(stderr, "    -r FRAMES: Frames to decode ahead of the last request (default: 30, 0 = disabled)\n");
+            fprintf(stderr, "    -S SLOTS: Serve raw frames through a shared memory ring of SLOTS frames per input\n");
+            fprintf(stderr, "    -E THREADS: Number of image encoder workers shared by the inputs (default: 0 = number of CPUs)\n");
+            fprintf(stderr, "    -V LEVEL: Trace level (0: off, 1: commands and seeks, 2: every frame) (default: 1)\n");
+            fprintf(stderr, "    -x FILE: Write the trace in Chrome trace JSON at exit\n");
 
             break;
 
@@ -63,7 +112,9 @@ static void usage(const char *argv0, enum NICM_SUBCOMMAND cmd) {
             fprintf(stderr, "    -o FILE: Specify output file\n");
             fprintf(stderr, "    -g SEGMENT: Specify information file (audio only)\n");
             fprintf(stderr, "    -l DURATION: Set the duration (sec) for the first analysis\n");
-            fprintf(stderr, "    -b: Seek a frame by byte\n");
+            fprintf(stderr, "    -b: Seek a frame by byte (the index is kept in Movie file.STREAM.nidx)\n");
+            fprintf(stderr, "    -t THREADS: Number of decoder threads (default: 0 = auto)\n");
+            fprintf(stderr, "    -T TYPE: Decoder threading (frame, slice or auto) (default: frame)\n");
 
             break;
 
@@ -72,6 +123,22 @@ static void usage(const char *argv0, enum NICM_SUBCOMMAND cmd) {
 
             fprintf(stderr, "Options:\n");
             fprintf(stderr, "    -o FILE: Output filename\n");
+            fprintf(stderr, "    -j JOBS: Check a file in chunks on JOBS threads (default: 0 = number of CPUs)\n");
+
+            break;
+
+        case CMD_INGEST:
+            fprintf(stderr, "Usage: %s ingest [options...] (Movie file or directory...)\n\n", argv0);
+
+            fprintf(stderr, "Options:\n");
+            fprintf(stderr, "    -o FILE: Write a line of JSON per file to FILE\n");
+            fprintf(stderr, "    -L LIST: Read the files from LIST (a path per line, - for stdin)\n");
+            fprintf(stderr, "    -J JOBS: Jobs for each file (comma separated: detect, index, check) (default: all)\n");
+            fprintf(stderr, "    -w WORKERS: Number of workers (default: 0 = number of CPUs)\n");
+            fprintf(stderr, "    -i JOBS: Jobs reading whole files (index and check) at once (default: 2)\n");
+            fprintf(stderr, "    -l DURATION: Set the duration (sec) for the first analysis\n");
+            fprintf(stderr, "    -t THREADS: Number of decoder threads per job (default: 1)\n");
+            fprintf(stderr, "    -T TYPE: Decoder threading (frame, slice or auto) (default: frame)\n");
 
             break;
 
@@ -82,9 +149,58 @@ static void usage(const char *argv0, enum NICM_SUBCOMMAND cmd) {
             fprintf(stderr, "    detect (TS file)\n");
             fprintf(stderr, "    index (TS file)\n");
             fprintf(stderr, "    serve (TS file)\n");
+            fprintf(stderr, "    daemon -u (Socket)\n");
             fprintf(stderr, "    decode (-v|-a|-s STREAM) (Movie file) (PTS...)\n");
+            fprintf(stderr, "    ingest (Movie file or directory...)\n");
+            break;
+    }
+}
+
+/**
+ * @brief Parse a size with an optional K/M/G suffix (binary units)
+ *
+ * @return long Size in bytes, or -1 on error
+ */
+static long parse_size(const char *str) {
+    char *end;
+    long size;
+    int shift = 0;
+
+    errno = 0;
+    size = strtol(str, &end, 10);
+    if (end == str || size < 0 || errno == ERANGE) {
+        return -1;
+    }
+    switch (*end) {
+        case 'g': case 'G':
+            shift += 10;
+            // fall through
+        case 'm': case 'M':
+            shift += 10;
+            // fall through
+        case 'k': case 'K':
+            shift += 10;
+            end++;
             break;
     }
+    if (*end != '\0' || size > LONG_MAX >> shift) {
+        return -1;
+    }
+    size <<= shift;
+
+    return size;
+}
+
+static enum NICM_THREAD_TYPE parse_thread_type(const char *str) {
+    if (!strcmp(str, "frame")) {
+        return THREAD_TYPE_FRAME;
+    } else if (!strcmp(str, "slice")) {
+        return THREAD_TYPE_SLICE;
+    } else if (!strcmp(str, "auto")) {
+        return THREAD_TYPE_AUTO;
+    }
+
+    return THREAD_TYPE_DEFAULT;
 }
 
 int main(int argc, char **argv) {
@@ -118,10 +234,21 @@ int main(int argc, char **argv) {
                 .name = "analysis-duration",
                 .has_arg = required_argument,
                 .val = 'l'
-            }
+            },
+            {
+                .name = "threads",
+                .has_arg = required_argument,
+                .val = 't'
+            },
+            {
+                .name = "thread-type",
+                .has_arg = required_argument,
+                .val = 'T'
+            },
+            {}
         };
 
-        while ((ret = getopt_long(argc, argv, "o:h?l:", detect_opts, &index)) > 0) {
+        while ((ret = getopt_long(argc, argv, "o:h?l:t:T:", detect_opts, &index)) > 0) {
             if (ret == 'o') {
                 output_file = optarg;
             } else if (ret == 'h' || ret == '?') {
@@ -129,6 +256,15 @@ int main(int argc, char **argv) {
                 return 1;
             } else if (ret == 'l') {
                 file_opts.analyze_duration = atol(optarg) * 1000 * 1000;
+            } else if (ret == 't') {
+                file_opts.threads = atoi(optarg);
+            } else if (ret == 'T') {
+                file_opts.thread_type = parse_thread_type(optarg);
+                if (file_opts.thread_type == THREAD_TYPE_DEFAULT) {
+                    fprintf(stderr, "Error: Unknown thread type '%s'.\n", optarg);
+                    usage(argv[0], CMD_DETECT);
+                    return 1;
+                }
             }
         }
         if (optind >= argc) {
@@ -146,6 +282,8 @@ int main(int argc, char **argv) {
         const char *output_file = NULL;
         const char *ts_file = NULL;
         int stream = -1;
+        int sidecar = 0;
+        int binary = 0;
 
         const struct option index_opts[] = {
             {
@@ -158,6 +296,26 @@ int main(int argc, char **argv) {
                 .has_arg = required_argument,
                 .val = 's'
             },
+            {
+                .name = "sidecar",
+                .has_arg = no_argument,
+                .val = 'n'
+            },
+            {
+                .name = "jobs",
+                .has_arg = required_argument,
+                .val = 'j'
+            },
+            {
+                .name = "format",
+                .has_arg = required_argument,
+                .val = 'f'
+            },
+            {
+                .name = "follow",
+                .has_arg = required_argument,
+                .val = 'F'
+            },
             {
                 .name = "help",
                 .has_arg = no_argument,
@@ -167,19 +325,55 @@ int main(int argc, char **argv) {
                 .name = "analysis-duration",
                 .has_arg = required_argument,
                 .val = 'l'
-            }
+            },
+            {
+                .name = "threads",
+                .has_arg = required_argument,
+                .val = 't'
+            },
+            {
+                .name = "thread-type",
+                .has_arg = required_argument,
+                .val = 'T'
+            },
+            {}
         };
 
-        while ((ret = getopt_long(argc, argv, "o:s:h?l:", index_opts, &index)) > 0) {
+        while ((ret = getopt_long(argc, argv, "o:s:nj:F:f:h?l:t:T:", index_opts, &index)) > 0) {
             if (ret == 'o') {
                 output_file = optarg;
             } else if (ret == 's') {
                 stream = atoi(optarg);
+            } else if (ret == 'n') {
+                sidecar = 1;
+            } else if (ret == 'j') {
+                file_opts.index_jobs = atoi(optarg);
+            } else if (ret == 'f') {
+                if (!strcmp(optarg, "bin")) {
+                    binary = 1;
+                } else if (!strcmp(optarg, "json")) {
+                    binary = 0;
+                } else {
+                    fprintf(stderr, "Error: Unknown format '%s'.\n", optarg);
+                    usage(argv[0], CMD_INDEX);
+                    return 1;
+                }
+            } else if (ret == 'F') {
+                file_opts.follow_timeout = atol(optarg) * 1000 * 1000;
             } else if (ret == 'h' || ret == '?') {
                 usage(argv[0], CMD_INDEX);
                 return 1;
             } else if (ret == 'l') {
                file_opts.analyze_duration = atol(optarg) * 1000 * 1000;
+            } else if (ret == 't') {
+                file_opts.threads = atoi(optarg);
+            } else if (ret == 'T') {
+                file_opts.thread_type = parse_thread_type(optarg);
+                if (file_opts.thread_type == THREAD_TYPE_DEFAULT) {
+                    fprintf(stderr, "Error: Unknown thread type '%s'.\n", optarg);
+                    usage(argv[0], CMD_INDEX);
+                    return 1;
+                }
             }
         }
         if (optind >= argc) {
@@ -190,7 +384,7 @@ int main(int argc, char **argv) {
         }
         ts_file = argv[optind];
 
-        return do_index(ts_file, output_file, stream, &file_opts);
+        return do_index(ts_file, output_file, stream, sidecar, binary, &file_opts);
     } else if (!strcmp(argv[1], "serve")) {
         // Subcommand: serve
         int index, ret;
@@ -217,10 +411,71 @@ int main(int argc, char **argv) {
                 .name = "seek-by-byte",
                 .has_arg = no_argument,
                 .val = 'b'
-            }
+            },
+            {
+                .name = "follow",
+                .has_arg = required_argument,
+                .val = 'F'
+            },
+            {
+                .name = "cache-size",
+                .has_arg = required_argument,
+                .val = 'm'
+            },
+            {
+                .name = "disk-cache",
+                .has_arg = required_argument,
+                .val = 'd'
+            },
+            {
+                .name = "disk-cache-size",
+                .has_arg = required_argument,
+                .val = 'D'
+            },
+            {
+                .name = "threads",
+                .has_arg = required_argument,
+                .val = 't'
+            },
+            {
+                .name = "thread-type",
+                .has_arg = required_argument,
+                .val = 'T'
+            },
+            {
+                .name = "read-ahead",
+                .has_arg = required_argument,
+                .val = 'r'
+            },
+            {
+                .name = "protocol",
+                .has_arg = required_argument,
+                .val = 'P'
+            },
+            {
+                .name = "shm-slots",
+                .has_arg = required_argument,
+                .val = 'S'
+            },
+            {
+                .name = "encoders",
+                .has_arg = required_argument,
+                .val = 'E'
+            },
+            {
+                .name = "trace-level",
+                .has_arg = required_argument,
+                .val = 'V'
+            },
+            {
+                .name = "trace-file",
+                .has_arg = required_argument,
+                .val = 'x'
+            },
+            {}
         };
 
-        while ((ret = getopt_long(argc, argv, "s:h?l:b", serve_opts, &index)) > 0) {
+        while ((ret = getopt_long(argc, argv, "s:h?l:bF:m:d:D:t:T:r:P:S:E:V:x:", serve_opts, &index)) > 0) {
             if (ret == 's') {
                 stream = atoi(optarg);
             } else if (ret == 'h' || ret == '?') {
@@ -230,6 +485,64 @@ int main(int argc, char **argv) {
                 file_opts.analyze_duration = atol(optarg) * 1000 * 1000;
             } else if (ret == 'b') {
                 file_opts.seek_by_byte = 1;
+            } else if (ret == 'F') {
+                file_opts.follow_timeout = atol(optarg) * 1000 * 1000;
+            } else if (ret == 'm') {
+                file_opts.cache_size = parse_size(optarg);
+                if (file_opts.cache_size <= 0) {
+                    fprintf(stderr, "Error: Invalid cache size '%s'.\n", optarg);
+                    usage(argv[0], CMD_SERVE);
+                    return 1;
+                }
+            } else if (ret == 'd') {
+                file_opts.disk_cache_dir = optarg;
+            } else if (ret == 'D') {
+                file_opts.disk_cache_size = parse_size(optarg);
+                if (file_opts.disk_cache_size <= 0) {
+                    fprintf(stderr, "Error: Invalid cache size '%s'.\n", optarg);
+                    usage(argv[0], CMD_SERVE);
+                    return 1;
+                }
+            } else if (ret == 't') {
+                file_opts.threads = atoi(optarg);
+            } else if (ret == 'T') {
+                file_opts.thread_type = parse_thread_type(optarg);
+                if (file_opts.thread_type == THREAD_TYPE_DEFAULT) {
+                    fprintf(stderr, "Error: Unknown thread type '%s'.\n", optarg);
+                    usage(argv[0], CMD_SERVE);
+                    return 1;
+                }
+            } else if (ret == 'r') {
+                file_opts.readahead_frames = atoi(optarg);
+                if (file_opts.readahead_frames <= 0) {
+                    // Disabled (0 in the options means the default)
+                    file_opts.readahead_frames = -1;
+                }
+            } else if (ret == 'P') {
+                file_opts.protocol_version = atoi(optarg);
+                if (file_opts.protocol_version < 1 || file_opts.protocol_version > 2) {
+                    fprintf(stderr, "Error: Unsupported protocol version '%s'.\n", optarg);
+                    usage(argv[0], CMD_SERVE);
+                    return 1;
+                }
+            } else if (ret == 'S') {
+                file_opts.shm_slots = atoi(optarg);
+                if (file_opts.shm_slots < 0 || file_opts.shm_slots > 256) {
+                    fprintf(stderr, "Error: The number of slots must be 0 - 256.\n");
+                    usage(argv[0], CMD_SERVE);
+                    return 1;
+                }
+            } else if (ret == 'E') {
+                file_opts.encoder_threads = atoi(optarg);
+            } else if (ret == 'V') {
+                trace_level = atoi(optarg);
+                if (trace_level < TRACE_LEVEL_OFF || trace_level > TRACE_LEVEL_DEBUG) {
+                    fprintf(stderr, "Error: The trace level must be 0 - 2.\n");
+                    usage(argv[0], CMD_SERVE);
+                    return 1;
+                }
+            } else if (ret == 'x') {
+                file_opts.trace_file = optarg;
             }
         }
         if (optind >= argc) {
@@ -291,10 +604,21 @@ int main(int argc, char **argv) {
                 .name = "seek-by-byte",
                 .has_arg = no_argument,
                 .val = 'b'
-            }
+            },
+            {
+                .name = "threads",
+                .has_arg = required_argument,
+                .val = 't'
+            },
+            {
+                .name = "thread-type",
+                .has_arg = required_argument,
+                .val = 'T'
+            },
+            {}
         };
 
-        while ((ret = getopt_long(argc, argv, "s:o:avh?g:l:b", decode_opts, &index)) > 0) {
+        while ((ret = getopt_long(argc, argv, "s:o:avh?g:l:bt:T:", decode_opts, &index)) > 0) {
             if (ret == 's') {
                 stream = atoi(optarg);
             } else if (ret == 'v') {
@@ -312,6 +636,15 @@ int main(int argc, char **argv) {
                 file_opts.analyze_duration = atol(optarg) * 1000 * 1000;
             } else if (ret == 'b') {
                 file_opts.seek_by_byte = 1;
+            } else if (ret == 't') {
+                file_opts.threads = atoi(optarg);
+            } else if (ret == 'T') {
+                file_opts.thread_type = parse_thread_type(optarg);
+                if (file_opts.thread_type == THREAD_TYPE_DEFAULT) {
+                    fprintf(stderr, "Error: Unknown thread type '%s'.\n", optarg);
+                    usage(argv[0], CMD_DECODE);
+                    return 1;
+                }
             }
         }
 
@@ -352,6 +685,7 @@ int main(int argc, char **argv) {
         const char *ts_file = NULL, *output_file = NULL;
         int ret;
         int index;
+        int jobs = 0;
 
         const struct option check_opts[] = {
             {
@@ -363,12 +697,20 @@ int main(int argc, char **argv) {
                 .name = "output",
                 .has_arg = required_argument,
                 .val = 'o'
-            }
+            },
+            {
+                .name = "jobs",
+                .has_arg = required_argument,
+                .val = 'j'
+            },
+            {}
         };
 
-        while ((ret = getopt_long(argc, argv, "o:h?", check_opts, &index)) > 0) {
+        while ((ret = getopt_long(argc, argv, "o:j:h?", check_opts, &index)) > 0) {
             if (ret == 'o') {
                 output_file = optarg;
+            } else if (ret == 'j') {
+                jobs = atoi(optarg);
             } else if (ret == 'h' || ret == '?') {
                 usage(argv[0], CMD_CHECK);
                 return 1;
@@ -378,9 +720,260 @@ int main(int argc, char **argv) {
             ts_file = argv[optind];
         }
 
-        ret = do_check(ts_file, output_file);
+        ret = do_check(ts_file, output_file, jobs);
 
         return ret;
+    } else if (!strcmp(argv[1], "daemon")) {
+        // Subcommand: daemon
+        int index, ret;
+        const char *socket_path = NULL;
+
+        const struct option daemon_opts[] = {
+            {
+                .name = "socket",
+                .has_arg = required_argument,
+                .val = 'u'
+            },
+            {
+                .name = "help",
+                .has_arg = no_argument,
+                .val = 'h'
+            },
+            {
+                .name = "analysis-duration",
+                .has_arg = required_argument,
+                .val = 'l'
+            },
+            {
+                .name = "seek-by-byte",
+                .has_arg = no_argument,
+                .val = 'b'
+            },
+            {
+                .name = "follow",
+                .has_arg = required_argument,
+                .val = 'F'
+            },
+            {
+                .name = "cache-size",
+                .has_arg = required_argument,
+                .val = 'm'
+            },
+            {
+                .name = "disk-cache",
+                .has_arg = required_argument,
+                .val = 'd'
+            },
+            {
+                .name = "disk-cache-size",
+                .has_arg = required_argument,
+                .val = 'D'
+            },
+            {
+                .name = "threads",
+                .has_arg = required_argument,
+                .val = 't'
+            },
+            {
+                .name = "thread-type",
+                .has_arg = required_argument,
+                .val = 'T'
+            },
+            {
+                .name = "read-ahead",
+                .has_arg = required_argument,
+                .val = 'r'
+            },
+            {
+                .name = "shm-slots",
+                .has_arg = required_argument,
+                .val = 'S'
+            },
+            {
+                .name = "encoders",
+                .has_arg = required_argument,
+                .val = 'E'
+            },
+            {
+                .name = "trace-level",
+                .has_arg = required_argument,
+                .val = 'V'
+            },
+            {
+                .name = "trace-file",
+                .has_arg = required_argument,
+                .val = 'x'
+            },
+            {}
+        };
+
+        while ((ret = getopt_long(argc, argv, "u:h?l:bF:m:d:D:t:T:r:S:E:V:x:", daemon_opts, &index)) > 0) {
+            if (ret == 'u') {
+                socket_path = optarg;
+            } else if (ret == 'h' || ret == '?') {
+                usage(argv[0], CMD_DAEMON);
+                return 1;
+            } else if (ret == 'l') {
+                file_opts.analyze_duration = atol(optarg) * 1000 * 1000;
+            } else if (ret == 'b') {
+                file_opts.seek_by_byte = 1;
+            } else if (ret == 'F') {
+                file_opts.follow_timeout = atol(optarg) * 1000 * 1000;
+            } else if (ret == 'm') {
+                file_opts.cache_size = parse_size(optarg);
+                if (file_opts.cache_size <= 0) {
+                    fprintf(stderr, "Error: Invalid cache size '%s'.\n", optarg);
+                    usage(argv[0], CMD_DAEMON);
+                    return 1;
+                }
+            } else if (ret == 'd') {
+                file_opts.disk_cache_dir = optarg;
+            } else if (ret == 'D') {
+                file_opts.disk_cache_size = parse_size(optarg);
+                if (file_opts.disk_cache_size <= 0) {
+                    fprintf(stderr, "Error: Invalid cache size '%s'.\n", optarg);
+                    usage(argv[0], CMD_DAEMON);
+                    return 1;
+                }
+            } else if (ret == 't') {
+                file_opts.threads = atoi(optarg);
+            } else if (ret == 'T') {
+                file_opts.thread_type = parse_thread_type(optarg);
+                if (file_opts.thread_type == THREAD_TYPE_DEFAULT) {
+                    fprintf(stderr, "Error: Unknown thread type '%s'.\n", optarg);
+                    usage(argv[0], CMD_DAEMON);
+                    return 1;
+                }
+            } else if (ret == 'r') {
+                file_opts.readahead_frames = atoi(optarg);
+                if (file_opts.readahead_frames <= 0) {
+                    // Disabled (0 in the options means the default)
+                    file_opts.readahead_frames = -1;
+                }
+            } else if (ret == 'S') {
+                file_opts.shm_slots = atoi(optarg);
+                if (file_opts.shm_slots < 0 || file_opts.shm_slots > 256) {
+                    fprintf(stderr, "Error: The number of slots must be 0 - 256.\n");
+                    usage(argv[0], CMD_DAEMON);
+                    return 1;
+                }
+            } else if (ret == 'E') {
+                file_opts.encoder_threads = atoi(optarg);
+            } else if (ret == 'V') {
+                trace_level = atoi(optarg);
+                if (trace_level < TRACE_LEVEL_OFF || trace_level > TRACE_LEVEL_DEBUG) {
+                    fprintf(stderr, "Error: The trace level must be 0 - 2.\n");
+                    usage(argv[0], CMD_DAEMON);
+                    return 1;
+                }
+            } else if (ret == 'x') {
+                file_opts.trace_file = optarg;
+            }
+        }
+        if (socket_path == NULL) {
+            fprintf(stderr, "Error: No socket is specified.\n");
+            usage(argv[0], CMD_DAEMON);
+
+            return 1;
+        }
+        file_opts.protocol_version = 2;
+
+        return do_daemon(socket_path, &file_opts);
+    } else if (!strcmp(argv[1], "ingest")) {
+        // Subcommand: ingest
+        int index, ret;
+        const char *output_file = NULL, *list_file = NULL;
+        int jobs = 0, workers = 0, io_jobs = 0;
+
+        const struct option ingest_opts[] = {
+            {
+                .name = "output",
+                .has_arg = required_argument,
+                .val = 'o'
+            },
+            {
+                .name = "list",
+                .has_arg = required_argument,
+                .val = 'L'
+            },
+            {
+                .name = "jobs",
+                .has_arg = required_argument,
+                .val = 'J'
+            },
+            {
+                .name = "workers",
+                .has_arg = required_argument,
+                .val = 'w'
+            },
+            {
+                .name = "io-jobs",
+                .has_arg = required_argument,
+                .val = 'i'
+            },
+            {
+                .name = "help",
+                .has_arg = no_argument,
+                .val = 'h'
+            },
+            {
+                .name = "analysis-duration",
+                .has_arg = required_argument,
+                .val = 'l'
+            },
+            {
+                .name = "threads",
+                .has_arg = required_argument,
+                .val = 't'
+            },
+            {
+                .name = "thread-type",
+                .has_arg = required_argument,
+                .val = 'T'
+            },
+            {}
+        };
+
+        while ((ret = getopt_long(argc, argv, "o:L:J:w:i:h?l:t:T:", ingest_opts, &index)) > 0) {
+            if (ret == 'o') {
+                output_file = optarg;
+            } else if (ret == 'L') {
+                list_file = optarg;
+            } else if (ret == 'J') {
+                jobs = parse_ingest_jobs(optarg);
+                if (jobs == 0) {
+                    fprintf(stderr, "Error: Unknown jobs '%s'.\n", optarg);
+                    usage(argv[0], CMD_INGEST);
+                    return 1;
+                }
+            } else if (ret == 'w') {
+                workers = atoi(optarg);
+            } else if (ret == 'i') {
+                io_jobs = atoi(optarg);
+            } else if (ret == 'h' || ret == '?') {
+                usage(argv[0], CMD_INGEST);
+                return 1;
+            } else if (ret == 'l') {
+                file_opts.analyze_duration = atol(optarg) * 1000 * 1000;
+            } else if (ret == 't') {
+                file_opts.threads = atoi(optarg);
+            } else if (ret == 'T') {
+                file_opts.thread_type = parse_thread_type(optarg);
+                if (file_opts.thread_type == THREAD_TYPE_DEFAULT) {
+                    fprintf(stderr, "Error: Unknown thread type '%s'.\n", optarg);
+                    usage(argv[0], CMD_INGEST);
+                    return 1;
+                }
+            }
+        }
+        if (optind >= argc && !list_file) {
+            fprintf(stderr, "Error: No file is specified.\n");
+            usage(argv[0], CMD_INGEST);
+
+            return 1;
+        }
+
+        return do_ingest(argv + optind, argc - optind, list_file, output_file, jobs, workers, io_jobs, &file_opts);
     } else {
         fprintf(stderr, "Error: Unknown command '%s'\n", argv[1]);
         usage(argv[0], CMD_NONE);
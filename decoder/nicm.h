@@ -6,10 +6,45 @@ enum NICM_STREAM_TYPE {
     STREAM_TYPE_AUDIO
 };
 
+enum NICM_THREAD_TYPE {
+    THREAD_TYPE_DEFAULT, // Decided by the subcommand
+    THREAD_TYPE_FRAME,
+    THREAD_TYPE_SLICE,
+    THREAD_TYPE_AUTO // Frame and slice
+};
+
 struct file_open_options {
     long analyze_duration;
     long probe_size;
     long skip_initial_bytes;
 
     int seek_by_byte;
+    // The file is being recorded: wait this long for it to grow at the end (usec, 0: disabled)
+    long follow_timeout;
+
+    // Decoder threads (0: auto)
+    int threads;
+    enum NICM_THREAD_TYPE thread_type;
+
+    // Threads indexing a TS file in byte ranges (0 or 1: a single demuxer)
+    int index_jobs;
+
+    long cache_size;
+    const char *disk_cache_dir;
+    long disk_cache_size;
+
+    // Frames decoded ahead of the last request (0: default, negative: disabled)
+    int readahead_frames;
+
+    // Serve protocol version (0: the original untagged protocol)
+    int protocol_version;
+
+    // Image encoder workers (0: the number of CPUs)
+    int encoder_threads;
+
+    // Slots of the shared memory for raw frames (0: disabled)
+    int shm_slots;
+
+    // Chrome trace JSON written at exit (optional)
+    const char *trace_file;
 };
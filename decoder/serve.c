@@ -1,73 +1,402 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/imgutils.h>
 #include <libswscale/swscale.h>
+#include <libavutil/opt.h>
 #include <jansson.h>
 #include "lib/framecache.h"
+#include "lib/diskcache.h"
+#include "lib/pool.h"
+#include "lib/shmring.h"
+#include "lib/encoder_pool.h"
 #include "lib/helper.h"
+#include "lib/frameindex.h"
+#include "lib/indexer.h"
+#include "lib/probecache.h"
 #include "lib/scene_detect.h"
+#include "lib/seek_policy.h"
+#include "lib/stats.h"
+#include "lib/trace.h"
+#include "serve.h"
 
-/* Protocol */
-#define NICM_SERVE_COMMAND_QUIT  0
-#define NICM_SERVE_COMMAND_INFO  1
-/* Image: [0]: Frame PTS / [1]: Decode options / [2]: Image options
- *   Decode options: 0 .. return only exact frame / 1 .. return the nearest frame
- *   Image options:  0 .. original size / 1 .. half size / 2 .. resized original size / 3 .. resized half size | 0 .. PNG / 4 .. JPEG
- */
-#define NICM_SERVE_COMMAND_IMAGE 2
+#define SCENE_DETECT_MAX_FRAMES 2000
+#define SCENE_DETECT_DEFAULT_FRAMES 100
+#define IMAGE_RANGE_MAX_FRAMES 1000
+// The images of a range are held in memory until sent, so the sequence ends early beyond this
+#define IMAGE_RANGE_MAX_BYTES (256UL << 20)
+
+/* Image options */
+#define IMAGE_SIZES 4
+#define IMAGE_FORMAT_SHIFT 2
+#define IMAGE_OPTIONS (IMAGE_SIZES * (sizeof(image_formats) / sizeof(image_formats[0])))
+#define IMAGE_MAX_QUALITY 100
+// Key of an image in the disk cache
+#define IMAGE_CACHE_KEY(opt, quality) ((opt) | ((quality) << 8))
+
+static void set_png_quality(AVCodecContext *context, int quality) {
+    if (quality > 0) {
+        context->compression_level = (quality > 10 ? 10 : quality) - 1;
+    }
+}
+
+static void set_jpeg_quality(AVCodecContext *context, int quality) {
+    if (quality > 0) {
+        // Quality 100 .. 1 to qscale 2 .. 31
+        context->flags |= AV_CODEC_FLAG_QSCALE;
+        context->global_quality = FF_QP2LAMBDA * (2 + (IMAGE_MAX_QUALITY - quality) * 29 / (IMAGE_MAX_QUALITY - 1));
+    }
+}
+
+static void set_webp_quality(AVCodecContext *context, int quality) {
+    // Favor speed over size
+    context->compression_level = 1;
+    if (quality > 0) {
+        av_opt_set_int(context, "quality", quality, AV_OPT_SEARCH_CHILDREN);
+    }
+}
 
-#define NICM_SERVE_COMMAND_SCENE_DETECT 256
-/* Image: [0]: Base Frame PTS / [1]: Detect options / [2]: Max frames (default: 100, max: 2000) / [3]: Cutoff score
- *   Detect options: 0 .. detect forward / 1 .. detect backward
+/*
+ * Output formats of the images. The index is the upper bits of the image option.
+ * To add a format, append an entry here. Encoders not built in FFmpeg are reported as 501.
  */
+static const struct image_format {
+    const char *name;
+    enum AVCodecID codec_id;
+    enum AVPixelFormat fmt;
+    void (*set_quality)(AVCodecContext *context, int quality);
+} image_formats[] = {
+    { "png", AV_CODEC_ID_PNG, AV_PIX_FMT_RGB24, set_png_quality },
+    { "jpeg", AV_CODEC_ID_MJPEG, AV_PIX_FMT_YUVJ420P, set_jpeg_quality },
+    { "rgba", AV_CODEC_ID_RAWVIDEO, AV_PIX_FMT_RGBA, NULL },
+    { "bgra", AV_CODEC_ID_RAWVIDEO, AV_PIX_FMT_BGRA, NULL },
+    { "qoi", AV_CODEC_ID_QOI, AV_PIX_FMT_RGBA, NULL },
+    { "webp", AV_CODEC_ID_WEBP, AV_PIX_FMT_YUV420P, set_webp_quality },
+};
+_Static_assert(IMAGE_OPTIONS <= FRAMECACHE_MAX_IMAGES, "The framecache cannot hold an image of every option");
+
+#define DEFAULT_DISK_CACHE_SIZE (1UL << 30) // 1 GB
+
+#define MAX_CACHE_FRAMES 1024
+#define DEFAULT_CACHE_SIZE (256UL << 20) // 256 MB
+// Decode forward up to this distance until the costs of decoding and seeking are measured
+#define INITIAL_SEEK_THRESHOLD 30
+// Seeks retried with a longer preroll when no keyframe is found before the frame
+#define SEEK_MAX_ATTEMPTS 3
+#define DEFAULT_READAHEAD_FRAMES 30
+// A request beyond the end of the file being recorded waits this long for it to grow (usec)
+#define FOLLOW_READ_TIMEOUT (1000L * 1000)
+
+struct serve_request {
+    struct nicm_serve_command_v2 cmd;
+    struct serve_session *session;
+    // When the command was read
+    long received;
+    struct serve_request *next;
+};
 
-#define SCENE_DETECT_MAX_FRAMES 2000
-#define SCENE_DETECT_DEFAULT_FRAMES 100
+enum serve_stats_command {
+    STATS_IMAGE,
+    // Answered by the session thread without waiting for the command thread
+    STATS_IMAGE_CACHED,
+    STATS_IMAGE_RANGE,
+    STATS_FRAME,
+    STATS_SCENE_DETECT,
+    STATS_COMMANDS
+};
 
-struct nicm_serve_command {
-    long command;
-    long args[7];
+static const char *stats_command_names[STATS_COMMANDS] = {
+    "image", "image_cached", "image_range", "frame", "scene_detect"
 };
-struct nicm_serve_response {
-    long code;
-    long size;
+
+/*
+ * Performance counters of an input, reported by the STATS command
+ */
+struct serve_stats {
+    // Frames requested by the commands, found in the cache or not
+    atomic_ulong cache_hits;
+    atomic_ulong cache_misses;
+    // Encoded images found in the frame cache and in the disk cache
+    atomic_ulong image_hits;
+    atomic_ulong disk_hits;
+    atomic_ulong images_encoded;
+
+    atomic_ulong seeks;
+    // Seeks which found no keyframe before the frame and went back further
+    atomic_ulong seek_retries;
+    atomic_ulong frames_decoded;
+    // Decoded on the way to a frame, but not cached
+    atomic_ulong frames_discarded;
+    atomic_ulong frames_read_ahead;
+
+    // Per packet
+    struct latency_histogram demux;
+    struct latency_histogram decode;
+    // From the seek until the requested frame is decoded
+    struct latency_histogram seek;
+    // Per image
+    struct latency_histogram scale;
+    struct latency_histogram encode;
+    // From reading a command to answering it
+    struct latency_histogram commands[STATS_COMMANDS];
 };
 
-static int serve_stream(AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec, FILE *pipe, struct file_open_options *opts);
+/*
+ * State of an input
+ *
+ * Commands are read by the session threads and processed by the command thread in order.
+ * The demuxer and the decoder are shared by the command thread and the read-ahead thread,
+ * and protected by `mutex`. The frame cache is also read by the session threads to answer
+ * cached images immediately, so it is protected by `cache_mutex` as well. Only the holder
+ * of `mutex` adds or evicts frames, so the frames it got from the cache stay valid.
+ */
+struct serve_context {
+    AVFormatContext *avf_context;
+    AVStream *stream;
+    AVCodecContext *codec;
+    struct file_open_options *opts;
+
+    struct framecache cache;
+    // Protected by mutex
+    struct seek_policy seek_policy;
+    struct diskcache *disk_cache;
+    struct encode_configs encode_configs[IMAGE_OPTIONS];
+    // Shared with the other inputs in the daemon
+    struct encoder_pool *encoder_pool;
+    struct serve_stats stats;
+
+    // Seek-by-byte only
+    struct frame_index index;
+    long first_pts;
+
+    // The file is being recorded. The follower extends the index until it stops growing.
+    struct index_follower follower;
+    pthread_t follow_thread;
+    int follow_started;
+    // Protected by mutex
+    int following;
+    atomic_int stop_follow;
+
+    // Raw frames (shared memory transport)
+    struct shm_ring shm_ring;
+    struct SwsContext *raw_sws_contexts[4][2];
+
+    pthread_mutex_t cache_mutex;
+
+    // Command queue
+    pthread_t command_thread;
+    pthread_mutex_t queue_mutex;
+    pthread_cond_t queue_cond;
+    struct serve_request *queue_head;
+    struct serve_request *queue_tail;
+    int queue_closed;
+
+    // Read-ahead
+    pthread_t readahead_thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int readahead_frames;
+    long readahead_target;
+    int readahead_eof;
+    // The last requested frame, and whether the frames are being requested backward
+    long last_load_pts;
+    int reverse;
+    // Commands queued or being processed. The read-ahead thread yields to them.
+    atomic_int pending_requests;
+    int quit;
+};
 
 int do_serve(const char *ts_file, const int stream, struct file_open_options *opts) {
-    AVFormatContext *avf_context = NULL;
+    struct encoder_pool encoder_pool;
+    struct serve_context *ctx;
+    struct serve_session session;
     int ret;
 
-    ret = open_file_with_opts(ts_file, &avf_context, opts);
-    if (ret < 0) {
-        fprintf(stderr, "Error: avformat_open_input returned %d\n", ret);
-        return 10;
+    // Encoders and scalers are created by each worker
+    if (init_encoder_pool(&encoder_pool, opts->encoder_threads) != 0) {
+        fprintf(stderr, "Failed to start the encoder workers.\n");
+        return 1;
     }
 
-    ret = avformat_find_stream_info(avf_context, NULL);
-    if (ret < 0) {
-        fprintf(stderr, "Error: avformat_find_stream_info returned %d\n", ret);
-        avformat_close_input(&avf_context);
-        return 11;
+    ret = open_serve_context(&ctx, ts_file, stream, opts, &encoder_pool,
+        opts->cache_size > 0 ? (size_t)opts->cache_size : DEFAULT_CACHE_SIZE);
+    if (ret == 0) {
+        trace_thread_name("session");
+        init_serve_session(&session, stdout, opts->protocol_version >= 2 ? 2 : 1);
+        ret = serve_session(ctx, &session, stdin);
+        destroy_serve_session(&session);
+
+        close_serve_context(ctx);
+        print_pool_stats(stderr);
+    }
+    if (opts->trace_file) {
+        write_trace(opts->trace_file);
+    }
+
+    destroy_encoder_pool(&encoder_pool);
+
+    return ret;
+}
+
+static char *handle_info_command(struct serve_context *ctx);
+static void handle_frame_command(struct serve_context *ctx, struct serve_session *session, const struct nicm_serve_command_v2 *cmd);
+static void handle_image_command(struct serve_context *ctx, struct serve_session *session, const struct nicm_serve_command_v2 *cmd);
+static void handle_image_range_command(struct serve_context *ctx, struct serve_session *session, const struct nicm_serve_command_v2 *cmd);
+static void handle_scene_detect_command(struct serve_context *ctx, struct serve_session *session, const struct nicm_serve_command_v2 *cmd);
+static void handle_stats_command(struct serve_context *ctx, struct serve_session *session, const struct nicm_serve_command_v2 *cmd);
+static void handle_trace_command(struct serve_session *session, const struct nicm_serve_command_v2 *cmd);
+
+int send_response(struct serve_session *session, long id, long code, size_t size, void *data) {
+    int ret = 0;
+
+    pthread_mutex_lock(&session->output_mutex);
+    if (session->protocol >= 2) {
+        struct nicm_serve_response_v2 response;
+
+        response.code = code;
+        response.id = id;
+        response.size = size;
+        if (fwrite(&response, sizeof(struct nicm_serve_response_v2), 1, session->output) != 1) {
+            ret = 1;
+        }
+    } else {
+        struct nicm_serve_response response;
+
+        response.code = code;
+        response.size = size;
+        if (fwrite(&response, sizeof(struct nicm_serve_response), 1, session->output) != 1) {
+            ret = 1;
+        }
     }
+    if (ret == 0 && size > 0) {
+        if (fwrite(data, 1, size, session->output) != size) {
+            ret = 1;
+        }
+    }
+    fflush(session->output);
+    pthread_mutex_unlock(&session->output_mutex);
+
+    return ret;
+}
+
+static int send_response_json(struct serve_session *session, long id, long code, json_t *object) {
+    char *json_str;
+    int ret;
+
+    json_str = json_dumps(object, 0);
+    ret = send_response(session, id, code, strlen(json_str), json_str);
+    free(json_str);
+
+    return ret;
+}
+
+/**
+ * @brief Check the image option and the quality of a request
+ *
+ * @return long 0 if OK, or the response code
+ */
+static long check_image_option(const struct serve_context *ctx, long image_opt, long quality) {
+    if (image_opt < 0 || image_opt >= (long)IMAGE_OPTIONS || quality < 0 || quality > IMAGE_MAX_QUALITY) {
+        return 400;
+    }
+    if (!ctx->encode_configs[image_opt].encoder) {
+        return 501;
+    }
+    return 0;
+}
+
+static struct frame *load_frame(struct serve_context *ctx, long pts);
+static int cache_next_frame(struct serve_context *ctx, long min_pts, long max_pts);
+static void *readahead_worker(void *arg);
+static void *command_worker(void *arg);
+static void *follow_worker(void *arg);
+static void __stop_readahead(struct serve_context *ctx);
+static void __stop_follow(struct serve_context *ctx);
+static int __follow_interrupted(void *opaque);
+static int read_command(struct serve_session *session, FILE *input, struct nicm_serve_command_v2 *cmd);
+static int try_cached_image(struct serve_context *ctx, struct serve_session *session, const struct nicm_serve_command_v2 *cmd, long received);
+
+static int init_encode_configs(struct serve_context *ctx) {
+    struct encode_configs *encode_configs = ctx->encode_configs;
+    AVStream *stream = ctx->stream;
+    int sizes[IMAGE_SIZES][2];
+    unsigned int i;
+
+    sizes[0][0] = stream->codecpar->width;
+    sizes[0][1] = stream->codecpar->height;
+    sizes[1][0] = sizes[0][0] / 2;
+    sizes[1][1] = sizes[0][1] / 2;
+    sizes[2][0] = stream->codecpar->width
+        * stream->codecpar->sample_aspect_ratio.num / stream->codecpar->sample_aspect_ratio.den;
+    sizes[2][1] = stream->codecpar->height;
+    sizes[3][0] = sizes[2][0] / 2;
+    sizes[3][1] = sizes[2][1] / 2;
+
+    for (i = 0; i < IMAGE_OPTIONS; i++) {
+        const struct image_format *format = image_formats + (i >> IMAGE_FORMAT_SHIFT);
+        struct encode_configs *c = encode_configs + i;
+
+        c->width = sizes[i % IMAGE_SIZES][0];
+        c->height = sizes[i % IMAGE_SIZES][1];
+        c->encoder = avcodec_find_encoder(format->codec_id);
+        c->fmt = format->fmt;
+        c->time_base = stream->time_base;
+        c->id = new_encode_configs_id();
+        c->set_quality = format->set_quality;
+        if (!c->encoder && i % IMAGE_SIZES == 0) {
+            fprintf(stderr, "Warning: No encoder for %s images.\n", format->name);
+        }
+
+        if (init_image_pool(&c->image_pool, c->width, c->height, c->fmt) != 0) {
+            fprintf(stderr, "Failed to create the image pool.");
+            return 1;
+        }
+    }
+    if (!encode_configs[0].encoder) {
+        fprintf(stderr, "Failed to find the PNG encoder.");
+        return 1;
+    }
+
+    return 0;
+}
+
+static void destroy_encode_configs(struct serve_context *ctx) {
+    unsigned int i, j;
+
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 2; j++) {
+            sws_freeContext(ctx->raw_sws_contexts[i][j]);
+            ctx->raw_sws_contexts[i][j] = NULL;
+        }
+    }
+
+    for (i = 0; i < IMAGE_OPTIONS; i++) {
+        destroy_image_pool(&ctx->encode_configs[i].image_pool);
+    }
+}
+
+/**
+ * @brief Find the video stream to serve
+ *
+ * @return int 0 on success, or the exit code of nicm serve
+ */
+static int __find_video_stream(AVFormatContext *avf_context, int stream, AVStream **avs) {
+    *avs = NULL;
 
-    AVStream *avs = NULL;
     if (stream >= 0) {
         if ((unsigned int)stream < avf_context->nb_streams) {
-            avs = avf_context->streams[stream];
-            if (avs->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
-                fprintf(stderr, "Error: Stream %d found but not video.\n", ret);
-                avformat_close_input(&avf_context);
+            *avs = avf_context->streams[stream];
+            if ((*avs)->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
+                fprintf(stderr, "Error: Stream %d found but not video.\n", stream);
                 return 12;
             }
             // OK.
         } else {
-            fprintf(stderr, "Error: Stream index %d is out of bound.\n", ret);
-            avformat_close_input(&avf_context);
+            fprintf(stderr, "Error: Stream index %d is out of bound.\n", stream);
             return 13;
         }
     } else { // Find a video stream
@@ -75,298 +404,1020 @@ int do_serve(const char *ts_file, const int stream, struct file_open_options *op
 
         // Choose the first one
         for (i = 0; i < avf_context->nb_streams; i++) {
-            if (!avs &&
+            if (!*avs &&
                 avf_context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
                 avf_context->streams[i]->start_time != AV_NOPTS_VALUE) {
-                avs = avf_context->streams[i];
+                *avs = avf_context->streams[i];
             }
         }
-        if (!avs) {
+        if (!*avs) {
             fprintf(stderr, "Error: No suitable video stream found.\n");
-            avformat_close_input(&avf_context);
             return 14;
         }
     }
-    AVCodecContext *avcc = open_decoder_for_stream(avs);
-    if (!avcc) {
+
+    return 0;
+}
+
+static void __free_serve_context(struct serve_context *ctx) {
+    __stop_follow(ctx);
+    destroy_framecache(&ctx->cache);
+    destroy_encode_configs(ctx);
+    destroy_shm_ring(&ctx->shm_ring);
+
+    release_frame_index(&ctx->index);
+    if (ctx->disk_cache) {
+        destroy_diskcache(ctx->disk_cache);
+        free(ctx->disk_cache);
+    }
+    if (ctx->codec) {
+        avcodec_close(ctx->codec);
+        avcodec_free_context(&ctx->codec);
+    }
+    if (ctx->avf_context) {
+        avformat_close_input(&ctx->avf_context);
+    }
+
+    pthread_cond_destroy(&ctx->queue_cond);
+    pthread_mutex_destroy(&ctx->queue_mutex);
+    pthread_mutex_destroy(&ctx->cache_mutex);
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->mutex);
+
+    free(ctx);
+}
+
+/**
+ * @brief Open the input and start its threads
+ *
+ * @param encoder_pool Images are encoded by the pool, which must outlive the input
+ * @param cache_size Memory budget of the frame cache
+ * @return int 0 on success, or the exit code of nicm serve
+ */
+int open_serve_context(struct serve_context **ctx_ptr, const char *file, int stream, struct file_open_options *opts, struct encoder_pool *encoder_pool, size_t cache_size) {
+    struct file_open_options decoder_opts = *opts;
+    struct serve_context *ctx;
+    AVCodecContext *codec;
+    long delta;
+    int ret;
+
+    *ctx_ptr = NULL;
+
+    ctx = calloc(1, sizeof(struct serve_context));
+    ctx->opts = opts;
+    ctx->encoder_pool = encoder_pool;
+    ctx->shm_ring.fd = -1;
+
+    pthread_mutex_init(&ctx->mutex, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    pthread_mutex_init(&ctx->cache_mutex, NULL);
+    pthread_mutex_init(&ctx->queue_mutex, NULL);
+    pthread_cond_init(&ctx->queue_cond, NULL);
+    atomic_init(&ctx->pending_requests, 0);
+    atomic_init(&ctx->stop_follow, 0);
+
+    // The decoder does not wait long at the end of the file being recorded, as a command is waiting.
+    // The follower waits for the recording.
+    if (decoder_opts.follow_timeout > FOLLOW_READ_TIMEOUT) {
+        decoder_opts.follow_timeout = FOLLOW_READ_TIMEOUT;
+    }
+
+    ret = open_probed_file(file, &ctx->avf_context, &decoder_opts);
+    if (ret < 0) {
+        __free_serve_context(ctx);
+        return 10;
+    }
+
+    if ((ret = __find_video_stream(ctx->avf_context, stream, &ctx->stream)) != 0) {
+        __free_serve_context(ctx);
+        return ret;
+    }
+    ctx->codec = codec = open_decoder_for_stream(ctx->stream, opts, THREAD_TYPE_SLICE);
+    if (!codec) {
         fprintf(stderr, "Stream error: Failed to open the decoder for the stream");
-        avformat_close_input(&avf_context);
+        __free_serve_context(ctx);
         return 15;
     }
 
-    ret = serve_stream(avf_context, avs, avcc, stdout, opts);
+    if (opts->disk_cache_dir) {
+        ctx->disk_cache = malloc(sizeof(struct diskcache));
+        if (init_diskcache(ctx->disk_cache, opts->disk_cache_dir,
+                opts->disk_cache_size > 0 ? (size_t)opts->disk_cache_size : DEFAULT_DISK_CACHE_SIZE, file) != 0) {
+            fprintf(stderr, "Warning: Failed to open the disk cache. Continue without it.\n");
+            destroy_diskcache(ctx->disk_cache);
+            free(ctx->disk_cache);
+            ctx->disk_cache = NULL;
+        }
+    }
 
-    avcodec_close(avcc);
-    avcodec_free_context(&avcc);
-    avformat_close_input(&avf_context);
+    // Calculate delta in time base. delta is 1 / fps [s]
+    delta = ctx->stream->r_frame_rate.den * ctx->stream->time_base.den / ctx->stream->r_frame_rate.num / ctx->stream->time_base.num;
+    fprintf(stderr, "delta: %ld (%ld | %ld)\n", delta, sizeof(int), sizeof(long));
+    fprintf(stderr, "cache size: %lu bytes\n", cache_size);
 
-    return ret;
-}
+    init_framecache(&ctx->cache, MAX_CACHE_FRAMES, cache_size, delta);
+    // The initial preroll is replaced once the keyframe interval is observed
+    init_seek_policy(&ctx->seek_policy, delta, INITIAL_SEEK_THRESHOLD,
+        codec->codec_id == AV_CODEC_ID_MPEG2VIDEO ? 40 : codec->codec_id == AV_CODEC_ID_H264 ? 40 : 30
+    );
 
-static char *handle_info_command(AVStream *stream, long first_pts);
+    ctx->first_pts = AV_NOPTS_VALUE;
+    if (cache_next_frame(ctx, AV_NOPTS_VALUE, AV_NOPTS_VALUE) == 0) {
+        ctx->first_pts = ctx->cache.pts_last;
+    }
+    cache_next_frame(ctx, AV_NOPTS_VALUE, AV_NOPTS_VALUE);
 
-static int send_response(FILE *output, long code, size_t size, void *data) {
-    struct nicm_serve_response response;
+    if (ctx->cache.pts_last - ctx->first_pts != delta) {
+        fprintf(stderr, "*The interval between the first two frames is not delta (expecting %ld, but got %ld)\n",
+                delta, ctx->cache.pts_last - ctx->first_pts);
+    }
 
-    response.code = code;
-    response.size = size;
-    if (fwrite(&response, sizeof(struct nicm_serve_response), 1, output) != 1) {
+    // Transform Initialization
+    if (init_encode_configs(ctx) != 0) {
+        __free_serve_context(ctx);
         return 1;
     }
-    if (size > 0) {
-        if (fwrite(data, 1, size, output) != size) {
+
+    if (opts->shm_slots > 0) {
+        size_t slot_size = 0;
+        int i;
+
+        for (i = 0; i < 4; i++) {
+            size_t size = av_image_get_buffer_size(AV_PIX_FMT_RGBA, ctx->encode_configs[i].width, ctx->encode_configs[i].height, 1);
+            if (size > slot_size) {
+                slot_size = size;
+            }
+        }
+        if (init_shm_ring(&ctx->shm_ring, opts->shm_slots, slot_size) != 0) {
+            fprintf(stderr, "Warning: Failed to create the shared memory. Raw frames are not available.\n");
+        }
+    }
+
+    if (opts->follow_timeout > 0) {
+        // Until the follower has indexed a frame, it is found by PTS
+        AVIOInterruptCB interrupt = { .callback = __follow_interrupted, .opaque = ctx };
+
+        if (open_index_follower(&ctx->follower, file, ctx->stream->index, opts, &interrupt) != 0 ||
+            pthread_create(&ctx->follow_thread, NULL, follow_worker, ctx) != 0) {
+            fprintf(stderr, "Failed to follow the file.\n");
+            __free_serve_context(ctx);
+            return 1;
+        }
+        ctx->follow_started = 1;
+        ctx->following = 1;
+    } else if (opts->seek_by_byte) {
+        if (load_frame_index(&ctx->index, file, ctx->avf_context, ctx->stream, codec, opts) != 0) {
+            fprintf(stderr, "Failed to create indices.\n");
+            __free_serve_context(ctx);
             return 1;
         }
     }
-    fflush(output);
+
+    // Read-ahead
+    ctx->readahead_frames = opts->readahead_frames == 0 ? DEFAULT_READAHEAD_FRAMES : opts->readahead_frames;
+    ctx->readahead_target = AV_NOPTS_VALUE;
+    ctx->readahead_eof = 0;
+    ctx->last_load_pts = AV_NOPTS_VALUE;
+    ctx->reverse = 0;
+    ctx->quit = 0;
+
+    if (ctx->readahead_frames > 0) {
+        if (pthread_create(&ctx->readahead_thread, NULL, readahead_worker, ctx) != 0) {
+            fprintf(stderr, "Warning: Failed to start the read-ahead thread. Continue without it.\n");
+            ctx->readahead_frames = 0;
+        }
+    }
+
+    if (pthread_create(&ctx->command_thread, NULL, command_worker, ctx) != 0) {
+        fprintf(stderr, "Failed to start the command thread.\n");
+        __stop_readahead(ctx);
+        __free_serve_context(ctx);
+        return 1;
+    }
+
+    *ctx_ptr = ctx;
 
     return 0;
 }
 
-static int send_response_json(FILE *output, long code, json_t *object) {
-    char *json_str;
-    int ret;
+static void __stop_readahead(struct serve_context *ctx) {
+    if (ctx->readahead_frames > 0) {
+        pthread_mutex_lock(&ctx->mutex);
+        ctx->quit = 1;
+        pthread_cond_signal(&ctx->cond);
+        pthread_mutex_unlock(&ctx->mutex);
 
-    json_str = json_dumps(object, 0);
-    ret = send_response(output, code, strlen(json_str), json_str);
-    free(json_str);
+        pthread_join(ctx->readahead_thread, NULL);
+    }
+}
 
-    return ret;
+static int __follow_interrupted(void *opaque) {
+    struct serve_context *ctx = opaque;
+
+    return atomic_load(&ctx->stop_follow);
 }
 
-static struct frame *load_frame(struct framecache *cache, AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec, long pts, struct video_stream_frame_index *indices, int frames_in_indices);
-static int cache_next_frame(struct framecache *cache, AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec, long min_pts, long max_pts);
+static void __stop_follow(struct serve_context *ctx) {
+    if (ctx->follow_started) {
+        atomic_store(&ctx->stop_follow, 1);
+        pthread_join(ctx->follow_thread, NULL);
+        ctx->follow_started = 0;
+    }
+    close_index_follower(&ctx->follower);
+}
 
-#define DEFAULT_ARRAY_SIZE 120
-#define SEEK_THRESHOLD 30
+/**
+ * @brief Extend the index as the file grows, a GOP at a time
+ *
+ * When the file stops growing, the recording is over. The index is complete and saved to the sidecar.
+ */
+static void *follow_worker(void *arg) {
+    struct serve_context *ctx = arg;
+    const struct video_stream_frame_index *entries;
+    int num, ret;
+
+    trace_thread_name("follow");
+    do {
+        ret = follow_next_gop(&ctx->follower, &entries, &num);
+        if (num > 0) {
+            pthread_mutex_lock(&ctx->mutex);
+            append_frame_index(&ctx->index, entries, num);
+            // There are more frames to read ahead
+            ctx->readahead_eof = 0;
+            pthread_cond_signal(&ctx->cond);
+            pthread_mutex_unlock(&ctx->mutex);
+            TRACE_COUNTER(TRACE_LEVEL_DEBUG, "indexed_frames", ctx->index.num_entries);
+        }
+    } while (ret > 0);
 
-struct encode_configs {
-    int width;
-    int height;
-    const AVCodec *encoder;
-    AVCodecContext *encoder_context;
-    struct SwsContext* sws_context;
-    enum AVPixelFormat fmt;
-};
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->following = 0;
+    pthread_mutex_unlock(&ctx->mutex);
 
-static int serve_stream(AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec, FILE *pipe, struct file_open_options *opts) {
-    struct nicm_serve_command cmd;
-    struct framecache cache;
-    long first_pts;
-    long delta;
+    if (ret == 0) {
+        fprintf(stderr, "[follow] The file stopped growing. %d frames indexed.\n", ctx->index.num_entries);
+        if (save_frame_index(&ctx->index, ctx->follower.file, ctx->stream->index) != 0) {
+            fprintf(stderr, "[follow] Warning: Failed to save the index.\n");
+        }
+    }
 
-    struct encode_configs encode_configs[8];
-    const AVCodec *png_codec, *jpeg_codec;
+    return NULL;
+}
 
-    struct video_stream_frame_index *indices = NULL;
-    int frames_in_indices = 0;
+/**
+ * @brief Finish the queued commands and close the input. No session may use it any more.
+ */
+void close_serve_context(struct serve_context *ctx) {
+    pthread_mutex_lock(&ctx->queue_mutex);
+    ctx->queue_closed = 1;
+    pthread_cond_signal(&ctx->queue_cond);
+    pthread_mutex_unlock(&ctx->queue_mutex);
 
-    // Initialization
+    pthread_join(ctx->command_thread, NULL);
+    __stop_readahead(ctx);
 
-    // Calculate delta in time base. delta is 1 / fps [s]
-    delta = stream->r_frame_rate.den * stream->time_base.den / stream->r_frame_rate.num / stream->time_base.num;
-    fprintf(stderr, "delta: %ld (%ld | %ld)\n", delta, sizeof(int), sizeof(long));
+    __free_serve_context(ctx);
+}
 
-    init_framecache(&cache, DEFAULT_ARRAY_SIZE, delta, SEEK_THRESHOLD,
-        codec->codec_id == AV_CODEC_ID_MPEG2VIDEO ? 40 : codec->codec_id == AV_CODEC_ID_H264 ? 40 : 30
-    );
+/**
+ * @brief Change the memory budget of the frame cache
+ *
+ * Frames over the budget are evicted when the running command finishes.
+ */
+void resize_serve_cache(struct serve_context *ctx, size_t cache_size) {
+    pthread_mutex_lock(&ctx->mutex);
+    pthread_mutex_lock(&ctx->cache_mutex);
+    resize_framecache(&ctx->cache, cache_size);
+    pthread_mutex_unlock(&ctx->cache_mutex);
+    pthread_mutex_unlock(&ctx->mutex);
+}
 
-    if (cache_next_frame(&cache, avf_context, stream, codec, AV_NOPTS_VALUE, AV_NOPTS_VALUE) == 0) {
-        first_pts = cache.pts_range_start;
-    }
-    cache_next_frame(&cache, avf_context, stream, codec, AV_NOPTS_VALUE, AV_NOPTS_VALUE);
+void init_serve_session(struct serve_session *session, FILE *output, int protocol) {
+    session->output = output;
+    session->protocol = protocol;
+    session->pending = 0;
+    pthread_mutex_init(&session->output_mutex, NULL);
+    pthread_cond_init(&session->pending_cond, NULL);
+}
 
-    if (cache.pts_range_end - cache.pts_range_start != delta) {
-        fprintf(stderr, "*The interval between the first two frames is not delta (expecting %ld, but got %ld)\n",
-                delta, cache.pts_range_end - cache.pts_range_start);
-    }
+void destroy_serve_session(struct serve_session *session) {
+    pthread_cond_destroy(&session->pending_cond);
+    pthread_mutex_destroy(&session->output_mutex);
+}
 
-    // Transform Initialization
-    encode_configs[0].width = encode_configs[4].width = stream->codecpar->width;
-    encode_configs[0].height = encode_configs[4].height = stream->codecpar->height;
-    encode_configs[1].width = encode_configs[5].width = encode_configs[0].width / 2;
-    encode_configs[1].height = encode_configs[5].height = encode_configs[0].height / 2;
-    encode_configs[2].width = encode_configs[6].width = stream->codecpar->width
-        * stream->codecpar->sample_aspect_ratio.num / stream->codecpar->sample_aspect_ratio.den;
-    encode_configs[2].height = encode_configs[6].height = stream->codecpar->height;
-    encode_configs[3].width = encode_configs[7].width = encode_configs[2].width / 2;
-    encode_configs[3].height = encode_configs[7].height = encode_configs[2].height / 2;
+/**
+ * @brief Read the commands of the session until QUIT or the end of the input
+ *
+ * It returns after all the commands of the session are answered, so the caller can close the output.
+ */
+int serve_session(struct serve_context *ctx, struct serve_session *session, FILE *input) {
+    struct nicm_serve_command_v2 cmd;
 
-    png_codec = avcodec_find_encoder(AV_CODEC_ID_PNG);
-    jpeg_codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    fprintf(stderr, "Protocol version %d\n", session->protocol);
+    while (read_command(session, input, &cmd) == 0) {
+        long received = now_us();
 
-    int i;
-    for (i = 0; i < 4; i++) {
-        encode_configs[i].encoder = png_codec;
-        encode_configs[i].fmt = AV_PIX_FMT_RGB24;
-        encode_configs[i + 4].encoder = jpeg_codec;
-        encode_configs[i + 4].fmt = AV_PIX_FMT_YUVJ420P;
+        TRACE_INSTANT(TRACE_LEVEL_DEBUG, "read_command", "command,id", cmd.command, cmd.id);
+
+        if (session->protocol >= 2) {
+            // Statistics and traces are scraped while a long command is in progress
+            if (cmd.command == NICM_SERVE_COMMAND_STATS) {
+                handle_stats_command(ctx, session, &cmd);
+                continue;
+            }
+            if (cmd.command == NICM_SERVE_COMMAND_TRACE) {
+                handle_trace_command(session, &cmd);
+                continue;
+            }
+            if (try_cached_image(ctx, session, &cmd, received) == 0) {
+                continue;
+            }
+        }
+
+        struct serve_request *request = malloc(sizeof(struct serve_request));
+        request->cmd = cmd;
+        request->session = session;
+        request->received = received;
+        request->next = NULL;
+
+        pthread_mutex_lock(&session->output_mutex);
+        session->pending++;
+        pthread_mutex_unlock(&session->output_mutex);
+
+        atomic_fetch_add(&ctx->pending_requests, 1);
+        pthread_mutex_lock(&ctx->queue_mutex);
+        if (ctx->queue_tail) {
+            ctx->queue_tail->next = request;
+        } else {
+            ctx->queue_head = request;
+        }
+        ctx->queue_tail = request;
+        pthread_cond_signal(&ctx->queue_cond);
+        pthread_mutex_unlock(&ctx->queue_mutex);
+
+        if (cmd.command == NICM_SERVE_COMMAND_QUIT) {
+            break;
+        }
     }
-    for (i = 0; i < 8; i++) {
-        struct encode_configs *c = encode_configs + i;
 
-        c->encoder_context = avcodec_alloc_context3(c->encoder);
-        c->encoder_context->time_base = stream->time_base;
-        c->encoder_context->pix_fmt = c->fmt;
-        c->encoder_context->width = c->width;
-        c->encoder_context->height = c->height;
+    // Wait for the command thread to answer the queued commands
+    pthread_mutex_lock(&session->output_mutex);
+    while (session->pending > 0) {
+        pthread_cond_wait(&session->pending_cond, &session->output_mutex);
+    }
+    pthread_mutex_unlock(&session->output_mutex);
+
+    return 0;
+}
+
+/**
+ * @brief Read a command in the layout of the protocol version 2
+ *
+ * @return int 0 on success, non-zero at the end of the input
+ */
+static int read_command(struct serve_session *session, FILE *input, struct nicm_serve_command_v2 *cmd) {
+    if (session->protocol >= 2) {
+        return fread(cmd, sizeof(struct nicm_serve_command_v2), 1, input) == 1 ? 0 : 1;
+    } else {
+        struct nicm_serve_command cmd_v1;
 
-        if (avcodec_open2(c->encoder_context, c->encoder, NULL) != 0) {
-            fprintf(stderr, "Failed to open encoder.");
+        if (fread(&cmd_v1, sizeof(struct nicm_serve_command), 1, input) != 1) {
             return 1;
         }
+        cmd->command = cmd_v1.command;
+        cmd->id = 0;
+        memcpy(cmd->args, cmd_v1.args, sizeof(cmd->args));
 
-        c->sws_context = sws_getContext(stream->codecpar->width, stream->codecpar->height, stream->codecpar->format,
-            encode_configs[i].width, encode_configs[i].height, c->fmt, SWS_BILINEAR, NULL, NULL, NULL);
+        return 0;
     }
+}
 
-    if (opts->seek_by_byte) {
-        // Create index
-        fprintf(stderr, "Seek-by-byte option is set. Creating indices...\n");
-        indices = build_index_stream(avf_context, stream, codec, &frames_in_indices);
-        if (!indices) {
-            fprintf(stderr, "Failed to create indices.\n");
-            return 1;
+/**
+ * @brief Answer an IMAGE command without waiting for the command thread if the image is already encoded
+ *
+ * @return int 0 if answered, non-zero if the command should be queued
+ */
+static int try_cached_image(struct serve_context *ctx, struct serve_session *session, const struct nicm_serve_command_v2 *cmd, long received) {
+    struct diskcache_entry entry;
+    AVPacket *packet = NULL;
+    long pts = cmd->args[0];
+    int image_opt = cmd->args[2], quality = cmd->args[3];
+    int slot;
+
+    if (cmd->command != NICM_SERVE_COMMAND_IMAGE || check_image_option(ctx, cmd->args[2], cmd->args[3]) != 0) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&ctx->cache_mutex);
+    slot = find_in_framecache(&ctx->cache, pts);
+    if (slot >= 0 && ctx->cache.frames[slot].encoded[image_opt] && ctx->cache.frames[slot].encoded_variant[image_opt] == quality) {
+        // Take a reference so that the command thread can evict the frame meanwhile
+        packet = pool_get_packet();
+        if (av_packet_ref(packet, ctx->cache.frames[slot].encoded[image_opt]) != 0) {
+            pool_put_packet(&packet);
         }
-        fprintf(stderr, "Indices created. Frames = %d\n", frames_in_indices);
+    }
+    pthread_mutex_unlock(&ctx->cache_mutex);
+
+    if (packet) {
+        counter_add(&ctx->stats.image_hits, 1);
+        send_response(session, cmd->id, 0, packet->size, packet->data);
+        pool_put_packet(&packet);
+        latency_record(ctx->stats.commands + STATS_IMAGE_CACHED, now_us() - received);
+        return 0;
+    }
+    if (ctx->disk_cache && find_in_diskcache(ctx->disk_cache, ctx->stream->index, pts, IMAGE_CACHE_KEY(image_opt, quality), &entry) == 0) {
+        counter_add(&ctx->stats.disk_hits, 1);
+        send_response(session, cmd->id, 0, entry.size, (void *)entry.data);
+        release_diskcache_entry(&entry);
+        latency_record(ctx->stats.commands + STATS_IMAGE_CACHED, now_us() - received);
+        return 0;
     }
 
-    // Receive Loop
-    while (fread(&cmd, sizeof(struct nicm_serve_command), 1, stdin) == 1) {
-        fprintf(stderr, "[Command] command = %ld (%ld, %ld, %ld)\n", cmd.command, cmd.args[0], cmd.args[1], cmd.args[2]);
-        if (cmd.command == NICM_SERVE_COMMAND_QUIT) {
-            fprintf(stderr, "[Quit] Quitting the server...");
-            send_response(pipe, 0, 0, NULL);
+    return 1;
+}
+
+/**
+ * @brief Name of the command in the trace
+ */
+static const char *__command_name(long command) {
+    switch (command) {
+        case NICM_SERVE_COMMAND_QUIT:
+            return "quit";
+        case NICM_SERVE_COMMAND_INFO:
+            return "info";
+        case NICM_SERVE_COMMAND_IMAGE:
+            return "image";
+        case NICM_SERVE_COMMAND_IMAGE_RANGE:
+            return "image_range";
+        case NICM_SERVE_COMMAND_FRAME:
+            return "frame";
+        case NICM_SERVE_COMMAND_STATS:
+            return "stats";
+        case NICM_SERVE_COMMAND_TRACE:
+            return "trace";
+        case NICM_SERVE_COMMAND_SCENE_DETECT:
+            return "scene_detect";
+        default:
+            return "unknown";
+    }
+}
+
+static void *command_worker(void *arg) {
+    struct serve_context *ctx = arg;
+
+    trace_thread_name("command");
+    for (;;) {
+        struct serve_request *request;
+
+        pthread_mutex_lock(&ctx->queue_mutex);
+        while (!ctx->queue_head && !ctx->queue_closed) {
+            pthread_cond_wait(&ctx->queue_cond, &ctx->queue_mutex);
+        }
+        request = ctx->queue_head;
+        if (request) {
+            ctx->queue_head = request->next;
+            if (!ctx->queue_head) {
+                ctx->queue_tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&ctx->queue_mutex);
 
+        if (!request) {
             break;
-        } else if (cmd.command == NICM_SERVE_COMMAND_INFO) {
-            char *result = handle_info_command(stream, first_pts);
+        }
+
+        struct nicm_serve_command_v2 *cmd = &request->cmd;
+        struct serve_session *session = request->session;
+        int stats_command = -1;
+
+        pthread_mutex_lock(&ctx->mutex);
+        long traced = TRACE_START(TRACE_LEVEL_INFO);
+
+        if (cmd->command == NICM_SERVE_COMMAND_QUIT) {
+            // The session ends. The input is closed by the owner.
+            fprintf(stderr, "[Quit] Closing the session...\n");
+            send_response(session, cmd->id, 0, 0, NULL);
+        } else if (cmd->command == NICM_SERVE_COMMAND_INFO) {
+            char *result = handle_info_command(ctx);
             if (result) {
-                send_response(pipe, 0, strlen(result), result);
+                send_response(session, cmd->id, 0, strlen(result), result);
                 free(result);
             } else {
-                send_response(pipe, 500, 0, NULL);
+                send_response(session, cmd->id, 500, 0, NULL);
             }
-        } else if (cmd.command == NICM_SERVE_COMMAND_IMAGE) {
-            if (cmd.args[2] < 0 || cmd.args[2] >= 8) {
-                send_response(pipe, 400, 0, NULL);
+        } else if (cmd->command == NICM_SERVE_COMMAND_IMAGE) {
+            handle_image_command(ctx, session, cmd);
+            stats_command = STATS_IMAGE;
+        } else if (cmd->command == NICM_SERVE_COMMAND_IMAGE_RANGE) {
+            handle_image_range_command(ctx, session, cmd);
+            stats_command = STATS_IMAGE_RANGE;
+        } else if (cmd->command == NICM_SERVE_COMMAND_FRAME) {
+            handle_frame_command(ctx, session, cmd);
+            stats_command = STATS_FRAME;
+        } else if (cmd->command == NICM_SERVE_COMMAND_SCENE_DETECT) {
+            handle_scene_detect_command(ctx, session, cmd);
+            stats_command = STATS_SCENE_DETECT;
+        } else if (cmd->command == NICM_SERVE_COMMAND_STATS) {
+            handle_stats_command(ctx, session, cmd);
+        } else if (cmd->command == NICM_SERVE_COMMAND_TRACE) {
+            handle_trace_command(session, cmd);
+        } else {
+            send_response(session, cmd->id, 400, 0, NULL);
+        }
+
+        TRACE_SPAN(TRACE_LEVEL_INFO, traced, __command_name(cmd->command), "pts,id", cmd->args[0], cmd->id);
+
+        // The request may have moved the demuxer, so the end of the stream may not be reached any more
+        ctx->readahead_eof = 0;
+        atomic_fetch_sub(&ctx->pending_requests, 1);
+        pthread_cond_signal(&ctx->cond);
+        pthread_mutex_unlock(&ctx->mutex);
+
+        if (stats_command >= 0) {
+            latency_record(ctx->stats.commands + stats_command, now_us() - request->received);
+        }
+        free(request);
+
+        // The session may be gone right after this
+        pthread_mutex_lock(&session->output_mutex);
+        session->pending--;
+        pthread_cond_broadcast(&session->pending_cond);
+        pthread_mutex_unlock(&session->output_mutex);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Frames that fit in half of the cache budget, estimated from the frames in the cache
+ */
+static long __half_budget_frames(const struct framecache *cache) {
+    long frames = cache->num_allocated_frames / 2;
+
+    if (cache->num_frames > 0) {
+        long budget_frames = cache->max_bytes / 2 / (cache->bytes / cache->num_frames + 1);
+
+        if (frames > budget_frames) {
+            frames = budget_frames;
+        }
+    }
+
+    return frames;
+}
+
+/**
+ * @brief PTS of the keyframe which the frame at or before the PTS follows in the index
+ *
+ * A reverse window starting there covers whole GOPs, so the next window does not decode them again.
+ */
+static long __keyframe_pts_before(const struct frame_index *index, long pts) {
+    struct video_stream_frame_index *entry;
+
+    if (pts <= (long)index->entries[0].pts) {
+        return pts;
+    }
+    entry = nearest_earlier_index(index->entries, index->num_entries, pts);
+    while (entry > index->entries && !(entry->flags & FRAME_INDEX_FLAG_KEY)) {
+        entry--;
+    }
+
+    return entry->pts;
+}
+
+/**
+ * @brief Whether the read-ahead thread should decode the next frame
+ *
+ * It reads ahead only when the decoder is around the last requested PTS.
+ * If the decoder is somewhere else, the next request will seek anyway.
+ * Frames read ahead may take at most half of the cache budget so that they do not
+ * evict the frames being viewed. Nothing is read ahead while the frames are requested backward.
+ */
+static int __should_read_ahead(const struct serve_context *ctx) {
+    const struct framecache *cache = &ctx->cache;
+    long ahead = ctx->readahead_frames;
+
+    if (ctx->readahead_eof || ctx->reverse || ctx->readahead_target == AV_NOPTS_VALUE || cache->pts_last == AV_NOPTS_VALUE) {
+        return 0;
+    }
+    // Do not wait for the recording at the end of the file, holding the lock
+    if (ctx->following && (ctx->index.num_entries == 0 || cache->pts_last >= (long)ctx->index.entries[ctx->index.num_entries - 1].pts)) {
+        return 0;
+    }
+
+    if (ahead > __half_budget_frames(cache)) {
+        ahead = __half_budget_frames(cache);
+    }
+
+    if (cache->pts_last < ctx->readahead_target - cache->delta * seek_policy_forward_limit(&ctx->seek_policy)) {
+        return 0;
+    }
+    return cache->pts_last < ctx->readahead_target + cache->delta * ahead;
+}
+
+static void *readahead_worker(void *arg) {
+    struct serve_context *ctx = arg;
+
+    trace_thread_name("read-ahead");
+    pthread_mutex_lock(&ctx->mutex);
+    while (!ctx->quit) {
+        if (atomic_load(&ctx->pending_requests) == 0 && __should_read_ahead(ctx)) {
+            if (cache_next_frame(ctx, AV_NOPTS_VALUE, AV_NOPTS_VALUE) != 0) {
+                ctx->readahead_eof = 1;
             } else {
-                struct frame *frame = load_frame(&cache, avf_context, stream, codec, cmd.args[0], indices, frames_in_indices);
-                if (frame == NULL) {
-                    fprintf(stderr, "[Image command] No frame for %ld\n", cmd.args[0]);
-                    send_response(pipe, 404, 0, NULL);
-                } else {
-                    int imageOpt = cmd.args[2];
-                    if (!frame->encoded[imageOpt]) {
-                        AVFrame *new_frame = av_frame_alloc();
-                        int ret;
-                        struct encode_configs *c = encode_configs + imageOpt;
-
-                        av_image_alloc(new_frame->data, new_frame->linesize, c->width, c->height, c->fmt, 16);
-                        sws_scale(c->sws_context, (const uint8_t * const *)frame->avf->data, frame->avf->linesize, 0, frame->avf->height, new_frame->data, new_frame->linesize);
-                        new_frame->width = c->width;
-                        new_frame->height = c->height;
-                        new_frame->format = c->fmt;
-
-                        if ((ret = avcodec_send_frame(c->encoder_context, new_frame)) != 0) {
-                            fprintf(stderr, "avcodec_send_frame failed: %d\n", ret);
-                            av_freep(&new_frame->data[0]);
-                            av_frame_free(&new_frame);
-                            send_response(pipe, 500, 0, NULL);
-                            continue;
-                        }
-
-                        AVPacket *packet = av_packet_alloc();
-                        if ((ret = avcodec_receive_packet(c->encoder_context, packet)) != 0) {
-                            fprintf(stderr, "avcodec_receive_packet failed: %d\n", ret);
-                            av_freep(&new_frame->data[0]);
-                            av_frame_free(&new_frame);
-                            send_response(pipe, 500, 0, NULL);
-                            continue;
-                        }
-
-                        frame->encoded[imageOpt] = packet;
-
-                        av_freep(&new_frame->data[0]);
-                        av_frame_free(&new_frame);
-                    }
-                    send_response(pipe, 0, frame->encoded[imageOpt]->size, frame->encoded[imageOpt]->data);
-                }
-            }
-        } else if (cmd.command == NICM_SERVE_COMMAND_SCENE_DETECT) {
-            int backward = (cmd.args[1] & 1) == 1;
-            int max_frame = SCENE_DETECT_DEFAULT_FRAMES;
-            int cut_off = MAX_SCENE_CHANGE_SCORE;
-            long pts = cmd.args[0];
-            int f;
-            struct frame *frame = load_frame(&cache, avf_context, stream, codec, pts, indices, frames_in_indices);
-            struct scene_detect_context sd;
-
-            if (frame == NULL) {
-                fprintf(stderr, "[Scene command] No frame for %ld\n", pts);
-                send_response(pipe, 404, 0, NULL);
+                counter_add(&ctx->stats.frames_read_ahead, 1);
             }
+            // Decode one frame at a time so that a command does not wait long for the lock
+            pthread_mutex_unlock(&ctx->mutex);
+            pthread_mutex_lock(&ctx->mutex);
+        } else {
+            pthread_cond_wait(&ctx->cond, &ctx->mutex);
+        }
+    }
+    pthread_mutex_unlock(&ctx->mutex);
 
-            if (cmd.args[2] > 0) {
-                if (cmd.args[2] > SCENE_DETECT_MAX_FRAMES) {
-                    max_frame = SCENE_DETECT_MAX_FRAMES;
-                } else {
-                    max_frame = (int)cmd.args[2];
-                }
-            }
+    return NULL;
+}
 
-            if (cmd.args[3] > 0 && cmd.args[3] < MAX_SCENE_CHANGE_SCORE) {
-                cut_off = cmd.args[3];
-            }
+struct encoded_image {
+    long pts;
+    const uint8_t *data;
+    size_t size;
+    // Reference of the image, or the mapping of the disk cache if the image came from there
+    AVPacket *packet;
+    struct diskcache_entry entry;
+    // Encoding in progress
+    AVFrame *frame;
+    struct encode_job job;
+};
 
-            json_t *result = json_object();
-            json_t *array = json_array();
-            init_scene_detect_context(&sd, frame);
+/**
+ * @brief Find the encoded image of the frame at the PTS, or start encoding it
+ *
+ * Call finish_encoded_image() to get the image. The encoder workers do not touch the cache,
+ * so several images can be started before finishing them.
+ *
+ * @return long Response code (0: OK, 404: no frame)
+ */
+static long start_encoded_image(struct serve_context *ctx, long pts, int image_opt, int quality, struct encoded_image *image) {
+    int slot;
 
-            for (f = 1; f <= max_frame; f++) {
-                struct frame *new_frame = load_frame(&cache, avf_context, stream, codec,
-                    backward ? pts - f * cache.delta : pts + f * cache.delta,
-                    indices, frames_in_indices
-                );
+    memset(image, 0, sizeof(*image));
 
-                if (new_frame == NULL) {
-                    break;
-                }
+    pthread_mutex_lock(&ctx->cache_mutex);
+    slot = find_in_framecache(&ctx->cache, pts);
+    if (slot >= 0 && ctx->cache.frames[slot].encoded[image_opt] && ctx->cache.frames[slot].encoded_variant[image_opt] == quality) {
+        image->packet = pool_get_packet();
+        av_packet_ref(image->packet, ctx->cache.frames[slot].encoded[image_opt]);
+    }
+    pthread_mutex_unlock(&ctx->cache_mutex);
+
+    if (image->packet) {
+        counter_add(&ctx->stats.image_hits, 1);
+        image->pts = pts;
+        image->data = image->packet->data;
+        image->size = image->packet->size;
+        return 0;
+    }
+    if (ctx->disk_cache &&
+        find_in_diskcache(ctx->disk_cache, ctx->stream->index, pts, IMAGE_CACHE_KEY(image_opt, quality), &image->entry) == 0) {
+        // Encoded in a previous run. No need to seek.
+        counter_add(&ctx->stats.disk_hits, 1);
+        image->pts = pts;
+        image->data = image->entry.data;
+        image->size = image->entry.size;
+        return 0;
+    }
+
+    struct frame *frame = load_frame(ctx, pts);
+    if (frame == NULL) {
+        return 404;
+    }
+    image->pts = frame->pts;
+
+    if (frame->encoded[image_opt] && frame->encoded_variant[image_opt] == quality) {
+        // The nearest frame has the image
+        counter_add(&ctx->stats.image_hits, 1);
+        image->packet = pool_get_packet();
+        av_packet_ref(image->packet, frame->encoded[image_opt]);
+        image->data = image->packet->data;
+        image->size = image->packet->size;
+        return 0;
+    }
+
+    // The frame may be evicted while encoding, so hand a reference to the worker
+    image->frame = pool_get_frame();
+    av_frame_ref(image->frame, frame->avf);
+    image->job.frame = image->frame;
+    image->job.config = ctx->encode_configs + image_opt;
+    image->job.quality = quality;
+    encoder_pool_submit(ctx->encoder_pool, &image->job);
+
+    return 0;
+}
+
+/**
+ * @brief Wait for the image and put it in the caches
+ *
+ * @return long Response code (0: OK, 500: encoder error)
+ */
+static long finish_encoded_image(struct serve_context *ctx, int image_opt, int quality, struct encoded_image *image) {
+    int slot;
+
+    if (!image->frame) {
+        return 0;
+    }
+
+    encoder_pool_wait(ctx->encoder_pool, &image->job);
+    pool_put_frame(&image->frame);
+    if (image->job.status != 0) {
+        return 500;
+    }
+    counter_add(&ctx->stats.images_encoded, 1);
+    latency_record(&ctx->stats.scale, image->job.scale_us);
+    latency_record(&ctx->stats.encode, image->job.encode_us);
+
+    image->packet = image->job.packet;
+    image->job.packet = NULL;
+    image->data = image->packet->data;
+    image->size = image->packet->size;
+
+    pthread_mutex_lock(&ctx->cache_mutex);
+    slot = find_in_framecache(&ctx->cache, image->pts);
+    if (slot >= 0 && (!ctx->cache.frames[slot].encoded[image_opt] || ctx->cache.frames[slot].encoded_variant[image_opt] != quality)) {
+        AVPacket *packet = pool_get_packet();
+
+        av_packet_ref(packet, image->packet);
+        add_encoded_framecache(&ctx->cache, ctx->cache.frames + slot, image_opt, quality, packet);
+    }
+    pthread_mutex_unlock(&ctx->cache_mutex);
+
+    if (ctx->disk_cache) {
+        add_diskcache(ctx->disk_cache, ctx->stream->index, image->pts, IMAGE_CACHE_KEY(image_opt, quality), image->data, image->size);
+    }
+
+    return 0;
+}
+
+static void release_encoded_image(struct serve_context *ctx, struct encoded_image *image) {
+    if (image->frame) {
+        // Abandoned while encoding
+        encoder_pool_wait(ctx->encoder_pool, &image->job);
+        pool_put_frame(&image->frame);
+    }
+    if (image->job.packet) {
+        pool_put_packet(&image->job.packet);
+    }
+    if (image->packet) {
+        pool_put_packet(&image->packet);
+    }
+    release_diskcache_entry(&image->entry);
+}
+
+/**
+ * @brief Get the encoded image of the frame at the PTS, encoding it if needed
+ *
+ * Release the image with release_encoded_image().
+ *
+ * @return long Response code (0: OK, 404: no frame, 500: encoder error)
+ */
+static long get_encoded_image(struct serve_context *ctx, long pts, int image_opt, int quality, struct encoded_image *image) {
+    long code = start_encoded_image(ctx, pts, image_opt, quality, image);
+
+    if (code == 0) {
+        code = finish_encoded_image(ctx, image_opt, quality, image);
+    }
+
+    return code;
+}
+
+static void handle_image_command(struct serve_context *ctx, struct serve_session *session, const struct nicm_serve_command_v2 *cmd) {
+    struct encoded_image image;
+    long pts = cmd->args[0];
+    long code;
+
+    if ((code = check_image_option(ctx, cmd->args[2], cmd->args[3])) != 0) {
+        send_response(session, cmd->id, code, 0, NULL);
+        return;
+    }
+
+    ctx->readahead_target = pts;
+
+    code = get_encoded_image(ctx, pts, cmd->args[2], cmd->args[3], &image);
+    if (code == 0) {
+        send_response(session, cmd->id, 0, image.size, (void *)image.data);
+    } else {
+        if (code == 404) {
+            fprintf(stderr, "[Image command] No frame for %ld\n", pts);
+        }
+        send_response(session, cmd->id, code, 0, NULL);
+    }
+    release_encoded_image(ctx, &image);
+}
+
+static void handle_image_range_command(struct serve_context *ctx, struct serve_session *session, const struct nicm_serve_command_v2 *cmd) {
+    long start = cmd->args[0], count = cmd->args[1], stride = cmd->args[3], end = cmd->args[4];
+    int image_opt = cmd->args[2], quality = cmd->args[5];
+    struct encoded_image *images;
+    char *buffer = NULL;
+    size_t buffer_size = 0, written = 0;
+    FILE *fp;
+    long i, j, window, started, sent = 0, code = 0;
+    int full = 0;
+
+    if ((code = check_image_option(ctx, cmd->args[2], cmd->args[5])) != 0) {
+        send_response(session, cmd->id, code, 0, NULL);
+        return;
+    }
+    if (stride == 0) {
+        stride = 1;
+    }
+    // A negative stride goes backward, so the end is before the start
+    if (count < 0 || (count == 0 && (stride > 0 ? end < start : end > start))) {
+        send_response(session, cmd->id, 400, 0, NULL);
+        return;
+    }
+    if (count == 0) {
+        count = (end - start) / (ctx->cache.delta * stride) + 1;
+    }
+    if (count > IMAGE_RANGE_MAX_FRAMES) {
+        count = IMAGE_RANGE_MAX_FRAMES;
+    }
+
+    // Images may be evicted while encoding the following frames, so copy them as we go
+    if ((fp = open_memstream(&buffer, &buffer_size)) == NULL) {
+        send_response(session, cmd->id, 500, 0, NULL);
+        return;
+    }
 
-                int score = score_scene_change(&sd, new_frame);
+    // Keep every encoder worker busy, but do not hold too many decoded frames
+    window = ctx->encoder_pool->num_threads * 2;
+    images = calloc(window, sizeof(struct encoded_image));
 
-                json_array_append_new(array, json_integer(score));
+    for (i = 0; i < count && code == 0 && !full; i += window) {
+        // Decode the frames and hand them to the workers
+        for (started = 0; started < window && i + started < count; started++) {
+            long pts = start + (i + started) * stride * ctx->cache.delta;
 
-                if (score > cut_off) {
-                    break;
+            ctx->readahead_target = pts;
+            if ((code = start_encoded_image(ctx, pts, image_opt, quality, images + started)) != 0) {
+                release_encoded_image(ctx, images + started);
+                break;
+            }
+        }
+        // Then collect the images in order
+        for (j = 0; j < started; j++) {
+            struct nicm_serve_image_header header;
+
+            // The rest of the window is only released once the buffer is full
+            if (!full && (code == 0 || sent == i + j)) {
+                long ret = finish_encoded_image(ctx, image_opt, quality, images + j);
+
+                if (ret == 0) {
+                    header.pts = images[j].pts;
+                    header.size = images[j].size;
+                    fwrite(&header, sizeof(header), 1, fp);
+                    fwrite(images[j].data, 1, images[j].size, fp);
+                    sent++;
+                    written += sizeof(header) + images[j].size;
+                    full = written >= IMAGE_RANGE_MAX_BYTES;
+                } else {
+                    code = ret;
                 }
             }
+            release_encoded_image(ctx, images + j);
+        }
+    }
+    fclose(fp);
+    free(images);
+
+    if (sent == 0 && code != 0) {
+        // Not even the first frame
+        send_response(session, cmd->id, code, 0, NULL);
+    } else {
+        send_response(session, cmd->id, 0, buffer_size, buffer);
+    }
+    free(buffer);
+}
 
-            json_object_set_new(result, "scores", array);
+static void handle_frame_command(struct serve_context *ctx, struct serve_session *session, const struct nicm_serve_command_v2 *cmd) {
+    static const enum AVPixelFormat raw_formats[2] = { AV_PIX_FMT_RGBA, AV_PIX_FMT_YUV420P };
+    struct nicm_serve_shm_frame result;
+    uint8_t *dst_data[4];
+    int dst_linesize[4];
+    long pts = cmd->args[0], started;
+    int size_opt = cmd->args[2], format = cmd->args[3], slot, size;
+
+    if (!ctx->shm_ring.map) {
+        send_response(session, cmd->id, 501, 0, NULL);
+        return;
+    }
+    if (cmd->args[2] < 0 || cmd->args[2] >= 4 || cmd->args[3] < 0 || cmd->args[3] >= 2) {
+        send_response(session, cmd->id, 400, 0, NULL);
+        return;
+    }
 
-            send_response_json(pipe, 0, result);
-            json_decref(result);
-        }
+    ctx->readahead_target = pts;
+
+    struct frame *frame = load_frame(ctx, pts);
+    if (frame == NULL) {
+        fprintf(stderr, "[Frame command] No frame for %ld\n", pts);
+        send_response(session, cmd->id, 404, 0, NULL);
+        return;
     }
 
-    destroy_framecache(&cache);
+    struct encode_configs *c = ctx->encode_configs + size_opt;
+    struct SwsContext *sws = sws_getCachedContext(ctx->raw_sws_contexts[size_opt][format],
+        frame->avf->width, frame->avf->height, frame->avf->format,
+        c->width, c->height, raw_formats[format], SWS_BILINEAR, NULL, NULL, NULL);
+    if (!sws) {
+        send_response(session, cmd->id, 500, 0, NULL);
+        return;
+    }
+    ctx->raw_sws_contexts[size_opt][format] = sws;
+
+    // Scale straight into the slot
+    uint8_t *buffer = shm_ring_begin_write(&ctx->shm_ring, &slot);
+    size = av_image_fill_arrays(dst_data, dst_linesize, buffer, raw_formats[format], c->width, c->height, 1);
+    started = now_us();
+    sws_scale(sws, (const uint8_t * const *)frame->avf->data, frame->avf->linesize, 0, frame->avf->height, dst_data, dst_linesize);
+    latency_record(&ctx->stats.scale, now_us() - started);
+
+    result.pts = frame->pts;
+    result.slot = slot;
+    result.sequence = shm_ring_end_write(&ctx->shm_ring, slot);
+    result.offset = shm_ring_slot_offset(&ctx->shm_ring, slot);
+    result.size = size;
+    result.width = c->width;
+    result.height = c->height;
+    result.linesize = dst_linesize[0];
+    result.format = format;
+
+    send_response(session, cmd->id, 0, sizeof(result), &result);
+}
 
-    for (i = 0; i < 8; i++) {
-        struct encode_configs *c = encode_configs + i;
+static void handle_scene_detect_command(struct serve_context *ctx, struct serve_session *session, const struct nicm_serve_command_v2 *cmd) {
+    int backward = (cmd->args[1] & 1) == 1;
+    int max_frame = SCENE_DETECT_DEFAULT_FRAMES;
+    int cut_off = MAX_SCENE_CHANGE_SCORE;
+    long pts = cmd->args[0];
+    int f;
+    struct frame *frame = load_frame(ctx, pts);
+    struct scene_detect_context sd;
+
+    if (frame == NULL) {
+        fprintf(stderr, "[Scene command] No frame for %ld\n", pts);
+        send_response(session, cmd->id, 404, 0, NULL);
+        return;
+    }
 
-        sws_freeContext(c->sws_context);
-        avcodec_close(c->encoder_context);
-        avcodec_free_context(&c->encoder_context);
+    if (cmd->args[2] > 0) {
+        if (cmd->args[2] > SCENE_DETECT_MAX_FRAMES) {
+            max_frame = SCENE_DETECT_MAX_FRAMES;
+        } else {
+            max_frame = (int)cmd->args[2];
+        }
     }
 
-    if (indices) {
-        free(indices);
+    if (cmd->args[3] > 0 && cmd->args[3] < MAX_SCENE_CHANGE_SCORE) {
+        cut_off = cmd->args[3];
     }
 
-    return 0;
+    json_t *result = json_object();
+    json_t *array = json_array();
+    init_scene_detect_context(&sd, frame);
+
+    for (f = 1; f <= max_frame; f++) {
+        long frame_pts = backward ? pts - f * ctx->cache.delta : pts + f * ctx->cache.delta;
+        struct frame *new_frame = load_frame(ctx, frame_pts);
+
+        if (new_frame == NULL) {
+            break;
+        }
+        if (!backward) {
+            // Scanning forward. The next request will likely follow.
+            ctx->readahead_target = frame_pts;
+        }
+
+        int score = score_scene_change(&sd, new_frame);
+
+        json_array_append_new(array, json_integer(score));
+
+        if (score > cut_off) {
+            break;
+        }
+    }
+
+    json_object_set_new(result, "scores", array);
+
+    send_response_json(session, cmd->id, 0, result);
+    json_decref(result);
 }
 
-static char *handle_info_command(AVStream *stream, long first_pts) {
+static char *handle_info_command(struct serve_context *ctx) {
+    AVStream *stream = ctx->stream;
+    long first_pts = ctx->first_pts;
+    long duration = stream->duration;
     json_t *root = json_object();
     char *json_str;
 
@@ -395,7 +1446,21 @@ static char *handle_info_command(AVStream *stream, long first_pts) {
     json_object_set_new(aspect_ratio, "den", json_integer(stream->codecpar->sample_aspect_ratio.den));
 
     json_object_set_new(root, "aspect_ratio", aspect_ratio);
-    json_object_set_new(root, "duration", json_integer(stream->duration));
+    if (ctx->opts->follow_timeout > 0 && ctx->index.num_entries > 0) {
+        // The duration estimated at open is of the file at that time
+        duration = ctx->index.entries[ctx->index.num_entries - 1].pts + ctx->cache.delta - stream->start_time;
+    }
+    json_object_set_new(root, "duration", json_integer(duration));
+    json_object_set_new(root, "following", json_boolean(ctx->following));
+
+    if (ctx->shm_ring.map) {
+        json_t *shm = json_object();
+        json_object_set_new(shm, "path", json_string(ctx->shm_ring.path));
+        json_object_set_new(shm, "slots", json_integer(ctx->shm_ring.slots));
+        json_object_set_new(shm, "slot_size", json_integer(ctx->shm_ring.slot_size));
+
+        json_object_set_new(root, "shm", shm);
+    }
 
     json_str = json_dumps(root, 0);
     json_decref(root);
@@ -403,74 +1468,214 @@ static char *handle_info_command(AVStream *stream, long first_pts) {
     return json_str;
 }
 
-static int cache_next_frame(struct framecache *cache, AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec,
-                            long pts_min, long pts_max) {
-    AVPacket packet = {};
+/**
+ * @brief Report the counters and the latencies of the input
+ *
+ * It reads only the atomic counters and the cache under cache_mutex, so it can be answered
+ * by the session thread while the command thread is busy.
+ */
+static void handle_stats_command(struct serve_context *ctx, struct serve_session *session, const struct nicm_serve_command_v2 *cmd) {
+    struct serve_stats *stats = &ctx->stats;
+    struct pool_stats ps;
+    json_t *root = json_object();
+    int i;
+
+    json_t *cache = json_object();
+    pthread_mutex_lock(&ctx->cache_mutex);
+    json_object_set_new(cache, "frames", json_integer(ctx->cache.num_frames));
+    json_object_set_new(cache, "bytes", json_integer(ctx->cache.bytes));
+    json_object_set_new(cache, "max_bytes", json_integer(ctx->cache.max_bytes));
+    pthread_mutex_unlock(&ctx->cache_mutex);
+    json_object_set_new(cache, "hits", json_integer(counter_get(&stats->cache_hits)));
+    json_object_set_new(cache, "misses", json_integer(counter_get(&stats->cache_misses)));
+    json_object_set_new(cache, "image_hits", json_integer(counter_get(&stats->image_hits)));
+    json_object_set_new(cache, "disk_hits", json_integer(counter_get(&stats->disk_hits)));
+
+    json_object_set_new(root, "cache", cache);
+
+    json_t *decoder = json_object();
+    json_object_set_new(decoder, "seeks", json_integer(counter_get(&stats->seeks)));
+    json_object_set_new(decoder, "seek_retries", json_integer(counter_get(&stats->seek_retries)));
+    json_object_set_new(decoder, "decoded", json_integer(counter_get(&stats->frames_decoded)));
+    json_object_set_new(decoder, "discarded", json_integer(counter_get(&stats->frames_discarded)));
+    json_object_set_new(decoder, "read_ahead", json_integer(counter_get(&stats->frames_read_ahead)));
+
+    json_object_set_new(root, "decoder", decoder);
+
+    json_t *encoder = json_object();
+    json_object_set_new(encoder, "images", json_integer(counter_get(&stats->images_encoded)));
+    json_object_set_new(encoder, "workers", json_integer(ctx->encoder_pool->num_threads));
+
+    json_object_set_new(root, "encoder", encoder);
+
+    json_t *latency = json_object();
+    json_object_set_new(latency, "demux", latency_to_json(&stats->demux));
+    json_object_set_new(latency, "decode", latency_to_json(&stats->decode));
+    json_object_set_new(latency, "seek", latency_to_json(&stats->seek));
+    json_object_set_new(latency, "scale", latency_to_json(&stats->scale));
+    json_object_set_new(latency, "encode", latency_to_json(&stats->encode));
+
+    json_object_set_new(root, "latency", latency);
+
+    json_t *commands = json_object();
+    for (i = 0; i < STATS_COMMANDS; i++) {
+        json_object_set_new(commands, stats_command_names[i], latency_to_json(stats->commands + i));
+    }
+
+    json_object_set_new(root, "commands", commands);
+
+    // Shared by all the inputs in the process
+    get_pool_stats(&ps);
+    json_t *pool = json_object();
+    json_object_set_new(pool, "frame_allocs", json_integer(ps.frame_allocs));
+    json_object_set_new(pool, "frame_gets", json_integer(ps.frame_gets));
+    json_object_set_new(pool, "packet_allocs", json_integer(ps.packet_allocs));
+    json_object_set_new(pool, "packet_gets", json_integer(ps.packet_gets));
+    json_object_set_new(pool, "buffer_allocs", json_integer(ps.buffer_allocs));
+    json_object_set_new(pool, "buffer_gets", json_integer(ps.buffer_gets));
+
+    json_object_set_new(root, "pool", pool);
+
+    send_response_json(session, cmd->id, 0, root);
+    json_decref(root);
+}
+
+/**
+ * @brief Return the events recorded by all the threads of the process in Chrome trace JSON
+ */
+static void handle_trace_command(struct serve_session *session, const struct nicm_serve_command_v2 *cmd) {
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE *fp = open_memstream(&buffer, &size);
     int ret;
-    AVFrame *frame = av_frame_alloc();
 
-    while ((ret = av_read_frame(avf_context, &packet)) == 0) {
-        if (packet.stream_index != stream->index) {
+    if (!fp) {
+        send_response(session, cmd->id, 500, 0, NULL);
+        return;
+    }
+    ret = export_trace(fp);
+    fclose(fp);
+
+    if (ret == 0) {
+        send_response(session, cmd->id, 0, size, buffer);
+    } else {
+        send_response(session, cmd->id, 500, 0, NULL);
+    }
+    free(buffer);
+}
+
+/**
+ * @brief Read the next packet, timing the demuxer
+ */
+static int __read_packet(struct serve_context *ctx, AVPacket *packet) {
+    long started = now_us();
+    int ret = av_read_frame(ctx->avf_context, packet);
+
+    latency_record(&ctx->stats.demux, now_us() - started);
+
+    return ret;
+}
+
+/**
+ * @brief Decode the next frame and put it in the cache. The caller must hold ctx->mutex.
+ *
+ * The time taken and the keyframes read are told to the seek policy.
+ */
+static int cache_next_frame(struct serve_context *ctx, long pts_min, long pts_max) {
+    AVStream *stream = ctx->stream;
+    AVCodecContext *codec = ctx->codec;
+    AVPacket *packet = pool_get_packet();
+    int ret;
+    AVFrame *frame = pool_get_frame();
+    long started = now_us(), decode_started;
+
+    while ((ret = __read_packet(ctx, packet)) == 0) {
+        if (packet->stream_index != stream->index) {
             goto free_packet;
         }
-        if (packet.flags & AV_PKT_FLAG_CORRUPT) {
-            fprintf(stderr, "Stream #%d, dts %ld corrupted.", packet.stream_index, packet.dts);
+        if (packet->flags & AV_PKT_FLAG_KEY) {
+            seek_policy_keyframe(&ctx->seek_policy, packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts);
+        }
+        if (packet->flags & AV_PKT_FLAG_CORRUPT) {
+            fprintf(stderr, "Stream #%d, dts %ld corrupted.", packet->stream_index, packet->dts);
             goto free_packet;
         }
-        ret = avcodec_send_packet(codec, &packet);
+        decode_started = now_us();
+        ret = avcodec_send_packet(codec, packet);
         if (ret == 0) {
             ret = avcodec_receive_frame(codec, frame);
+            latency_record(&ctx->stats.decode, now_us() - decode_started);
             if (ret == 0) {
-                if ((pts_min == AV_NOPTS_VALUE || frame->pts >= pts_min) &&
-                    (pts_max == AV_NOPTS_VALUE || frame->pts <= pts_max)) {
-                    fprintf(stderr, "[cache_next_frame] PTS %ld received at %ld. Going to add to cache\n", frame->pts, packet.pos);
-                    add_framecache(cache, frame);
+                long elapsed = now_us() - started;
+                int keep = (pts_min == AV_NOPTS_VALUE || frame->pts >= pts_min) &&
+                    (pts_max == AV_NOPTS_VALUE || frame->pts <= pts_max);
+
+                seek_policy_decoded(&ctx->seek_policy, elapsed);
+                counter_add(&ctx->stats.frames_decoded, 1);
+                TRACE_COMPLETE(TRACE_LEVEL_DEBUG, keep ? "decode_frame" : "discard_frame", "pts,pos", frame->pts, packet->pos, started, elapsed);
+
+                if (keep) {
+                    pthread_mutex_lock(&ctx->cache_mutex);
+                    add_framecache(&ctx->cache, frame);
+                    TRACE_COUNTER(TRACE_LEVEL_DEBUG, "cache_bytes", ctx->cache.bytes);
+                    pthread_mutex_unlock(&ctx->cache_mutex);
                 } else {
-                    fprintf(stderr, "[cache_next_frame] PTS %ld received. Discard.\n", frame->pts);
-                    av_frame_free(&frame);
+                    counter_add(&ctx->stats.frames_discarded, 1);
+                    pthread_mutex_lock(&ctx->cache_mutex);
+                    ctx->cache.pts_last = frame->pts;
+                    pthread_mutex_unlock(&ctx->cache_mutex);
+                    pool_put_frame(&frame);
                 }
 
-                av_packet_unref(&packet);
+                pool_put_packet(&packet);
                 return 0;
             } else if (ret != AVERROR(EAGAIN)) {
                 fprintf(stderr, "avcodec_receive_frame() => %d\n", ret);
+                pool_put_packet(&packet);
+                pool_put_frame(&frame);
                 return 1;
             }
         }
 
 free_packet:
-        av_packet_unref(&packet);
+        av_packet_unref(packet);
     }
     fprintf(stderr, "av_read_frame() => %d\n", ret);
+    if (ctx->opts->follow_timeout > 0) {
+        // The file may grow. Let the next read wait for it again.
+        ctx->avf_context->pb->eof_reached = 0;
+        ctx->avf_context->pb->error = 0;
+    }
 
-    av_frame_free(&frame);
+    pool_put_packet(&packet);
+    pool_put_frame(&frame);
 
     return 1;
 }
 
-static struct frame *load_frame(struct framecache *cache, AVFormatContext *avf_context, AVStream *stream, AVCodecContext *codec, long pts, struct video_stream_frame_index *indices, int frames_in_indices) {
-    int ret = find_in_framecache(cache, pts);
-    if (ret >= 0) {
-        return cache->frames + ret;
-    }
+static int find_cached_frame(struct serve_context *ctx, long pts, int nearest) {
+    int ret;
 
-    long pts_min = AV_NOPTS_VALUE;
-    if (ret == -1) {
-        pts_min = pts - cache->delta * cache->seek_amount;
+    pthread_mutex_lock(&ctx->cache_mutex);
+    ret = nearest ? find_nearest_frame(&ctx->cache, pts) : find_in_framecache(&ctx->cache, pts);
+    pthread_mutex_unlock(&ctx->cache_mutex);
 
-        cache->pts_last = AV_NOPTS_VALUE;
+    return ret;
+}
 
-        ret = seek_frame(avf_context, stream, pts_min, indices, frames_in_indices);
-        if (ret != 0) {
-            fprintf(stderr, "seek_frame returned error\n");
-            return NULL;
-        }
-        avcodec_flush_buffers(codec);
-    }
+/**
+ * @brief Decode forward until the frame at the PTS. The caller must hold ctx->mutex.
+ *
+ * @param pts_keep Frames before it are discarded instead of cached (AV_NOPTS_VALUE: cache all)
+ * @param overshot Set if the first decoded frame is already after the PTS and the frame is not found (optional)
+ */
+static struct frame *__decode_until(struct serve_context *ctx, long pts, long pts_keep, int *overshot) {
+    struct framecache *cache = &ctx->cache;
+    int ret, first = 1;
 
-    while ((ret = cache_next_frame(cache, avf_context, stream, codec, AV_NOPTS_VALUE, AV_NOPTS_VALUE)) == 0) {
+    while ((ret = cache_next_frame(ctx, pts_keep, AV_NOPTS_VALUE)) == 0) {
         if (cache->pts_last == pts) {
-            ret = find_in_framecache(cache, pts);
+            ret = find_cached_frame(ctx, pts, 0);
             if (ret >= 0) {
                 return cache->frames + ret;
             } else {
@@ -478,15 +1683,109 @@ static struct frame *load_frame(struct framecache *cache, AVFormatContext *avf_c
                 return NULL;
             }
         } else if (cache->pts_last > pts) {
-            ret = find_nearest_frame(cache, pts);
+            ret = find_cached_frame(ctx, pts, 1);
             if (ret >= 0) {
-                fprintf(stderr, "Returning the nearest frame %ld instead of %ld\n", cache->frames[ret].pts, pts);
+                TRACE_INSTANT(TRACE_LEVEL_INFO, "nearest_frame", "pts,requested", cache->frames[ret].pts, pts);
                 return cache->frames + ret;
+            } else if (first && overshot) {
+                *overshot = 1;
+                return NULL;
             } else {
-                fprintf(stderr, "Try to find the nearest frame, but nope\n");
+                TRACE_INSTANT(TRACE_LEVEL_INFO, "no_frame", "pts", pts, 0);
                 return NULL;
             }
         }
+        first = 0;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Get the frame at the PTS from the cache, or decode it
+ *
+ * Whether to decode forward or to seek is decided by the seek policy, which learns
+ * from the costs of the decodes and the seeks here.
+ *
+ * When the frames are requested backward, a seek decodes a window of frames before the PTS
+ * (about a GOP, as far as the cache budget allows, from a keyframe when indexed) and keeps them, so that the following
+ * requests are served from the cache until the window is exhausted.
+ */
+static struct frame *load_frame(struct serve_context *ctx, long pts) {
+    struct framecache *cache = &ctx->cache;
+    struct seek_policy *policy = &ctx->seek_policy;
+    int ret = find_cached_frame(ctx, pts, 0), attempt;
+
+    ctx->reverse = ctx->last_load_pts != AV_NOPTS_VALUE && pts < ctx->last_load_pts;
+    ctx->last_load_pts = pts;
+
+    if (ret >= 0) {
+        counter_add(&ctx->stats.cache_hits, 1);
+        return cache->frames + ret;
+    }
+    counter_add(&ctx->stats.cache_misses, 1);
+
+    if (!ctx->reverse && cache->pts_last != AV_NOPTS_VALUE && pts > cache->pts_last &&
+        !seek_policy_should_seek(policy, (pts - cache->pts_last + cache->delta - 1) / cache->delta)) {
+        return __decode_until(ctx, pts, AV_NOPTS_VALUE, NULL);
+    }
+
+    for (attempt = 0; attempt < SEEK_MAX_ATTEMPTS; attempt++) {
+        long started = now_us();
+        long pts_keep = AV_NOPTS_VALUE, pts_min;
+        int overshot = 0;
+        struct frame *frame;
+
+        if (ctx->reverse) {
+            long window = policy->preroll_frames;
+
+            if (window > __half_budget_frames(cache)) {
+                window = __half_budget_frames(cache);
+            }
+            pts_keep = pts - cache->delta * window;
+            if (ctx->index.entries) {
+                pts_keep = __keyframe_pts_before(&ctx->index, pts_keep);
+            }
+            pts_min = pts_keep;
+        } else {
+            pts_min = pts;
+        }
+        // The index seeks to the keyframe the frame is decoded from. Otherwise, go back far enough
+        // to have a keyframe before the frame.
+        if (!ctx->index.entries) {
+            pts_min = seek_policy_seek_target(policy, pts_min);
+        }
+
+        pthread_mutex_lock(&ctx->cache_mutex);
+        cache->pts_last = AV_NOPTS_VALUE;
+        pthread_mutex_unlock(&ctx->cache_mutex);
+
+        ret = seek_frame(ctx->avf_context, ctx->stream, pts_min, ctx->index.entries, ctx->index.num_entries);
+        if (ret != 0) {
+            fprintf(stderr, "seek_frame returned error\n");
+            return NULL;
+        }
+        avcodec_flush_buffers(ctx->codec);
+        seek_policy_keyframe(policy, AV_NOPTS_VALUE);
+        counter_add(&ctx->stats.seeks, 1);
+
+        // Nothing before the first frame, so going back further does not help
+        frame = __decode_until(ctx, pts, pts_keep, pts_min > ctx->first_pts ? &overshot : NULL);
+        if (!overshot) {
+            if (frame) {
+                long elapsed = now_us() - started;
+
+                seek_policy_seeked(policy, elapsed);
+                latency_record(&ctx->stats.seek, elapsed);
+                TRACE_COMPLETE(TRACE_LEVEL_INFO, "seek", "pts,target", pts, pts_min, started, elapsed);
+            }
+            return frame;
+        }
+        // No keyframe between the seek point and the frame
+        seek_policy_overshot(policy);
+        counter_add(&ctx->stats.seek_retries, 1);
+        TRACE_INSTANT(TRACE_LEVEL_INFO, "seek_overshot", "pts,target", pts, pts_min);
     }
+
+    fprintf(stderr, "No keyframe found before %ld\n", pts);
     return NULL;
 }
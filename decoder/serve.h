@@ -0,0 +1,118 @@
+#pragma once
+#include <stdio.h>
+#include <pthread.h>
+#include "nicm.h"
+#include "lib/encoder_pool.h"
+
+/*
+ * Serving frames of an input
+ *
+ * An input (struct serve_context) owns the demuxer, the decoder and the frame cache of a video stream.
+ * A session is a client of an input: it sends commands and receives the responses.
+ * `nicm serve` has one input and one session on stdin/stdout, while `nicm daemon` shares
+ * the inputs among the connections and an encoder pool among the inputs.
+ */
+
+/* Protocol */
+#define NICM_SERVE_COMMAND_QUIT  0
+#define NICM_SERVE_COMMAND_INFO  1
+/* Image: [0]: Frame PTS / [1]: Decode options / [2]: Image options / [3]: Quality
+ *   Decode options: 0 .. return only exact frame / 1 .. return the nearest frame
+ *   Image options:  0 .. original size / 1 .. half size / 2 .. resized original size / 3 .. resized half size
+ *                 | 0 .. PNG / 4 .. JPEG / 8 .. RGBA / 12 .. BGRA / 16 .. QOI / 20 .. WebP
+ *     RGBA and BGRA are packed pixels without any header.
+ *   Quality: 0 .. default of the format
+ *     PNG: 1 - 10 .. compression level 0 - 9 (1 is the fastest) / JPEG, WebP: 1 - 100 .. quality / Others: ignored
+ */
+#define NICM_SERVE_COMMAND_IMAGE 2
+/* Image range: [0]: Start PTS / [1]: Frame count (0: up to the end PTS) / [2]: Image options / [3]: Stride in frames (default: 1, negative: backward) / [4]: End PTS (inclusive) / [5]: Quality
+ *   Returns up to IMAGE_RANGE_MAX_FRAMES images, each of which is a nicm_serve_image_header followed by the image.
+ *   The sequence ends early when no more frames are found, or when the images exceed IMAGE_RANGE_MAX_BYTES in total. A backward range is decoded a GOP at a time, not with a seek per frame.
+ */
+#define NICM_SERVE_COMMAND_IMAGE_RANGE 3
+/* Raw frame in the shared memory (-S): [0]: Frame PTS / [2]: Size options (0 - 3 as image options) / [3]: Format (0: RGBA / 1: YUV420P)
+ *   Returns nicm_serve_shm_frame. The frame is valid until the slot is reused, which is told by the sequence number.
+ */
+#define NICM_SERVE_COMMAND_FRAME 4
+/* Open (nicm daemon only): [0]: Stream (-1: the first video stream) / [1]: Length of the path following the command
+ *   The first command of a connection, which binds the connection to the input. Returns 404 if the input cannot be opened.
+ */
+#define NICM_SERVE_COMMAND_OPEN 5
+/* Statistics: no arguments
+ *   Returns a JSON object of the counters (cache hits and misses, seeks, decoded and discarded frames, ...) and the latency
+ *   histograms of the stages (demux, decode, seek, scale, encode) and the commands since the input was opened.
+ *   With the protocol version 2, it is answered at once even while another command is in progress.
+ */
+#define NICM_SERVE_COMMAND_STATS 6
+/* Trace: no arguments
+ *   Returns the latest events recorded by all the threads of the process in Chrome trace JSON (see lib/trace.h).
+ *   With the protocol version 2, it is answered at once as STATS.
+ */
+#define NICM_SERVE_COMMAND_TRACE 7
+
+#define NICM_SERVE_COMMAND_SCENE_DETECT 256
+/* Image: [0]: Base Frame PTS / [1]: Detect options / [2]: Max frames (default: 100, max: 2000) / [3]: Cutoff score
+ *   Detect options: 0 .. detect forward / 1 .. detect backward
+ */
+
+struct nicm_serve_command {
+    long command;
+    long args[7];
+};
+struct nicm_serve_response {
+    long code;
+    long size;
+};
+
+/* Protocol version 2 (-P 2): Tagged requests
+ *   The client may send commands without waiting for the responses. Each response carries the ID of its command,
+ *   and the responses may come in a different order: images already in the cache are returned while a seek or
+ *   a scene detection is in progress. The other commands are processed in order.
+ */
+struct nicm_serve_command_v2 {
+    long command;
+    long id;
+    long args[7];
+};
+struct nicm_serve_response_v2 {
+    long code;
+    long id;
+    long size;
+};
+struct nicm_serve_image_header {
+    long pts;
+    long size;
+};
+struct nicm_serve_shm_frame {
+    long pts;
+    long slot;
+    long sequence;
+    // From the beginning of the shared memory
+    long offset;
+    long size;
+    long width;
+    long height;
+    long linesize;
+    long format;
+};
+
+struct serve_context;
+
+struct serve_session {
+    FILE *output;
+    pthread_mutex_t output_mutex;
+    int protocol;
+
+    // Commands of the session not answered yet
+    int pending;
+    pthread_cond_t pending_cond;
+};
+
+int open_serve_context(struct serve_context **ctx, const char *file, int stream, struct file_open_options *opts, struct encoder_pool *encoder_pool, size_t cache_size);
+void close_serve_context(struct serve_context *ctx);
+void resize_serve_cache(struct serve_context *ctx, size_t cache_size);
+
+void init_serve_session(struct serve_session *session, FILE *output, int protocol);
+void destroy_serve_session(struct serve_session *session);
+int serve_session(struct serve_context *ctx, struct serve_session *session, FILE *input);
+int send_response(struct serve_session *session, long id, long code, size_t size, void *data);
@@ -3,9 +3,12 @@ import FastifyStatic from "@fastify/static";
 
 import NimochConfig from "./config";
 import NimochWebsocket from "./renderer/websocket";
+import { NicmClient } from "./renderer/decoder";
 import path from "path";
 
 async function main() {
+    await NicmClient.StartDaemon();
+
     const fastify = Fastify({
         logger: true
     });
@@ -24,6 +27,14 @@ async function main() {
         prefix: "/websocket"
     });
 
+    // Decoder statistics, to tell whether the inputs are seek-, decode- or encode-bound
+    fastify.get("/stats", async () => {
+        return NicmClient.Stats();
+    });
+    fastify.get("/trace", async () => {
+        return NicmClient.Trace();
+    });
+
     await fastify.listen({
         port: NimochConfig.server.port,
         host: NimochConfig.server.host
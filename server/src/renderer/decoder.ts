@@ -1,20 +1,37 @@
 import config from "config";
 import { ChildProcessByStdio, spawn } from "child_process";
 import path from "path";
-import { once, Readable, Writable } from "stream";
-import { Mutex } from "async-mutex";
+import { Readable, Writable } from "stream";
+import { FileHandle, open } from "fs/promises";
+import net from "net";
 
 const NICM_PATH = path.resolve(__dirname, config.get<string>("bin.decoder"));
+const NICM_CACHE_DIR = config.has("cache.directory") ? path.resolve(__dirname, config.get<string>("cache.directory")) : null;
+const NICM_CACHE_SIZE = config.has("cache.size") ? config.get<string>("cache.size") : null;
+const NICM_SHM_SLOTS = config.has("shm.slots") ? config.get<number>("shm.slots") : 0;
+// Share one nicm daemon among the inputs instead of spawning nicm serve for each
+const NICM_DAEMON_SOCKET = config.has("daemon.socket") ? path.resolve(__dirname, config.get<string>("daemon.socket")) : null;
+const NICM_DAEMON_CACHE_SIZE = config.has("daemon.cache") ? config.get<string>("daemon.cache") : null;
+const NICM_DAEMON_START_TIMEOUT = 10000;
+// A client not answering Stats() or Trace() in time is skipped
+const NICM_STATS_TIMEOUT = 2000;
 
 enum NicmServeCommand {
     QUIT = 0,
     INFO = 1,
     IMAGE = 2,
+    IMAGE_RANGE = 3,
+    FRAME = 4,
+    // nicm daemon only
+    OPEN = 5,
+    STATS = 6,
+    TRACE = 7,
     SCENE_DETECT = 256
 };
 
 interface NicmServeResponseHeader {
     code: number;
+    id: number;
     size: number;
 }
 
@@ -22,7 +39,62 @@ export interface NicmServeSceneDetectResult {
     scores: number[];
 }
 
-const NICM_SERVE_RESPONSE_HEADER_SIZE = 16;
+// Image option = size | format
+export enum NicmImageSize {
+    ORIGINAL = 0,
+    HALF = 1,
+    RESIZED = 2,
+    RESIZED_HALF = 3
+}
+export enum NicmImageFormat {
+    PNG = 0,
+    JPEG = 4,
+    // Packed pixels without any header
+    RGBA = 8,
+    BGRA = 12,
+    QOI = 16,
+    WEBP = 20
+}
+
+export interface NicmServeImage {
+    pts: number;
+    image: Buffer;
+}
+
+export interface NicmServeImageRangeOptions {
+    // Number of frames. Either count or end is required.
+    count?: number;
+    // Last PTS (inclusive)
+    end?: number;
+    // Step in frames (default: 1, negative: backward from startPts)
+    stride?: number;
+    // See image()
+    quality?: number;
+}
+
+// Protocol version 2 (tagged requests)
+const NICM_SERVE_PROTOCOL_VERSION = 2;
+const NICM_SERVE_REQUEST_SIZE = 72;
+const NICM_SERVE_RESPONSE_HEADER_SIZE = 24;
+const NICM_SERVE_IMAGE_HEADER_SIZE = 16;
+const NICM_SERVE_SHM_FRAME_SIZE = 72;
+// Offset of the sequence numbers in the header of the shared memory
+const NICM_SHM_SEQUENCE_OFFSET = 64;
+
+export enum NicmRawFormat {
+    RGBA = 0,
+    YUV420P = 1
+}
+
+export interface NicmRawFrame {
+    pts: number;
+    width: number;
+    height: number;
+    // Bytes per line of the first plane. Planes are packed without padding.
+    linesize: number;
+    format: NicmRawFormat;
+    data: Buffer;
+}
 
 export interface NicmInfo {
     aspect_ratio: { num: number, den: number };
@@ -30,9 +102,33 @@ export interface NicmInfo {
     start_time: number;
     first_pts: number;
     duration: number;
+    // The file is being recorded and the duration grows (nicm serve -F)
+    following: boolean;
     width: number;
     height: number;
     stream: number;
+    shm?: { path: string, slots: number, slot_size: number };
+}
+
+// Bucket i counts the latencies in [2^(i-1), 2^i) us. The last bucket counts all the longer ones.
+export interface NicmLatencyHistogram {
+    count: number;
+    total_us: number;
+    max_us: number;
+    // Upper bounds of the buckets (absent if count is 0)
+    p50_us?: number;
+    p90_us?: number;
+    p99_us?: number;
+    buckets: number[];
+}
+
+export interface NicmServeStats {
+    cache: { frames: number, bytes: number, max_bytes: number, hits: number, misses: number, image_hits: number, disk_hits: number };
+    decoder: { seeks: number, seek_retries: number, decoded: number, discarded: number, read_ahead: number };
+    encoder: { images: number, workers: number };
+    latency: { demux: NicmLatencyHistogram, decode: NicmLatencyHistogram, seek: NicmLatencyHistogram, scale: NicmLatencyHistogram, encode: NicmLatencyHistogram };
+    commands: Record<"image" | "image_cached" | "image_range" | "frame" | "scene_detect", NicmLatencyHistogram>;
+    pool: { frame_allocs: number, frame_gets: number, packet_allocs: number, packet_gets: number, buffer_allocs: number, buffer_gets: number };
 }
 
 export interface NicmDetectStream {
@@ -58,6 +154,23 @@ export interface NicmDetectResult {
     };
 }
 
+// A line of nicm ingest
+export interface NicmIngestResult {
+    file: string;
+    detect?: NicmDetectResult;
+    index?: {
+        frames: number;
+    };
+    // Output of nicm check
+    check?: any;
+    // Exit code of each failed job
+    errors?: {
+        detect?: number;
+        index?: number;
+        check?: number;
+    };
+}
+
 export type NicmAudioDecodeSegment = {
     start: number;
     end: number;
@@ -70,30 +183,73 @@ export type NicmAudioDecodeSegment = {
 
 export type NicmAudioDecodeSegmentInfo = NicmAudioDecodeSegment[];
 
-function nicmServeRequest(command: NicmServeCommand, ...args: number[]) {
-    const buf = Buffer.alloc(64, 0);
+interface NicmServeRequest {
+    command: NicmServeCommand;
+    args: number[];
+}
+
+function nicmServeRequest(command: NicmServeCommand, ...args: number[]): NicmServeRequest {
+    return { command, args };
+}
+function nicmServeRequestBuffer(request: NicmServeRequest, id: number) {
+    const buf = Buffer.alloc(NICM_SERVE_REQUEST_SIZE, 0);
     let i;
 
-    buf.writeIntLE(command, 0, 6);
+    buf.writeBigInt64LE(BigInt(request.command), 0);
+    buf.writeBigInt64LE(BigInt(id), 8);
     for (i = 0; i < 7; i++) {
-        if (i < args.length) {
-            buf.writeBigInt64LE(BigInt(args[i]), 8 + i * 8);
+        if (i < request.args.length) {
+            buf.writeBigInt64LE(BigInt(request.args[i]), 16 + i * 8);
         }
     }
 
     return buf;
 }
+function nicmServeImageSequence(data: Buffer): NicmServeImage[] {
+    const images: NicmServeImage[] = [];
+    let offset = 0;
+
+    while (offset + NICM_SERVE_IMAGE_HEADER_SIZE <= data.length) {
+        const pts = Number(data.readBigInt64LE(offset));
+        const size = Number(data.readBigInt64LE(offset + 8));
+
+        offset += NICM_SERVE_IMAGE_HEADER_SIZE;
+        images.push({
+            pts,
+            image: data.subarray(offset, offset + size)
+        });
+        offset += size;
+    }
+
+    return images;
+}
 function nicmServeResponse(response: Buffer): NicmServeResponseHeader {
     const code = response.readBigInt64LE(0);
-    const size = response.readBigInt64LE(8);
+    const id = response.readBigInt64LE(8);
+    const size = response.readBigInt64LE(16);
 
     // Should fit in 2^53 - 1
     return {
         code: Number(code),
+        id: Number(id),
         size: Number(size)
     };
 }
 
+function connectable(socketPath: string): Promise<boolean> {
+    return new Promise((resolve) => {
+        const socket = net.createConnection(socketPath);
+
+        socket.once("connect", () => {
+            socket.destroy();
+            resolve(true);
+        });
+        socket.once("error", () => {
+            resolve(false);
+        });
+    });
+}
+
 export function execPipeStdout(command: string, args: string[]): Promise<string> {
     return new Promise<string>((resolve, reject) => {
         let ret = "";
@@ -130,45 +286,274 @@ export class NicmClient {
         return JSON.parse(result);
     }
 
-    protected proc: ChildProcessByStdio<Writable, Readable, null>;
-    protected mutex: Mutex;
+    /**
+     * Detect, index and check many files with nicm ingest. onResult is called as each file finishes.
+     * Resolves with the number of the files that failed.
+     */
+    public static Ingest(filenames: string[], onResult: (result: NicmIngestResult) => void, opts?: string[]): Promise<number> {
+        return new Promise<number>((resolve, reject) => {
+            let pending = "", failed = 0;
+
+            const proc = spawn(NICM_PATH, ["ingest", ...(opts ?? []), "-L", "-"], {
+                stdio: ["pipe", "pipe", "inherit"],
+            });
+
+            proc.stdout.on("data", (data: Buffer) => {
+                const lines = (pending + data.toString("utf-8")).split("\n");
+
+                pending = lines.pop()!;
+                for (const line of lines) {
+                    if (line.length > 0) {
+                        const result: NicmIngestResult = JSON.parse(line);
+
+                        if (result.errors != null) {
+                            failed++;
+                        }
+                        onResult(result);
+                    }
+                }
+            });
+
+            proc.on("close", (code) => {
+                // 2: some files failed, which are reported in the results
+                if (code !== 0 && code !== 2) {
+                    reject(new Error("Process exited with " + code));
+                } else {
+                    resolve(failed);
+                }
+            });
+
+            proc.on("error", (err) => {
+                reject(err);
+            });
+
+            proc.stdin.end(filenames.map((filename) => filename + "\n").join(""));
+        });
+    }
+
+    /**
+     * Start nicm daemon if it is configured and not running yet. Call it once before creating clients.
+     */
+    public static async StartDaemon(): Promise<void> {
+        if (NICM_DAEMON_SOCKET == null || await connectable(NICM_DAEMON_SOCKET)) {
+            return;
+        }
+
+        const opts = ["-u", NICM_DAEMON_SOCKET];
+        if (NICM_DAEMON_CACHE_SIZE != null) {
+            opts.push("-m", NICM_DAEMON_CACHE_SIZE);
+        }
+        if (NICM_CACHE_DIR != null) {
+            opts.push("-d", NICM_CACHE_DIR);
+            if (NICM_CACHE_SIZE != null) {
+                opts.push("-D", NICM_CACHE_SIZE);
+            }
+        }
+        if (NICM_SHM_SLOTS > 0) {
+            opts.push("-S", NICM_SHM_SLOTS.toString());
+        }
+
+        const proc = spawn(NICM_PATH, ["daemon", ...opts], {
+            stdio: ["ignore", "inherit", "inherit"]
+        });
+        proc.on("exit", (code) => {
+            console.error(`nicm: daemon exited with ${code}`);
+        });
+
+        const deadline = Date.now() + NICM_DAEMON_START_TIMEOUT;
+        while (!await connectable(NICM_DAEMON_SOCKET)) {
+            if (proc.exitCode != null || Date.now() > deadline) {
+                throw new Error("Failed to start nicm daemon");
+            }
+            await new Promise((resolve) => setTimeout(resolve, 100));
+        }
+    }
+
+    // Open clients, scraped by Stats()
+    protected static clients = new Map<NicmClient, string>();
+
+    /**
+     * Statistics of all the open clients, keyed by their file names
+     */
+    public static async Stats(): Promise<Record<string, NicmServeStats[]>> {
+        const result: Record<string, NicmServeStats[]> = {};
+        const clients = [...NicmClient.clients];
+        const stats = await Promise.allSettled(clients.map(([client]) => withTimeout(client.stats(), NICM_STATS_TIMEOUT)));
+
+        // Closed meanwhile or not answering
+        stats.forEach((s, i) => {
+            if (s.status === "fulfilled") {
+                (result[clients[i][1]] ??= []).push(s.value);
+            }
+        });
+
+        return result;
+    }
+
+    /**
+     * Chrome trace JSON of all the decoder processes. Clients sharing nicm daemon are fetched once.
+     */
+    public static async Trace(): Promise<{ traceEvents: { pid: number }[] }> {
+        const result = { traceEvents: [] as { pid: number }[] };
+        // Clients by their processes. The clients of nicm daemon have none of their own.
+        const processes = new Map<number | null, NicmClient[]>();
+
+        for (const client of NicmClient.clients.keys()) {
+            const pid = client.proc?.pid ?? null;
+            const group = processes.get(pid);
+
+            if (group != null) {
+                group.push(client);
+            } else {
+                processes.set(pid, [client]);
+            }
+        }
+
+        const traces = await Promise.allSettled([...processes.values()].map(async (clients) => {
+            // Another client of the process answers when one is closed meanwhile
+            for (const client of clients) {
+                try {
+                    return await withTimeout(client.trace(), NICM_STATS_TIMEOUT);
+                } catch (e) {
+                    continue;
+                }
+            }
+            throw new Error("No client answered");
+        }));
+
+        for (const trace of traces) {
+            if (trace.status === "fulfilled") {
+                result.traceEvents.push(...trace.value.traceEvents);
+            }
+        }
+
+        return result;
+    }
 
+    protected proc: ChildProcessByStdio<Writable, Readable, null> | null;
+    protected input: Readable;
+    protected output: Writable;
+    protected shm: Promise<FileHandle> | null;
+    protected nextId: number;
+    protected pending: Map<number, { resolve: (data: Buffer) => void, reject: (e: Error) => void }>;
+    // Set once the connection is lost. No more response arrives.
+    protected error: Error | null;
+
+    /**
+     * @param additionalOpts Options of nicm serve. Ignored when nicm daemon is used.
+     */
     public constructor(filename: string, stream?: number, additionalOpts?: string[]) {
+        this.shm = null;
+        this.nextId = 1;
+        this.pending = new Map();
+        this.error = null;
+        NicmClient.clients.set(this, filename);
+
+        if (NICM_DAEMON_SOCKET != null) {
+            const socket = net.createConnection(NICM_DAEMON_SOCKET);
+            const pathBuffer = Buffer.from(path.resolve(filename), "utf-8");
+
+            socket.on("error", (e) => {
+                this.rejectAll(e);
+            });
+            this.proc = null;
+            this.input = socket;
+            this.output = socket;
+
+            // The connection is bound to the input. The other requests can follow without waiting.
+            this.pending.set(0, {
+                resolve: () => undefined,
+                reject: (e) => console.error(`nicm: Cannot open ${filename}: ${e.message}`)
+            });
+            socket.write(Buffer.concat([
+                nicmServeRequestBuffer(nicmServeRequest(NicmServeCommand.OPEN, stream ?? -1, pathBuffer.length), 0),
+                pathBuffer
+            ]));
+        } else {
+            this.proc = this.spawnServe(filename, stream, additionalOpts);
+            this.input = this.proc.stdout;
+            this.output = this.proc.stdin;
+        }
+
+        this.receiveLoop().catch((e) => {
+            this.rejectAll(e as Error);
+        });
+    }
+
+    protected spawnServe(filename: string, stream?: number, additionalOpts?: string[]) {
         const opts = [];
         if (stream != null) {
             opts.push("-s", stream.toString());
         }
+        if (NICM_CACHE_DIR != null) {
+            opts.push("-d", NICM_CACHE_DIR);
+            if (NICM_CACHE_SIZE != null) {
+                opts.push("-D", NICM_CACHE_SIZE);
+            }
+        }
         if (additionalOpts != null) {
             opts.push(...additionalOpts);
         }
 
-        this.proc = spawn(NICM_PATH, ["serve", ...opts, filename], {
+        if (NICM_SHM_SLOTS > 0) {
+            opts.push("-S", NICM_SHM_SLOTS.toString());
+        }
+        opts.push("-P", NICM_SERVE_PROTOCOL_VERSION.toString());
+
+        return spawn(NICM_PATH, ["serve", ...opts, filename], {
             stdio: ["pipe", "pipe", "inherit"]
         });
-        this.mutex = new Mutex();
     }
 
-    protected async transact(request: Buffer): Promise<Buffer> {
-        const release = await this.mutex.acquire();
-        let error;
-        try {
-            if (this.proc.stdin.write(request) !== true) {
-                await once(this.proc.stdin, "drain");
-            }
-            const responseBuffer = await readFromStream(this.proc.stdout, NICM_SERVE_RESPONSE_HEADER_SIZE);
+    /**
+     * Dispatch responses to the requests by their IDs. They may arrive in a different order.
+     */
+    protected async receiveLoop() {
+        for (;;) {
+            const responseBuffer = await readFromStream(this.input, NICM_SERVE_RESPONSE_HEADER_SIZE);
             const header = nicmServeResponse(responseBuffer);
+            const data = header.size > 0 ? await readFromStream(this.input, header.size) : Buffer.from([]);
+            const request = this.pending.get(header.id);
+
+            if (request == null) {
+                console.warn(`nicm: Response for unknown request ${header.id}`);
+                continue;
+            }
+            this.pending.delete(header.id);
 
-            if (header.size > 0) {
-                return await readFromStream(this.proc.stdout, header.size);
-            } else if (header.code === 0) {
-                return Buffer.from([]);
+            if (header.code === 0) {
+                request.resolve(data);
+            } else {
+                request.reject(new Error("Server returned " + header.code));
             }
-            error = new Error("Server returned " + header.code);
-        } finally {
-            release();
+        }
+    }
+
+    protected rejectAll(error: Error) {
+        this.error ??= error;
+        NicmClient.clients.delete(this);
+        for (const request of this.pending.values()) {
+            request.reject(error);
+        }
+        this.pending.clear();
+    }
+
+    protected async transact(request: NicmServeRequest): Promise<Buffer> {
+        if (this.error != null) {
+            throw this.error;
+        }
+
+        const id = this.nextId++;
+        const response = new Promise<Buffer>((resolve, reject) => {
+            this.pending.set(id, { resolve, reject });
+        });
+
+        // A request is written in one call, so concurrent requests are not interleaved
+        if (this.output.write(nicmServeRequestBuffer(request, id)) !== true) {
+            await waitDrain(this.output).catch((e) => this.rejectAll(e as Error));
         }
 
-        throw error;
+        return response;
     }
 
     public async info(): Promise<NicmInfo> {
@@ -177,39 +562,168 @@ export class NicmClient {
         return JSON.parse(data.toString("utf-8"));
     }
 
-    public async image(pts: number, opt: number): Promise<Buffer> {
-        const data = await this.transact(nicmServeRequest(NicmServeCommand.IMAGE, pts, 0, opt));
+    /**
+     * @param opt NicmImageSize | NicmImageFormat
+     * @param quality 0: default / PNG: 1 - 10 (compression level + 1) / JPEG, WebP: 1 - 100
+     */
+    public async image(pts: number, opt: number, quality: number = 0): Promise<Buffer> {
+        const data = await this.transact(nicmServeRequest(NicmServeCommand.IMAGE, pts, 0, opt, quality));
 
         return data;
     }
 
+    /**
+     * Get images of frames from startPts in one round trip.
+     * The result may be shorter than requested when the stream ends.
+     */
+    public async imageRange(startPts: number, opt: number, range: NicmServeImageRangeOptions): Promise<NicmServeImage[]> {
+        const data = await this.transact(nicmServeRequest(NicmServeCommand.IMAGE_RANGE,
+            startPts, range.count ?? 0, opt, range.stride ?? 1, range.end ?? startPts, range.quality ?? 0));
+
+        return nicmServeImageSequence(data);
+    }
+
+    protected openSharedMemory(): Promise<FileHandle> {
+        if (this.shm == null) {
+            this.shm = this.info().then((info) => {
+                if (info.shm == null) {
+                    throw new Error("Shared memory is not enabled");
+                }
+                return open(info.shm.path, "r");
+            });
+        }
+        return this.shm;
+    }
+
+    /**
+     * Get a raw frame through the shared memory instead of an encoded image.
+     * sizeOpt is the same as the lower 2 bits of the image option.
+     */
+    public async frame(pts: number, sizeOpt: number, format: NicmRawFormat = NicmRawFormat.RGBA): Promise<NicmRawFrame> {
+        const shm = await this.openSharedMemory();
+        const desc = await this.transact(nicmServeRequest(NicmServeCommand.FRAME, pts, 0, sizeOpt, format));
+
+        if (desc.length < NICM_SERVE_SHM_FRAME_SIZE) {
+            throw new Error("Invalid frame descriptor");
+        }
+        const field = (i: number) => Number(desc.readBigInt64LE(i * 8));
+        const slot = field(1), sequence = desc.readBigInt64LE(16), offset = field(3), size = field(4);
+
+        // Read the slot directly from the memory of nicm (the page cache of the memfd)
+        const data = Buffer.allocUnsafe(size);
+        await shm.read(data, 0, size, offset);
+
+        // The slot may have been reused while reading
+        const current = Buffer.alloc(8);
+        await shm.read(current, 0, 8, NICM_SHM_SEQUENCE_OFFSET + slot * 8);
+        if (current.readBigInt64LE(0) !== sequence) {
+            throw new Error("Frame was overwritten");
+        }
+
+        return {
+            pts: field(0),
+            width: field(5),
+            height: field(6),
+            linesize: field(7),
+            format: field(8),
+            data
+        };
+    }
+
     public async sceneDetect(pts: number, opt: number, maxFrames: number = 0, cutOffScore: number = 0): Promise<NicmServeSceneDetectResult> {
         const data = await this.transact(nicmServeRequest(NicmServeCommand.SCENE_DETECT, pts, opt, maxFrames, cutOffScore));
 
         return JSON.parse(data.toString("utf-8"));
     }
 
+    /**
+     * Counters and latencies of the input. Answered at once even while other requests are in progress.
+     */
+    public async stats(): Promise<NicmServeStats> {
+        const data = await this.transact(nicmServeRequest(NicmServeCommand.STATS));
+
+        return JSON.parse(data.toString("utf-8"));
+    }
+
+    /**
+     * Latest events of the decoder process in Chrome trace JSON (chrome://tracing, Perfetto)
+     */
+    public async trace(): Promise<{ traceEvents: { pid: number }[] }> {
+        const data = await this.transact(nicmServeRequest(NicmServeCommand.TRACE));
+
+        return JSON.parse(data.toString("utf-8"));
+    }
+
     public async quit() {
+        NicmClient.clients.delete(this);
         await this.transact(nicmServeRequest(NicmServeCommand.QUIT));
 
-        this.proc.stdin.end();
+        this.output.end();
+        if (this.shm != null) {
+            await this.shm.then((handle) => handle.close(), () => undefined);
+            this.shm = null;
+        }
     }
 }
 
+function waitReadable(stream: Readable): Promise<void> {
+    return new Promise((resolve) => {
+        const done = () => {
+            stream.off("readable", done);
+            stream.off("end", done);
+            resolve();
+        };
+        stream.on("readable", done);
+        stream.on("end", done);
+    });
+}
+
+function withTimeout<T>(promise: Promise<T>, timeout: number): Promise<T> {
+    let timer: NodeJS.Timeout;
+
+    return Promise.race([
+        promise,
+        new Promise<T>((_, reject) => {
+            timer = setTimeout(() => reject(new Error("Timed out")), timeout);
+        })
+    ]).finally(() => clearTimeout(timer));
+}
+
+// A closed stream never drains, so closing is an error here
+function waitDrain(stream: Writable): Promise<void> {
+    return new Promise((resolve, reject) => {
+        const done = (e?: Error) => {
+            stream.off("drain", done);
+            stream.off("close", done);
+            stream.off("error", done);
+            if (e instanceof Error) {
+                reject(e);
+            } else if (stream.destroyed) {
+                reject(new Error("Closed"));
+            } else {
+                resolve();
+            }
+        };
+        stream.on("drain", done);
+        stream.on("close", done);
+        stream.on("error", done);
+    });
+}
+
 async function readFromStream(stream: Readable, size: number): Promise<Buffer> {
     const buf = Buffer.alloc(size);
     let offset = 0;
 
     while (size > 0) {
-        await once(stream, "readable");
-
-        let chunk = stream.read(size);
+        // Responses may be already buffered when requests are pipelined
+        let chunk = stream.read(size) ?? stream.read();
 
         if (chunk == null) {
-            chunk = stream.read();
-            if (chunk == null) {
+            if (stream.readableEnded) {
                 throw new Error("Cannot read");
             }
+            await waitReadable(stream);
+            continue;
         }
         (chunk as Buffer).copy(buf, offset);
         offset += chunk.length;
@@ -0,0 +1,94 @@
+import fs from "fs/promises";
+
+// Binary frame index written by `nicm index -f bin` (see decoder/lib/indexwriter.h)
+
+const MAGIC = "NICMIB01";
+const VERSION = 1;
+const HEADER_SIZE = 32;
+
+export const FRAME_INDEX_FLAG_KEY = 1;
+// Presented before the keyframe of its GOP
+export const FRAME_INDEX_FLAG_LEADING = 2;
+
+export interface NicmFrameIndex {
+    stream: number;
+    timebase: { num: number, den: number };
+    // Columns in presentation order
+    pts: Float64Array;
+    pos: Float64Array;
+    flags: Uint8Array;
+}
+
+// PTS and positions fit in 53 bits, so the varints are decoded without bitwise operators
+function readZigzagVarint(buf: Buffer, offset: number): [number, number] {
+    let value = 0, scale = 1, byte;
+
+    do {
+        byte = buf[offset++];
+        value += (byte & 0x7f) * scale;
+        scale *= 128;
+    } while (byte & 0x80);
+
+    return [value % 2 === 0 ? value / 2 : -(value + 1) / 2, offset];
+}
+
+export function decodeFrameIndex(buf: Buffer): NicmFrameIndex {
+    if (buf.length < HEADER_SIZE || buf.toString("latin1", 0, 8) !== MAGIC) {
+        throw new Error("Not a binary frame index");
+    }
+    if (buf.readUInt32LE(8) !== VERSION) {
+        throw new Error(`Unsupported frame index version ${buf.readUInt32LE(8)}`);
+    }
+
+    // Count the frames first so that the columns are allocated once
+    let frames = 0, offset = HEADER_SIZE;
+    for (;;) {
+        const num = buf.readUInt32LE(offset), bytes = buf.readUInt32LE(offset + 4);
+
+        if (num === 0) {
+            break;
+        }
+        frames += num;
+        offset += 8 + bytes;
+    }
+
+    const index: NicmFrameIndex = {
+        stream: buf.readInt32LE(12),
+        timebase: { num: buf.readInt32LE(16), den: buf.readInt32LE(20) },
+        pts: new Float64Array(frames),
+        pos: new Float64Array(frames),
+        flags: new Uint8Array(frames),
+    };
+
+    let base = 0;
+    offset = HEADER_SIZE;
+    for (;;) {
+        const num = buf.readUInt32LE(offset);
+        let p = offset + 8, prev = 0, delta;
+
+        if (num === 0) {
+            break;
+        }
+        for (let i = 0; i < num; i++) {
+            [delta, p] = readZigzagVarint(buf, p);
+            prev += delta;
+            index.pts[base + i] = prev;
+        }
+        prev = 0;
+        for (let i = 0; i < num; i++) {
+            [delta, p] = readZigzagVarint(buf, p);
+            prev += delta;
+            index.pos[base + i] = prev;
+        }
+        index.flags.set(buf.subarray(p, p + num), base);
+
+        base += num;
+        offset += 8 + buf.readUInt32LE(offset + 4);
+    }
+
+    return index;
+}
+
+export async function readFrameIndex(path: string): Promise<NicmFrameIndex> {
+    return decodeFrameIndex(await fs.readFile(path));
+}